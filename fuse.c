@@ -1,284 +1,1007 @@
 #define FUSE_USE_VERSION 31
 
 #include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <linux/falloc.h>
 #include <math.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 
 #include "oncefs.h"
 
+// When writes are made durable
+#define DURABILITY_STRICT 0   // on every close and fsync
+#define DURABILITY_FSYNC 1    // on fsync only
+#define DURABILITY_PERIODIC 2 // on fsync, and in the background
+
+#define DURABILITY_XATTR "user.oncefs.durability"
+
+// Only declared by unistd.h for _GNU_SOURCE, which clashes with the splice option
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#define SEEK_HOLE 4
+#endif
+
+// Kernel inode numbers start at 1 for the root, which is node 0
+#define INODE(node) ((fuse_ino_t) (node) + 1)
+#define NODE(ino) ((uint32_t) ((ino) - 1))
+
+// Open files keep an oncefs_handle_t
+#define HANDLE(fi) ((oncefs_handle_t *) (fi)->fh)
+#define HANDLE_NODE(fi) ((uint32_t) HANDLE(fi)->node.node)
+
+// Directory offsets: "." and ".." come first, then each node by its identifier, so an
+// offset names the same entry however the directory changes around it
+#define COOKIE_DOT 1
+#define COOKIE_DOTDOT 2
+#define COOKIE(node) ((off_t) (node) + 3)
+
+// State of an open directory, so a listing resumes where the last batch ended
+typedef struct dir_handle {
+    off_t cookie; // of the last entry sent, or 0
+    char name[ONCEFS_NAME_MAX_SIZE + 1]; // of the last entry sent
+} dir_handle_t;
+
 io_t io;
 oncefs_t ofs;
 
-static void *do_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
-    (void) conn;
-    cfg->kernel_cache = 1;
-    // cfg->kernel_cache = 0;
+int durability = DURABILITY_STRICT;
+int flush_interval = 1000; // milliseconds between background flushes
+size_t flush_threshold = 64 << 20; // bytes written that trigger one early, or 0
+
+pthread_t flusher;
+pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t flush_wake = PTHREAD_COND_INITIALIZER;
+int flush_running = 0;
+size_t flush_pending = 0; // bytes written since the last background flush
+
+int single_writer = 0; // apply changes on one thread, see oncefs_start_writer
+
+// Seconds the kernel may cache names, attributes and missing names; as the only
+// writer, the mount invalidates what it changes behind the kernel's back
+double entry_timeout = 1.0;
+double attr_timeout = 1.0;
+double negative_timeout = 0.0;
+
+struct fuse_session *session;
+pthread_t notifier;
+pthread_mutex_t notice_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t notice_wake = PTHREAD_COND_INITIALIZER;
+int notice_running = 0;
+array_t notices; // of inodes whose attributes to drop, waiting to be sent
+
+// Connection tuning, requested in do_init
+unsigned max_transfer = 1 << 20; // bytes per read or write request
+unsigned max_background = 0; // background requests in flight, or 0 for the default
+int writeback = 0; // let the kernel cache writes and send them in large batches
+int splice = 0; // move request and reply data through pipes rather than copies
+
+/**
+ * Background thread flushing writes for the periodic durability mode.
+ */
+static void *do_flusher(void *arg) {
+    pthread_mutex_lock(&flush_lock);
+    while (flush_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += flush_interval / 1000;
+        deadline.tv_nsec += (flush_interval % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        while (flush_running &&
+               (flush_threshold == 0 || flush_pending < flush_threshold)) {
+            if (pthread_cond_timedwait(&flush_wake, &flush_lock, &deadline) != 0) {
+                break; // timed out
+            }
+        }
+
+        flush_pending = 0;
+
+        pthread_mutex_unlock(&flush_lock);
+        oncefs_sync(&ofs); // errors resurface on the next explicit fsync
+        pthread_mutex_lock(&flush_lock);
+    }
+    pthread_mutex_unlock(&flush_lock);
 
-    // Disable async read
-    conn->want &= ~(FUSE_CAP_ASYNC_READ);
     return NULL;
 }
 
-static int do_access(const char *path, int mask) {
-    int r;
+/**
+ * Queue an invalidation of the cached attributes of an inode, sent from its own
+ * thread since the kernel may still hold locks of the request that changed it.
+ */
+void do_notify(fuse_ino_t ino) {
+    pthread_mutex_lock(&notice_lock);
+    if (notice_running) {
+        array_append(&notices, &ino);
+        pthread_cond_signal(&notice_wake);
+    }
+    pthread_mutex_unlock(&notice_lock);
+}
 
-    oncefs_stat_t result;
-    r = oncefs_get_node(&ofs, path, &result);
-    if (r != 0) { return r; }
+/**
+ * Background thread sending queued invalidations to the kernel.
+ */
+static void *do_notifier(void *arg) {
+    int _send(void *raw) {
+        // Fails harmlessly for what the kernel no longer caches
+        fuse_lowlevel_notify_inval_inode(session, *(fuse_ino_t *) raw, -1, 0);
+        return 0;
+    }
 
-    return 0;
+    pthread_mutex_lock(&notice_lock);
+    while (notice_running) {
+        if (array_len(&notices) == 0) {
+            pthread_cond_wait(&notice_wake, &notice_lock);
+            continue;
+        }
+
+        // Take the whole queue, so requests can add to a fresh one meanwhile
+        array_t batch = notices;
+        array_init(&notices, sizeof(fuse_ino_t));
+
+        pthread_mutex_unlock(&notice_lock);
+        array_each(&batch, _send);
+        array_free(&batch);
+        pthread_mutex_lock(&notice_lock);
+    }
+    pthread_mutex_unlock(&notice_lock);
+
+    return NULL;
 }
 
-static int do_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
-    int r;
+/**
+ * Describe the durability mode in effect, as reported through DURABILITY_XATTR.
+ */
+int do_describe_durability(char *buffer, size_t size) {
+    if (durability == DURABILITY_FSYNC) {
+        return snprintf(buffer, size, "fsync");
+    } else if (durability == DURABILITY_PERIODIC) {
+        return snprintf(buffer, size, "periodic,%ims,%zuMiB", flush_interval,
+                        flush_threshold >> 20);
+    }
 
-    oncefs_stat_t result;
-    r = oncefs_get_node(&ofs, path, &result);
-    if (r != 0) { return r; }
+    return snprintf(buffer, size, "strict");
+}
 
-    oncefs_status_t status;
-    r = oncefs_get_status(&ofs, &status);
-    if (r != 0) { return r; }
+static void do_init(void *userdata, struct fuse_conn_info *conn) {
+    // The kernel caps transfers at what it supports; max_read must match the mount
+    conn->max_write = max_transfer;
+    conn->max_read = max_transfer;
+    conn->max_readahead = max_transfer;
+
+    if (max_background > 0) {
+        conn->max_background = max_background;
+        conn->congestion_threshold = max_background * 3 / 4;
+    }
+
+    if (writeback) {
+        conn->want |= conn->capable & FUSE_CAP_WRITEBACK_CACHE;
+    }
+
+    if (splice) {
+        conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE |
+                                       FUSE_CAP_SPLICE_MOVE);
+    }
+
+    // Always send attributes along with listings, so ls -l needs no lookup per entry
+    conn->want |= conn->capable & FUSE_CAP_READDIRPLUS;
+    conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
 
+    // Started here rather than in main, which may fork into the background first
+    notice_running = 1;
+    if (pthread_create(&notifier, NULL, do_notifier, NULL) != 0) {
+        notice_running = 0;
+    }
+
+    if (durability == DURABILITY_PERIODIC) {
+        flush_running = 1;
+        if (pthread_create(&flusher, NULL, do_flusher, NULL) != 0) {
+            flush_running = 0;
+            durability = DURABILITY_STRICT; // the guarantee reported must hold
+        }
+    }
+
+    // Without it, changes take the lock themselves
+    if (single_writer) { oncefs_start_writer(&ofs); }
+}
+
+static void do_destroy(void *userdata) {
+    if (flush_running) {
+        pthread_mutex_lock(&flush_lock);
+        flush_running = 0;
+        pthread_cond_signal(&flush_wake);
+        pthread_mutex_unlock(&flush_lock);
+
+        pthread_join(flusher, NULL);
+    }
+
+    if (notice_running) {
+        // The session is going away, so what is still queued no longer matters
+        pthread_mutex_lock(&notice_lock);
+        notice_running = 0;
+        pthread_cond_signal(&notice_wake);
+        pthread_mutex_unlock(&notice_lock);
+
+        pthread_join(notifier, NULL);
+        array_free(&notices);
+        array_init(&notices, sizeof(fuse_ino_t));
+    }
+
+    oncefs_stop_writer(&ofs);
+    oncefs_sync(&ofs);
+}
+
+void do_fill_attr(oncefs_stat_t *result, struct stat *stbuf) {
     memset(stbuf, 0, sizeof(struct stat)); // clear
-    if (result.is_file == 1) {
+    if (result->is_file == 1) {
         stbuf->st_mode = S_IFREG | 0644;
         stbuf->st_nlink = 1;
-        stbuf->st_size = result.size;
-        stbuf->st_blocks = ceil(result.size / 512); // number of 512 blocks by definition
-    } else if (result.is_dir) {
+        stbuf->st_size = result->size;
+        stbuf->st_blocks = ceil(result->size / 512); // number of 512 blocks by definition
+    } else if (result->is_dir) {
         stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_blocks = ceil(status.block_size / 512);
-    } else if (result.is_link) {
+        stbuf->st_blocks = ceil(ofs.block_size / 512);
+    } else if (result->is_link) {
         stbuf->st_mode = S_IFLNK | 0777;
-        stbuf->st_blocks = ceil(status.block_size / 512);
+        stbuf->st_blocks = ceil(ofs.block_size / 512);
     }
 
-    stbuf->st_ino = (ino_t) result.node;
+    stbuf->st_ino = INODE(result->node);
 
-    stbuf->st_atim.tv_sec = result.last_access;
-    stbuf->st_mtim.tv_sec = result.last_modification;
-    stbuf->st_ctim.tv_sec = result.last_access;
+    stbuf->st_atim.tv_sec = result->last_access;
+    stbuf->st_mtim.tv_sec = result->last_modification;
+    stbuf->st_ctim.tv_sec = result->last_access;
+}
 
-    return 0;
+/**
+ * Reply with a node found or created by name, which the kernel then holds on to.
+ */
+void do_reply_entry(fuse_req_t req, oncefs_stat_t *result, struct fuse_file_info *fi) {
+    struct fuse_entry_param entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.ino = INODE(result->node);
+    entry.attr_timeout = attr_timeout;
+    entry.entry_timeout = entry_timeout;
+    do_fill_attr(result, &entry.attr);
+
+    if (fi != NULL) {
+        fuse_reply_create(req, &entry, fi);
+    } else {
+        fuse_reply_entry(req, &entry);
+    }
 }
 
-static int do_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
-                      struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
-    int _callback(oncefs_node_t * result) {
-        filler(buf, result->name, NULL, 0, 0);
-        return 0;
+/**
+ * Reply with a node by identifier, or with the error getting it.
+ */
+void do_reply_node(fuse_req_t req, int r, uint32_t node) {
+    oncefs_stat_t result;
+    if (r == 0) { r = oncefs_get_node_id(&ofs, node, &result); }
+    if (r != 0) {
+        fuse_reply_err(req, -r);
+        return;
     }
 
+    do_reply_entry(req, &result, NULL);
+}
+
+static void do_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
     int r;
-    r = oncefs_get_dir(&ofs, path, _callback);
+
+    oncefs_stat_t result;
+    r = oncefs_lookup(&ofs, NODE(parent), name, &result);
+    if (r == -ENOENT && negative_timeout > 0) {
+        // Let the kernel remember the name is missing
+        struct fuse_entry_param entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.entry_timeout = negative_timeout;
+        fuse_reply_entry(req, &entry);
+        return;
+    } else if (r != 0) {
+        fuse_reply_err(req, -r);
+        return;
+    }
+
+    do_reply_entry(req, &result, NULL);
+}
+
+// Nodes stay valid until they are deleted, so there is nothing to release
+static void do_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+    fuse_reply_none(req);
+}
+
+static void do_forget_multi(fuse_req_t req, size_t count,
+                            struct fuse_forget_data *forgets) {
+    fuse_reply_none(req);
+}
+
+static void do_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+    oncefs_stat_t result;
+    fuse_reply_err(req, -oncefs_get_node_id(&ofs, NODE(ino), &result));
+}
+
+static void do_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    int r;
+
+    // The kernel only passes open regular files
+    oncefs_stat_t result;
+    if (fi != NULL) {
+        r = oncefs_handle_stat(&ofs, HANDLE(fi), &result);
+    } else {
+        r = oncefs_get_node_id(&ofs, NODE(ino), &result);
+    }
     if (r != 0) {
-        filler(buf, ".", NULL, 0, 0);
-        filler(buf, "..", NULL, 0, 0);
+        fuse_reply_err(req, -r);
+        return;
     }
 
-    return r;
+    struct stat stbuf;
+    do_fill_attr(&result, &stbuf);
+    fuse_reply_attr(req, &stbuf, attr_timeout);
+}
+
+static void do_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+                       struct fuse_file_info *fi) {
+    int r = 0;
+
+    // Modes and owners are not stored
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        r = oncefs_del_data(&ofs, NODE(ino), attr->st_size);
+    }
+
+    if (r == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+        time_t now = time(NULL);
+        time_t last_access = (to_set & FUSE_SET_ATTR_ATIME_NOW) ? now : attr->st_atime;
+        time_t last_modification = (to_set & FUSE_SET_ATTR_MTIME_NOW) ? now
+                                                                        : attr->st_mtime;
+        r = oncefs_set_time_id(&ofs, NODE(ino), last_access, last_modification);
+    }
+
+    if (r == 0) { do_getattr(req, ino, NULL); } // fi may be an open directory
+    else { fuse_reply_err(req, -r); }
+}
+
+static void do_readlink(fuse_req_t req, fuse_ino_t ino) {
+    int r;
+
+    oncefs_node_t result;
+    r = oncefs_get_link_id(&ofs, NODE(ino), &result);
+    if (r != 0) {
+        fuse_reply_err(req, -r);
+        return;
+    }
+
+    fuse_reply_readlink(req, result.name);
 }
 
-static int do_mkdir(const char *path, mode_t mode) {
-    return oncefs_set_dir(&ofs, path);
+static void do_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                     mode_t mode) {
+    uint32_t node;
+    int r = oncefs_set_dir_at(&ofs, NODE(parent), name, &node);
+    do_reply_node(req, r, node);
 }
 
-static int do_open(const char *path, struct fuse_file_info *fi) {
+static void do_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+                       const char *name) {
+    uint32_t node;
+    int r = oncefs_set_link_at(&ofs, NODE(parent), name, link, &node);
+    do_reply_node(req, r, node);
+}
+
+static void do_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
     int r;
+    r = oncefs_del_node_at(&ofs, NODE(parent), name);
 
-    oncefs_stat_t stat;
+    fuse_reply_err(req, -r);
+}
 
-    int mode = fi->flags & O_ACCMODE;
-    if (mode == O_RDONLY) {
-        r = oncefs_get_node(&ofs, path, &stat);
-        if (r != 0) { return r; }
+static void do_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      fuse_ino_t newparent, const char *newname, unsigned int flags) {
+    if (flags) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
 
-        if (!stat.is_file) { return -EINVAL; }
+    int r;
+    r = oncefs_move_node_at(&ofs, NODE(parent), name, NODE(newparent), newname);
 
-        fi->fh = stat.node;
+    fuse_reply_err(req, -r);
+}
 
-        return 0;
-    } else if (mode == O_WRONLY || mode == O_RDWR) {
-        // Fetch existing node id
-        r = oncefs_get_node(&ofs, path, &stat);
-        if (r == -ENOENT) {
-            if((fi->flags & O_CREAT) == 0) {
-                return -ENOENT;
-            }
+/**
+ * Prepare a file for access, truncating it unless it is opened for appending.
+ */
+int do_prepare(uint32_t node, struct fuse_file_info *fi) {
+    int r;
 
-            // Create a new node TODO assuming is file
-            r = oncefs_set_file(&ofs, path);
-            if (r != 0) { return r; }
+    oncefs_stat_t stat;
+    r = oncefs_get_node_id(&ofs, node, &stat);
+    if (r != 0) { return r; }
 
-            // Fetch the new node id
-            r = oncefs_get_node(&ofs, path, &stat);
-            if (r != 0) { return r; }
-        } else if (stat.is_file != 1) {
-            return -EINVAL;
-        } else if ((fi->flags & O_APPEND) == 0) {
+    if (stat.is_file != 1) { return -EINVAL; }
+
+    int truncated = 0;
+    int mode = fi->flags & O_ACCMODE;
+    if (mode == O_WRONLY || mode == O_RDWR) {
+        // With writeback caching the kernel keeps the size itself, and truncates
+        // through setattr on O_TRUNC only
+        if ((fi->flags & O_APPEND) == 0 && !writeback) {
             // Delete existing and re-use node id
-            r = oncefs_del_data(&ofs, stat.node, 0);
+            r = oncefs_del_data(&ofs, node, 0);
             if (r != 0) { return r; }
+            truncated = 1;
+
+            // Unlike O_TRUNC, this is not something the kernel knows about
+            do_notify(INODE(node));
         }
+    } else if (mode != O_RDONLY) {
+        return -ENOSYS;
+    }
 
-        fi->fh = stat.node;
+    oncefs_handle_t *handle = malloc(sizeof(oncefs_handle_t));
+    if (handle == NULL) { return -ENOMEM; }
 
-        return 0;
+    r = oncefs_open(&ofs, node, handle);
+    if (r != 0) {
+        free(handle);
+        return r;
     }
 
-    return -ENOSYS;
+    fi->fh = (uint64_t) handle;
+    fi->keep_cache = !truncated; // cached pages of the old contents are stale
+
+    return 0;
+}
+
+/**
+ * Release the state of a file prepared by do_prepare.
+ */
+void do_close(struct fuse_file_info *fi) {
+    oncefs_close(HANDLE(fi));
+    free(HANDLE(fi));
+    fi->fh = 0;
 }
 
-static int do_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
-    int r = do_open(path, fi);
-    if (r < 0) { return r; }
+static void do_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    int r;
 
-    return 0;
+    r = do_prepare(NODE(ino), fi);
+    if (r != 0) {
+        fuse_reply_err(req, -r);
+        return;
+    }
+
+    fuse_reply_open(req, fi);
 }
 
-static int do_read(const char *path, char *buf, size_t size, off_t offset,
-                   struct fuse_file_info *fi) {
-    if (fi->fh <= 0) { return -EINVAL; }
+static void do_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                      struct fuse_file_info *fi) {
+    int r;
+
+    oncefs_stat_t result;
+    r = oncefs_lookup(&ofs, NODE(parent), name, &result);
+    if (r == -ENOENT) {
+        // Create a new node TODO assuming is file
+        uint32_t node;
+        r = oncefs_set_file_at(&ofs, NODE(parent), name, &node);
+        if (r == 0) { r = oncefs_get_node_id(&ofs, node, &result); }
+    } else if (r == 0 && (fi->flags & O_EXCL)) {
+        r = -EEXIST;
+    }
 
+    if (r == 0) { r = do_prepare(result.node, fi); }
+    if (r != 0) {
+        fuse_reply_err(req, -r);
+        return;
+    }
+
+    r = oncefs_handle_stat(&ofs, HANDLE(fi), &result);
+    if (r != 0) {
+        do_close(fi);
+        fuse_reply_err(req, -r);
+        return;
+    }
+
+    do_reply_entry(req, &result, fi);
+}
+
+/**
+ * Reply to a read with the container's own bytes, spliced from its descriptor or
+ * taken from its mapping, rather than copies.
+ *
+ * Returns:
+ *     0 once replied, otherwise an errno code if the backend can't be read this way.
+ */
+int do_read_direct(fuse_req_t req, oncefs_handle_t *handle, size_t size, off_t offset) {
     int r;
-    r = oncefs_get_data(&ofs, fi->fh, buf, size, offset);
-    if (r != 0) { return r; }
 
-    return size;
+    char *zeros = NULL;
+    struct fuse_bufvec *bufv = NULL;
+
+    int _reply(oncefs_extent_t *extents, size_t count) {
+        bufv = malloc(sizeof(struct fuse_bufvec) + count * sizeof(struct fuse_buf));
+        if (bufv == NULL) { return -ENOMEM; }
+        *bufv = (struct fuse_bufvec) {.count = 0, .idx = 0, .off = 0};
+
+        for (size_t i = 0; i < count; i++) {
+            oncefs_extent_t *extent = &extents[i];
+            struct fuse_buf buf = {.size = extent->size, .fd = -1};
+
+            int fh;
+            off_t position;
+            const void *data;
+            if (extent->hole) {
+                // Holes are never larger than the read
+                if (zeros == NULL) { zeros = calloc(1, size); }
+                if (zeros == NULL) { return -ENOMEM; }
+                buf.mem = zeros;
+            } else if (io_locate(&io, extent->block, ofs.overhead_size + extent->skip,
+                                 &fh, &position) == 0) {
+                buf.flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+                buf.fd = fh;
+                buf.pos = position;
+            } else if (io_peek(&io, extent->block, ofs.overhead_size + extent->skip,
+                               &data) == 0) {
+                buf.mem = (void *) data;
+            } else {
+                return -ENOTSUP;
+            }
+
+            // Neighbouring payloads, like those behind a header table, go as one
+            if (bufv->count > 0 && !extent->hole) {
+                struct fuse_buf *last = &bufv->buf[bufv->count - 1];
+                int follows = (buf.fd >= 0)
+                    ? last->fd == buf.fd && last->pos + last->size == buf.pos
+                    : last->mem != zeros && (char *) last->mem + last->size == buf.mem;
+                if (last->flags == buf.flags && follows) {
+                    last->size += buf.size;
+                    continue;
+                }
+            }
+
+            bufv->buf[bufv->count++] = buf;
+        }
+
+        // The blocks may be reused once the lock is released, so reply under it
+        fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+        return 0;
+    }
+
+    r = oncefs_handle_get_extents(&ofs, handle, size, offset, _reply);
+
+    free(bufv);
+    free(zeros);
+
+    return r;
 }
 
-static int do_write(const char *path, const char *buf, size_t size, off_t offset,
+static void do_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
                     struct fuse_file_info *fi) {
-    if (fi->fh <= 0) { return -EINVAL; }
-
     int r;
-    r = oncefs_set_data(&ofs, fi->fh, buf, size, offset);
-    if (r != 0) { return r; }
 
-    return size;
+    r = do_read_direct(req, HANDLE(fi), size, offset);
+    if (r == 0) { return; }
+    if (r != -ENOTSUP) {
+        fuse_reply_err(req, -r);
+        return;
+    }
+
+    char *buf = malloc(size);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    // Bytes up to the end of the data found, so reads past the end are empty
+    r = oncefs_handle_get_data(&ofs, HANDLE(fi), buf, size, offset);
+    if (r < 0) {
+        fuse_reply_err(req, -r);
+    } else {
+        fuse_reply_buf(req, buf, r);
+    }
+
+    free(buf);
 }
 
-static int do_symlink(const char *to, const char *from) {
-    return oncefs_set_link(&ofs, from, to);
+/**
+ * Reply to a write, waking the background flush once enough has been written.
+ */
+void do_reply_write(fuse_req_t req, size_t size) {
+    if (durability == DURABILITY_PERIODIC && flush_threshold > 0) {
+        pthread_mutex_lock(&flush_lock);
+        flush_pending += size;
+        if (flush_pending >= flush_threshold) { pthread_cond_signal(&flush_wake); }
+        pthread_mutex_unlock(&flush_lock);
+    }
+
+    fuse_reply_write(req, size);
 }
 
-static int do_readlink(const char *path, char *buf, size_t size) {
+static void do_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+                     off_t offset, struct fuse_file_info *fi) {
     int r;
-    oncefs_node_t result;
-    r = oncefs_get_link(&ofs, path, &result);
-    if (r != 0) { return r; }
+    r = oncefs_handle_set_data(&ofs, HANDLE(fi), buf, size, offset);
+    if (r != 0) {
+        fuse_reply_err(req, -r);
+        return;
+    }
+
+    do_reply_write(req, size);
+}
 
-    strncpy(buf, result.name, size);
+/**
+ * Write incoming buffers into the payloads of new blocks, spliced from the request
+ * pipe where libfuse received one, or copied once from its memory.
+ */
+static void do_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+                         off_t offset, struct fuse_file_info *fi) {
+    int r;
 
-    return 0;
+    size_t size = fuse_buf_size(bufv);
+
+    int _place(uint32_t block, int offset, size_t amount) {
+        int r;
+
+        int fh;
+        off_t position;
+        r = io_locate(&io, block, offset, &fh, &position);
+        if (r != 0) { return r; }
+
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(amount);
+        dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+        dst.buf[0].fd = fh;
+        dst.buf[0].pos = position;
+
+        // Advances through the source, so each call takes the next part
+        ssize_t copied = fuse_buf_copy(&dst, bufv, FUSE_BUF_SPLICE_MOVE);
+        if (copied < 0) { return copied; }
+        if (copied != amount) { return -EIO; }
+
+        return 0;
+    }
+
+    // Nothing is placed before the backend is known to allow it
+    int fh;
+    off_t position;
+    r = io_locate(&io, io_block_first(&io), 0, &fh, &position);
+    if (r == 0) {
+        r = oncefs_set_data_in_place(&ofs, HANDLE_NODE(fi), size, offset, _place);
+    }
+
+    if (r == -ENOTSUP) {
+        char *buf = malloc(size);
+        if (buf == NULL) {
+            fuse_reply_err(req, ENOMEM);
+            return;
+        }
+
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+        dst.buf[0].mem = buf;
+        ssize_t copied = fuse_buf_copy(&dst, bufv, 0);
+
+        r = (copied < 0) ? copied
+                         : oncefs_handle_set_data(&ofs, HANDLE(fi), buf, copied, offset);
+        size = copied;
+        free(buf);
+    }
+
+    if (r != 0) {
+        fuse_reply_err(req, -r);
+        return;
+    }
+
+    do_reply_write(req, size);
 }
 
-static int do_unlink(const char *path) {
-    return oncefs_del_node(&ofs, path);
+static void do_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+                         off_t length, struct fuse_file_info *fi) {
+    // Ranges are only checked to fit, not punched out or shifted
+    if (mode & ~FALLOC_FL_KEEP_SIZE) {
+        fuse_reply_err(req, EOPNOTSUPP);
+        return;
+    }
+
+    fuse_reply_err(req, -oncefs_allocate(&ofs, HANDLE_NODE(fi), length, offset,
+                                         mode & FALLOC_FL_KEEP_SIZE));
 }
 
-static int do_rename(const char *from, const char *to, unsigned int flags) {
-    if (flags) { return -EINVAL; }
-    return oncefs_move_node(&ofs, from, to);
+static void do_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in,
+                               struct fuse_file_info *fi_in, fuse_ino_t ino_out,
+                               off_t off_out, struct fuse_file_info *fi_out, size_t len,
+                               int flags) {
+    int r;
+
+    if (flags != 0) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    size_t copied;
+    r = oncefs_copy_data(&ofs, HANDLE_NODE(fi_in), off_in, HANDLE_NODE(fi_out), off_out,
+                         len, &copied);
+    if (r != 0) {
+        fuse_reply_err(req, -r);
+        return;
+    }
+
+    do_reply_write(req, copied);
 }
 
-int do_sync(const char *path, int isdatasync, struct fuse_file_info *fi) {
-    return oncefs_sync(&ofs);
+static void do_lseek(fuse_req_t req, fuse_ino_t ino, off_t offset, int whence,
+                     struct fuse_file_info *fi) {
+    int r;
+
+    // The kernel handles the other kinds of seek itself
+    if ((whence != SEEK_DATA && whence != SEEK_HOLE) || offset < 0) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    uint64_t result;
+    r = oncefs_seek(&ofs, HANDLE_NODE(fi), offset, whence == SEEK_HOLE, &result);
+    if (r != 0) {
+        fuse_reply_err(req, -r);
+        return;
+    }
+
+    fuse_reply_lseek(req, result);
 }
 
-int do_flush(const char *path, struct fuse_file_info *fi) {
-    return oncefs_sync(&ofs);
+static void do_sync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                    struct fuse_file_info *fi) {
+    fuse_reply_err(req, -oncefs_sync(&ofs));
 }
 
-static int do_chmod(const char *path, mode_t mode, struct fuse_file_info *fi) {
-    return 0;
+static void do_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (durability != DURABILITY_STRICT) {
+        fuse_reply_err(req, 0);
+        return;
+    }
+
+    fuse_reply_err(req, -oncefs_sync(&ofs));
 }
 
-static int do_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi) {
-    return 0;
+static void do_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    do_close(fi);
+    fuse_reply_err(req, 0);
 }
 
-static int do_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
-    if (fi->fh <= 0) { return -EINVAL; }
-    return oncefs_del_data(&ofs, fi->fh, size);
+static void do_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    int r;
+
+    oncefs_stat_t result;
+    r = oncefs_get_node_id(&ofs, NODE(ino), &result);
+    if (r == 0 && !result.is_dir) { r = -ENOTDIR; }
+    if (r != 0) {
+        fuse_reply_err(req, -r);
+        return;
+    }
+
+    dir_handle_t *handle = calloc(1, sizeof(dir_handle_t));
+    if (handle == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    fi->fh = (uint64_t) handle;
+    fuse_reply_open(req, fi);
 }
 
-static int do_utimens(const char *path, const struct timespec ts[2], struct fuse_file_info *fi) {
+static void do_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    free((dir_handle_t *) fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+/**
+ * List a directory from an offset, with the attributes of each entry if plus is set.
+ */
+void do_list(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+             struct fuse_file_info *fi, int plus) {
     int r;
-    r = oncefs_set_time(&ofs, path, ts[0].tv_sec, ts[1].tv_sec);
-    if(r != 0) { return r; }
 
-	return 0;
+    dir_handle_t *handle = (dir_handle_t *) fi->fh;
+
+    char *buf = malloc(size);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    size_t fill = 0;
+
+    // Returns 1 once the buffer is full
+    int _add(const char *name, off_t cookie, uint32_t node, mode_t type,
+             oncefs_stat_t *stat) {
+        size_t needed;
+        if (plus) {
+            struct fuse_entry_param entry;
+            memset(&entry, 0, sizeof(entry));
+            entry.attr.st_ino = INODE(node);
+            entry.attr.st_mode = type;
+            if (stat != NULL) {
+                entry.ino = INODE(node);
+                entry.attr_timeout = attr_timeout;
+                entry.entry_timeout = entry_timeout;
+                do_fill_attr(stat, &entry.attr);
+            }
+            needed = fuse_add_direntry_plus(req, buf + fill, size - fill, name, &entry,
+                                            cookie);
+        } else {
+            struct stat stbuf = {.st_ino = INODE(node), .st_mode = type};
+            needed = fuse_add_direntry(req, buf + fill, size - fill, name, &stbuf,
+                                       cookie);
+        }
+        if (needed > size - fill) { return 1; }
+
+        fill += needed;
+        return 0;
+    }
+
+    // An offset other than the last one sent, after a seek, is found by scanning
+    const char *after = NULL;
+    int seeking = 0;
+    if (offset > COOKIE_DOTDOT) {
+        if (offset == handle->cookie) {
+            after = handle->name;
+        } else {
+            seeking = 1;
+        }
+    }
+
+    int _callback(oncefs_node_t *entry, oncefs_stat_t *stat) {
+        if (seeking) {
+            seeking = COOKIE(entry->node) != offset;
+            return 0;
+        }
+
+        mode_t type = S_IFREG;
+        if (entry->type == NODE_TYPE_DIR) { type = S_IFDIR; }
+        else if (entry->type == NODE_TYPE_LINK) { type = S_IFLNK; }
+
+        if (_add(entry->name, COOKIE(entry->node), entry->node, type, stat)) {
+            return 1;
+        }
+
+        handle->cookie = COOKIE(entry->node);
+        strcpy(handle->name, entry->name);
+        return 0;
+    }
+
+    int full = 0;
+    if (offset < COOKIE_DOT) {
+        full = _add(".", COOKIE_DOT, NODE(ino), S_IFDIR, NULL);
+    }
+    if (!full && offset < COOKIE_DOTDOT) {
+        // The kernel fills in the parent itself
+        full = _add("..", COOKIE_DOTDOT, NODE(ino), S_IFDIR, NULL);
+    }
+
+    r = 0;
+    if (!full) {
+        r = oncefs_get_dir_after(&ofs, NODE(ino), after, plus, _callback);
+    }
+
+    if (r != 0) {
+        fuse_reply_err(req, -r);
+    } else {
+        fuse_reply_buf(req, buf, fill);
+    }
+
+    free(buf);
+}
+
+static void do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                       struct fuse_file_info *fi) {
+    do_list(req, ino, size, offset, fi, 0);
+}
+
+static void do_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                           struct fuse_file_info *fi) {
+    do_list(req, ino, size, offset, fi, 1);
 }
 
-static int do_statfs(const char *path, struct statvfs *stbuf) {
+static void do_statfs(fuse_req_t req, fuse_ino_t ino) {
     int r;
     oncefs_status_t status;
     r = oncefs_get_status(&ofs, &status);
-    if(r != 0) { return r; }
+    if(r != 0) {
+        fuse_reply_err(req, -r);
+        return;
+    }
 
-    memset(stbuf, 0, sizeof(struct statvfs));
-    stbuf->f_bsize = (__fsword_t) status.block_size;
-    stbuf->f_blocks = (fsblkcnt_t) status.total_blocks;
-    stbuf->f_bfree = (fsblkcnt_t) status.free_blocks;
-    stbuf->f_bavail = (fsblkcnt_t) status.free_blocks;
-    stbuf->f_namemax = status.name_max_size;
+    struct statvfs stbuf;
+    memset(&stbuf, 0, sizeof(struct statvfs));
+    stbuf.f_bsize = (__fsword_t) status.block_size;
+    stbuf.f_blocks = (fsblkcnt_t) status.total_blocks;
+    stbuf.f_bfree = (fsblkcnt_t) status.free_blocks;
+    stbuf.f_bavail = (fsblkcnt_t) status.free_blocks;
+    stbuf.f_namemax = status.name_max_size;
 
-    return 0;
+    fuse_reply_statfs(req, &stbuf);
 }
 
-static int do_setxattr(const char *path, const char *name, const char *value,
-                       size_t size, int flags) {
-    return 0;
+/**
+ * Reply to a request for an extended attribute value or list.
+ */
+void do_reply_xattr(fuse_req_t req, const char *value, size_t length, size_t size) {
+    if (size == 0) {
+        fuse_reply_xattr(req, length); // asking for the size
+    } else if (size < length) {
+        fuse_reply_err(req, ERANGE);
+    } else {
+        fuse_reply_buf(req, value, length);
+    }
 }
 
-static int do_getxattr(const char *path, const char *name, char *value, size_t size) {
-    return 0;
+static void do_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                        const char *value, size_t size, int flags) {
+    fuse_reply_err(req, 0);
 }
 
-static int do_listxattr(const char *path, char *list, size_t size) {
-    return 0;
+static void do_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
+    if (strcmp(name, DURABILITY_XATTR) != 0) {
+        fuse_reply_err(req, ENODATA);
+        return;
+    }
+
+    char buffer[64];
+    int length = do_describe_durability(buffer, sizeof(buffer));
+    do_reply_xattr(req, buffer, length, size);
 }
 
-static int do_removexattr(const char *path, const char *name) {
-    return 0;
+static void do_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+    do_reply_xattr(req, DURABILITY_XATTR, sizeof(DURABILITY_XATTR), size); // with \0
+}
+
+static void do_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name) {
+    fuse_reply_err(req, 0);
 }
 
-static const struct fuse_operations do_oper = {
+static const struct fuse_lowlevel_ops do_oper = {
     .init = do_init,
+    .destroy = do_destroy,
+    .lookup = do_lookup,
+    .forget = do_forget,
+    .forget_multi = do_forget_multi,
     .access = do_access,
     .getattr = do_getattr,
-    .readdir = do_readdir,
+    .setattr = do_setattr,
+    .readlink = do_readlink,
     .mkdir = do_mkdir,
-    .open = do_open,
-    .create = do_create,
-    .read = do_read,
-    .write = do_write,
     .symlink = do_symlink,
-    .readlink = do_readlink,
-    .truncate = do_truncate,
     .unlink = do_unlink,
     .rmdir = do_unlink,
     .rename = do_rename,
+    .open = do_open,
+    .create = do_create,
+    .read = do_read,
+    .write = do_write,
+    .write_buf = do_write_buf,
+    .fallocate = do_fallocate,
+    .copy_file_range = do_copy_file_range,
+    .lseek = do_lseek,
     //
     .fsync = do_sync,
     .flush = do_flush,
+    .release = do_release,
     //
-    // For setattr
-    .chmod = do_chmod,
-    .chown = do_chown,
-    .truncate = do_truncate,
-    .utimens = do_utimens,
-    // End for setattr
+    .opendir = do_opendir,
+    .readdir = do_readdir,
+    .readdirplus = do_readdirplus,
+    .releasedir = do_releasedir,
     .statfs = do_statfs,
-    // .release	= xmp_release,
     .setxattr = do_setxattr,
     .getxattr = do_getxattr,
     .listxattr = do_listxattr,
@@ -290,29 +1013,179 @@ int do_help(const char *name) {
     printf("Usage: %s [options] <file> <directory>\n\n", name);
     printf("Pass \":memory:\" in place of a file path to use RAM instead.\n\n");
     printf("Options:\n"
-           "    --help    Show this info.\n"
-           "    --format  Format (wipe) container.\n"
+           "    --help          Show this info.\n"
+           "    --format        Format (wipe) container.\n"
+           "    --mmap          Access the container through a memory mapping.\n"
+           "    --uring         Batch container access through io_uring.\n"
+           "    --direct        Bypass the page cache (O_DIRECT); implies 4 KiB blocks.\n"
+           "    --split-headers Keep block headers apart from aligned payloads.\n"
+           "    --simulate=<read us>,<write us>,<sync us>,<MiB/s>\n"
+           "                    Slow container access down to behave like a given device.\n"
+           "    --block-size=<bytes>\n"
+           "                    Block size; must match the size used when formatting.\n"
+           "    --memory=<MiB>  Limit index memory; the rest is spilled to disk.\n"
+           "    --spill=<dir>   Directory for spilled index pages (default: the container's\n"
+           "                    directory).\n"
+           "    --discard[=<blocks>]\n"
+           "                    Release freed blocks to storage (punch holes, or TRIM on\n"
+           "                    block devices), at most <blocks> per sync (default: 4096).\n"
+           "    --durability=strict|fsync|periodic[,<ms>[,<MiB>]]\n"
+           "                    When writes are made durable: on every close and fsync\n"
+           "                    (strict, default), on fsync only, or also in the\n"
+           "                    background every <ms> (default: 1000) or after <MiB>\n"
+           "                    written (default: 64; 0 for time only). The mode in\n"
+           "                    effect is reported in the " DURABILITY_XATTR " xattr.\n"
+           "    --sync-window=<us>\n"
+           "                    Delay each flush so concurrent fsyncs can share it.\n"
+           "    --writer        Apply all changes on one thread, in batches, while\n"
+           "                    lookups and reads run in parallel.\n"
+           "    --writeback     Let the kernel cache writes and flush them in batches.\n"
+           "    --splice        Move data between the kernel and the mount through pipes.\n"
+           "    --max-io=<KiB>  Largest read or write request to ask for (default: 1024).\n"
+           "    --max-background=<requests>\n"
+           "                    Background requests, like readahead, kept in flight.\n"
+           "    --entry-timeout=<s>, --attr-timeout=<s>, --negative-timeout=<s>\n"
+           "                    How long the kernel may cache names, attributes and\n"
+           "                    missing names (default: 1, 1, 0). Changes it cannot\n"
+           "                    see are invalidated, so these can be long.\n"
+           "    --stats         Print write amplification and I/O statistics on unmount\n"
+           "                    (with -f, so the output is not discarded).\n"
+           "    --migrate=<file>\n"
+           "                    Copy the container into <file> using the current format,\n"
+           "                    then exit. <file> must already exist and is formatted.\n"
            "\n");
 
     return 1;
 }
 
+void do_stats() {
+    oncefs_dump_amplification(&ofs);
+
+    io_stats_t stats;
+    io_get_stats(&io, &stats);
+
+    printf("\n  io\n");
+    printf("+-------+------------+--------------+----------+----------+\n");
+    printf("| op    |      calls |        bytes | p50 (us) | p99 (us) |\n");
+    printf("+-------+------------+--------------+----------+----------+\n");
+    printf("| read  | %10lu | %12lu | %8lu | %8lu |\n", stats.reads, stats.bytes_read,
+           io_histogram_percentile(stats.read_latency, 0.5),
+           io_histogram_percentile(stats.read_latency, 0.99));
+    printf("| write | %10lu | %12lu | %8lu | %8lu |\n", stats.writes, stats.bytes_written,
+           io_histogram_percentile(stats.write_latency, 0.5),
+           io_histogram_percentile(stats.write_latency, 0.99));
+    printf("| fsync | %10lu | %12s | %8s | %8s |\n", stats.sync_requests, "", "", "");
+    printf("| flush | %10lu | %12s | %8lu | %8lu |\n", stats.syncs, "",
+           io_histogram_percentile(stats.sync_latency, 0.5),
+           io_histogram_percentile(stats.sync_latency, 0.99));
+    printf("+-------+------------+--------------+----------+----------+\n");
+}
+
 int main(int argc, char *argv[]) {
     int r;
 
     // Custom config
     int format = 0;
+    int backend = IO_BACKEND_DEFAULT;
+    int direct = 0;
+    int split = 0;
+    io_sim_config_t sim = {0};
+    int block_size = 0;
     char *container = NULL;
+    char *migrate = NULL;
+    int stats = 0;
+    int sync_window = 0;
+    oncefs_config_t ofs_config = {.spill_path = NULL, .memory_budget = 0};
 
     // Parse to filter out custom args
     int argc_new = 0; // skip command
-    char *argv_new[argc];
+    char *argv_new[argc + 1];
     for(int i=0;i<argc;i++) { // skip command
         if(i != 0) {
             // All args but first
             if(strcmp(argv[i], "--format") == 0) {
                 format = 1;
                 continue;
+            } else if(strcmp(argv[i], "--mmap") == 0) {
+                backend = IO_BACKEND_MMAP;
+                continue;
+            } else if(strcmp(argv[i], "--uring") == 0) {
+                backend = IO_BACKEND_URING;
+                continue;
+            } else if(strcmp(argv[i], "--direct") == 0) {
+                direct = 1;
+                continue;
+            } else if(strncmp(argv[i], "--simulate=", 11) == 0) {
+                backend = IO_BACKEND_SIM;
+                sscanf(argv[i] + 11, "%i,%i,%i,%zu", &sim.read_latency,
+                       &sim.write_latency, &sim.sync_latency, &sim.bandwidth);
+                sim.bandwidth <<= 20;
+                continue;
+            } else if(strcmp(argv[i], "--split-headers") == 0) {
+                split = 1;
+                continue;
+            } else if(strncmp(argv[i], "--block-size=", 13) == 0) {
+                block_size = atoi(argv[i] + 13);
+                continue;
+            } else if(strncmp(argv[i], "--memory=", 9) == 0) {
+                ofs_config.memory_budget = strtoul(argv[i] + 9, NULL, 10) << 20;
+                continue;
+            } else if(strncmp(argv[i], "--spill=", 8) == 0) {
+                ofs_config.spill_path = argv[i] + 8;
+                continue;
+            } else if(strcmp(argv[i], "--discard") == 0) {
+                ofs_config.discard_rate = 4096;
+                continue;
+            } else if(strncmp(argv[i], "--discard=", 10) == 0) {
+                ofs_config.discard_rate = strtoul(argv[i] + 10, NULL, 10);
+                continue;
+            } else if(strcmp(argv[i], "--durability=strict") == 0) {
+                durability = DURABILITY_STRICT;
+                continue;
+            } else if(strcmp(argv[i], "--durability=fsync") == 0) {
+                durability = DURABILITY_FSYNC;
+                continue;
+            } else if(strncmp(argv[i], "--durability=periodic", 21) == 0) {
+                durability = DURABILITY_PERIODIC;
+                size_t threshold = flush_threshold >> 20;
+                sscanf(argv[i] + 21, ",%i,%zu", &flush_interval, &threshold);
+                flush_threshold = threshold << 20;
+                if (flush_interval <= 0) { return do_help(argv[0]); }
+                continue;
+            } else if(strncmp(argv[i], "--sync-window=", 14) == 0) {
+                sync_window = atoi(argv[i] + 14);
+                continue;
+            } else if(strcmp(argv[i], "--writeback") == 0) {
+                writeback = 1;
+                continue;
+            } else if(strcmp(argv[i], "--splice") == 0) {
+                splice = 1;
+                continue;
+            } else if(strncmp(argv[i], "--max-io=", 9) == 0) {
+                max_transfer = strtoul(argv[i] + 9, NULL, 10) << 10;
+                if (max_transfer == 0) { return do_help(argv[0]); }
+                continue;
+            } else if(strncmp(argv[i], "--max-background=", 17) == 0) {
+                max_background = strtoul(argv[i] + 17, NULL, 10);
+                continue;
+            } else if(strncmp(argv[i], "--entry-timeout=", 16) == 0) {
+                entry_timeout = strtod(argv[i] + 16, NULL);
+                continue;
+            } else if(strncmp(argv[i], "--attr-timeout=", 15) == 0) {
+                attr_timeout = strtod(argv[i] + 15, NULL);
+                continue;
+            } else if(strncmp(argv[i], "--negative-timeout=", 19) == 0) {
+                negative_timeout = strtod(argv[i] + 19, NULL);
+                continue;
+            } else if(strcmp(argv[i], "--writer") == 0) {
+                single_writer = 1;
+                continue;
+            } else if(strcmp(argv[i], "--stats") == 0) {
+                stats = 1;
+                continue;
+            } else if(strncmp(argv[i], "--migrate=", 10) == 0) {
+                migrate = argv[i] + 10;
+                continue;
             } else if(strcmp(argv[i], "--help") == 0) {
                 return do_help(argv[0]);
             }
@@ -331,11 +1204,39 @@ int main(int argc, char *argv[]) {
         return do_help(argv[0]);
     }
 
+    // Spill next to the container; /tmp is often memory backed, which would save nothing
+    char spill_path[PATH_MAX];
+    if(ofs_config.spill_path == NULL) {
+        snprintf(spill_path, sizeof(spill_path), "%s", container);
+        ofs_config.spill_path = dirname(spill_path);
+    }
+
+    // Reads are only as large as the mount allows
+    char max_read[32];
+    snprintf(max_read, sizeof(max_read), "-omax_read=%u", max_transfer);
+    argv_new[argc_new++] = max_read;
+
     // Startup
 
+    int header_size = split ? ONCEFS_OVERHEAD_SIZE : 0;
+    int block_size_given = block_size != 0;
+
+    if(block_size == 0) {
+        // Direct access needs whole pages; otherwise fit 1 KiB of payload per block
+        block_size = direct ? IO_DIRECT_ALIGNMENT : 1024 + ONCEFS_OVERHEAD_SIZE;
+        if(split && direct) {
+            block_size = header_size + IO_DIRECT_ALIGNMENT;
+        }
+    }
+
     io_config_t config = {
         .path = container,
-        .block_size = 1024 + ONCEFS_OVERHEAD_SIZE
+        .block_size = block_size,
+        .backend = backend,
+        .direct = direct,
+        .header_size = header_size,
+        .sim = sim,
+        .sync_window = sync_window
     };
 
     r = io_init(&io, &config);
@@ -344,20 +1245,106 @@ int main(int argc, char *argv[]) {
         return -r;
     }
 
-    r = oncefs_init(&ofs, &io, format);
+    if(!format) {
+        // Reopen with the geometry the container was formatted with
+        oncefs_super_t super;
+        r = oncefs_probe(&io, &super);
+        if(r == 0 && (super.block_size != config.block_size ||
+                      super.header_size != config.header_size)) {
+            config.block_size = super.block_size;
+            config.header_size = super.header_size;
+        } else if(r == -ENOENT && !block_size_given && !direct) {
+            // Earlier versions had no superblock and larger record headers
+            config.block_size = 1024 + ONCEFS_LEGACY_OVERHEAD_SIZE;
+        }
+
+        if(config.block_size != io_block_size(&io) || config.header_size != header_size) {
+            io_close(&io);
+            r = io_init(&io, &config);
+            if(r != 0) {
+                printf("Error %i: %s\n", -r, strerror(-r));
+                return -r;
+            }
+        }
+    }
+
+    r = oncefs_init2(&ofs, &io, format, &ofs_config);
     if (r != 0) {
         printf("Error %i: %s\n", -r, strerror(-r));
         return -r;
     }
 
+    if(migrate != NULL) {
+        io_t target;
+        config.path = migrate;
+        config.header_size = header_size;
+
+        r = io_init(&target, &config);
+        if(r == 0) {
+            r = oncefs_migrate(&ofs, &target);
+            io_close(&target);
+        }
+
+        oncefs_free(&ofs);
+        io_close(&io);
+
+        if(r != 0) {
+            printf("Error %i: %s\n", -r, strerror(-r));
+            return -r;
+        }
+        return 0;
+    }
+
     // Pass to fuse
 
     // oncefs_dump(&ofs);
 
-    r = fuse_main(argc_new, argv_new, &do_oper, NULL);
-    if(r != 0) {
+    array_init(&notices, sizeof(fuse_ino_t));
+
+    struct fuse_args args = FUSE_ARGS_INIT(argc_new, argv_new);
+    struct fuse_cmdline_opts opts;
+    if(fuse_parse_cmdline(&args, &opts) != 0) {
         return do_help(argv[0]);
     }
 
+    if(opts.show_help || opts.mountpoint == NULL) {
+        do_help(argv[0]);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        return 1;
+    }
+
+    r = 1;
+    struct fuse_session *se = fuse_session_new(&args, &do_oper, sizeof(do_oper), NULL);
+    session = se;
+    if(se != NULL) {
+        if(fuse_set_signal_handlers(se) == 0) {
+            if(fuse_session_mount(se, opts.mountpoint) == 0) {
+                fuse_daemonize(opts.foreground);
+
+                if(opts.singlethread) {
+                    r = fuse_session_loop(se);
+                } else {
+                    r = fuse_session_loop_mt(se, opts.clone_fd);
+                }
+
+                fuse_session_unmount(se);
+            }
+            fuse_remove_signal_handlers(se);
+        }
+        fuse_session_destroy(se);
+    }
+
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+
+    if(r != 0) {
+        return 1;
+    }
+
+    if(stats) {
+        do_stats();
+    }
+
     return 0;
 }
@@ -4,15 +4,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
+
+// for spilling to disk
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "array.h"
 
+// Grow spilled arrays in steps of this many bytes to limit remapping
+#define ARRAY_SPILL_STEP (1 << 20)
+
 void array_init(array_t *array, int entry_size) {
     array->entries = NULL;
     array->entry_size = entry_size;
     array->fill = 0;
     array->capacity = 0;
     array->reference = NULL;
+    array->spill_dir = NULL;
+    array->spill_limit = 0;
+    array->spill_fd = -1;
 }
 
 int array_set_reference(array_t *array, array_t *reference) {
@@ -24,12 +35,80 @@ int array_set_reference(array_t *array, array_t *reference) {
     return 0;
 }
 
+/**
+ * Allow entries to be moved into a memory mapped file once they exceed a size limit.
+ *
+ * The file is unlinked as soon as it is created, so it only lives as long as the
+ * array. Cold pages are written back to it and dropped by the kernel under memory
+ * pressure, bounding the resident size of large arrays.
+ */
+int array_set_spill(array_t *array, const char *dir, size_t limit) {
+    if(dir == NULL || array->spill_fd != -1) {
+        return -EINVAL;
+    }
+
+    array->spill_dir = dir;
+    array->spill_limit = limit;
+    return 0;
+}
+
 void array_free(array_t *array) {
-    if(array->entries != NULL) {
+    if(array->spill_fd != -1) {
+        munmap(array->entries, array->capacity * array->entry_size);
+        close(array->spill_fd);
+        array->spill_fd = -1;
+    } else if(array->entries != NULL) {
         free(array->entries);
     }
 }
 
+int _array_spill_resize(array_t *array, size_t size) {
+    // Round up to avoid remapping on every append
+    size_t bytes = size * array->entry_size;
+    bytes = (bytes + ARRAY_SPILL_STEP - 1) / ARRAY_SPILL_STEP * ARRAY_SPILL_STEP;
+    size = bytes / array->entry_size;
+    bytes = size * array->entry_size;
+
+    void *ptr;
+    if(array->spill_fd == -1) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/.array-XXXXXX", array->spill_dir);
+
+        int fd = mkstemp(path);
+        if(fd == -1) { return -errno; }
+        unlink(path);
+
+        if(ftruncate(fd, bytes) != 0) {
+            close(fd);
+            return -errno;
+        }
+
+        ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(ptr == MAP_FAILED) {
+            close(fd);
+            return -errno;
+        }
+
+        if(array->entries != NULL) {
+            memcpy(ptr, array->entries, array->fill * array->entry_size);
+            free(array->entries);
+        }
+
+        array->spill_fd = fd;
+    } else {
+        if(ftruncate(array->spill_fd, bytes) != 0) { return -errno; }
+
+        ptr = mremap(array->entries, array->capacity * array->entry_size, bytes,
+                MREMAP_MAYMOVE);
+        if(ptr == MAP_FAILED) { return -errno; }
+    }
+
+    array->entries = ptr;
+    array->capacity = size;
+
+    return 0;
+}
+
 const void *array_dereference(array_t *array, const void *entry) {
     if(array->reference == NULL) {
         return entry;
@@ -48,6 +127,10 @@ int _array_resize(array_t *array, size_t size) {
         return 0; // noop
     }
 
+    if(array->spill_dir != NULL && size * array->entry_size > array->spill_limit) {
+        return _array_spill_resize(array, size);
+    }
+
     void *ptr = realloc(array->entries, size * array->entry_size);
     if(ptr == NULL) { return -ENOMEM; }
 
@@ -285,7 +368,7 @@ int array_sorted_each(array_t *array, comparison_fn_t filter, void *key,
     if(r != 0) { return r; }
 
     for(size_t i=first;i<=last;i++) {
-        callback(&array->entries[i * array->entry_size]);
+        if(callback(&array->entries[i * array->entry_size]) != 0) { break; }
     }
 
     return 0;
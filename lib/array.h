@@ -17,6 +17,11 @@ typedef struct array {
     comparison_fn_t comparator;
 
     struct array *reference;
+
+    // Spill entries to a memory mapped file once they grow past a limit
+    const char *spill_dir;
+    size_t spill_limit;
+    int spill_fd;
 } array_t;
 
 void array_init(array_t *array, int entry_size);
@@ -25,6 +30,8 @@ const void *array_dereference(array_t *array, const void *entry);
 
 void array_free(array_t *array);
 
+int array_set_spill(array_t *array, const char *dir, size_t limit);
+
 int array_set(array_t *array, size_t index, const void *entry);
 int array_append(array_t *array, const void *entry);
 int array_get(array_t *array, size_t index, void *result);
@@ -35,7 +42,8 @@ int array_delete(array_t *array, comparison_fn_t filter, void *key);
 int array_sort(array_t *array, comparison_fn_t comparator); // must be called first
 int array_sorted_insert(array_t *array, const void *entry);
 
-// Filtering; filters must be compatible with sort comparator
+// Filtering; filters must be compatible with sort comparator, and callbacks stop the
+// iteration early by returning non-zero
 int array_sorted_first(array_t *array, comparison_fn_t filter, void *key, void *result);
 int array_sorted_last(array_t *array, comparison_fn_t filter, void *key, void *result);
 int array_sorted_each(array_t *array, comparison_fn_t filter, void *key,
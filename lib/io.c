@@ -2,57 +2,63 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-// for open
-#include <fcntl.h>
-#include <sys/stat.h>
+#include "io_backend.h"
 
-// for pread, pwrite
-#include <unistd.h>
-#define _XOPEN_SOURCE 700
+size_t _io_align(size_t size) {
+    return (size + IO_DIRECT_ALIGNMENT - 1) / IO_DIRECT_ALIGNMENT * IO_DIRECT_ALIGNMENT;
+}
 
-#include "io.h"
+/**
+ * Get the number of bytes needed to store a number of blocks.
+ *
+ * Without a header table, blocks are stored whole one after the other. Otherwise the
+ * leading header bytes of every block are packed together at the start of the file,
+ * followed by the rest of each block in a payload slot. Payload slots start on an
+ * aligned boundary, so the layout depends on the number of blocks.
+ */
+size_t _io_layout_size(io_t *io, size_t num_blocks) {
+    if (io->header_size == 0) {
+        return num_blocks * io->block_size;
+    }
 
-int _io_init_file(io_t *io, io_config_t *config) {
-    // Determine size of underlying file
-    FILE *fp = fopen(config->path, "r+b");
-    if (fp == NULL) { return -errno; }
-    fseek(fp, 0, SEEK_END);
-    size_t size = ftell(fp);
-    fclose(fp);
+    size_t slot_size = io->block_size - io->header_size;
+    return _io_align(num_blocks * io->header_size) + num_blocks * slot_size;
+}
 
-    // Config
-    size_t num_blocks = size / config->block_size;
-    if(config->max_num_blocks > 0 && config->max_num_blocks < num_blocks) {
-        num_blocks = config->max_num_blocks;
-    }
+/**
+ * Lay out a number of blocks.
+ */
+int _io_layout(io_t *io, size_t num_blocks) {
     if(num_blocks <= 0) {
         return -ENOSPC;
     }
-    io->last_valid_block = num_blocks - 1;
 
-    // Open
-    io->fh = open(config->path, O_RDWR);
-    if (io->fh == -1) { return -errno; }
+    io->last_valid_block = num_blocks - 1;
+    io->layout_size = _io_layout_size(io, num_blocks);
+    io->data_offset = 0;
+    if (io->header_size > 0) {
+        io->data_offset = _io_align(num_blocks * io->header_size);
+    }
 
     return 0;
 }
 
-int _io_init_memory(io_t *io, io_config_t *config) {
-    if(config->max_num_blocks <= 0) {
-        return -EINVAL;
+/**
+ * Get the position in the file of a byte of a block.
+ */
+off_t _io_offset(io_t *io, size_t block, int offset) {
+    if (io->header_size == 0) {
+        return block * io->block_size + offset;
     }
 
-    // Config
-    io->last_valid_block = config->max_num_blocks - 1;
-
-    // Allocate
-    size_t size = config->max_num_blocks * config->block_size;
-    void *buffer = malloc(size);
-    if (buffer == NULL) { return -ENOMEM; }
-    io->buffer = buffer;
+    if (offset < io->header_size) {
+        return block * io->header_size + offset;
+    }
 
-    return 0;
+    size_t slot_size = io->block_size - io->header_size;
+    return io->data_offset + block * slot_size + offset - io->header_size;
 }
 
 int io_init(io_t *io, io_config_t *config) {
@@ -60,93 +66,788 @@ int io_init(io_t *io, io_config_t *config) {
         return -EINVAL;
     }
 
+    if (config->header_size < 0 || config->header_size >= config->block_size) {
+        return -EINVAL;
+    }
+
     io->fh = -1;
+    io->fh_direct = -1;
+    io->is_device = 0;
     io->buffer = NULL;
+    io->buffer_size = 0;
     io->block_size = config->block_size;
-
-    int r;
-    if (strcmp(config->path, ":memory:") == 0) {
-        r = _io_init_memory(io, config);
+    io->header_size = config->header_size;
+    io->dirty_start = -1;
+    io->dirty_end = 0;
+    io->writes_in_flight = 0;
+    io->state = NULL;
+    memset(&io->stats, 0, sizeof(io->stats));
+    pthread_mutex_init(&io->sync_lock, NULL);
+    pthread_mutex_init(&io->pool_lock, NULL);
+    pthread_cond_init(&io->sync_done, NULL);
+    io->syncing = 0;
+    io->sync_open = 1;
+    io->sync_completed = 0;
+    io->sync_result = 0;
+    io->sync_window = config->sync_window;
+    io->direct = config->direct;
+    io->pool = NULL;
+    io->sink = NULL;
+
+    array_init(&io->queue, sizeof(io_request_t));
+
+    if (io->direct) {
+        // Headers kept apart go through the page cache; only payload slots are direct
+        size_t unit = config->block_size - config->header_size;
+        if (unit % IO_DIRECT_ALIGNMENT != 0) { return -EINVAL; }
+
+        // The sink may stand in for a whole block when merging direct reads
+        size_t size = (size_t) IO_QUEUE_DEPTH * unit;
+        if (posix_memalign((void **) &io->pool, IO_DIRECT_ALIGNMENT, size) != 0 ||
+            posix_memalign((void **) &io->sink, IO_DIRECT_ALIGNMENT,
+                           config->block_size) != 0) {
+            return -ENOMEM;
+        }
     } else {
-        r = _io_init_file(io, config);
+        io->sink = malloc(config->block_size);
+        if (io->sink == NULL) { return -ENOMEM; }
     }
 
-    if (r != 0) { return r; }
+    io->backend = config->backend;
+    if (io->backend == IO_BACKEND_DEFAULT) {
+        if (strcmp(config->path, ":memory:") == 0) {
+            io->backend = IO_BACKEND_MEMORY;
+        } else {
+            io->backend = IO_BACKEND_FILE;
+        }
+    }
 
-    return 0;
+    if (io->direct && io->backend != IO_BACKEND_FILE && io->backend != IO_BACKEND_URING) {
+        return -EINVAL; // only file descriptors can bypass the page cache
+    }
+
+    if (io->backend == IO_BACKEND_MEMORY) {
+        io->ops = &io_backend_memory;
+    } else if (io->backend == IO_BACKEND_FILE) {
+        io->ops = &io_backend_file;
+    } else if (io->backend == IO_BACKEND_MMAP) {
+        io->ops = &io_backend_mmap;
+    } else if (io->backend == IO_BACKEND_URING) {
+        io->ops = &io_backend_uring;
+    } else if (io->backend == IO_BACKEND_SIM) {
+        io->ops = &io_backend_sim;
+    } else if (io->backend == IO_BACKEND_CUSTOM && config->ops != NULL) {
+        io->ops = config->ops;
+    } else {
+        io->ops = NULL;
+        return -EINVAL;
+    }
+
+    return io->ops->init(io, config);
 }
 
 void io_close(io_t *io) {
-    if (io->fh != -1) { close(io->fh); }
+    if (io->ops != NULL) { io->ops->close(io); }
 
-    if (io->buffer != NULL) { free(io->buffer); }
+    array_free(&io->queue);
+    free(io->sink);
+    free(io->pool);
+
+    pthread_cond_destroy(&io->sync_done);
+    pthread_mutex_destroy(&io->sync_lock);
+    pthread_mutex_destroy(&io->pool_lock);
 }
 
-int io_write3(io_t *io, size_t block, const void *data, int size, const void *data2,
-              int size2, const void *data3, int size3) {
+/**
+ * Describe a transfer of up to three segments at the start of a block.
+ *
+ * Leading segments without a buffer are skipped by starting the transfer later, and
+ * trailing ones are dropped. Any others are read into a sink. When headers are kept
+ * apart, a transfer crossing into the payload is split in two; there is room for two
+ * requests and the number used is stored in count.
+ */
+int _io_prepare(io_t *io, io_request_t *requests, int *count, int op, size_t block,
+                const void *data, int size, const void *data2, int size2,
+                const void *data3, int size3) {
     if (block > io->last_valid_block) {
         return -EOVERFLOW; // past underlying file
     }
 
-    if (size + size2 + size3 > io->block_size) {
+    if (size < 0 || size2 < 0 || size3 < 0 || size + size2 + size3 > io->block_size) {
         return -EINVAL; // past block
     }
 
-    size_t start = block * io->block_size;
-    if (start < 0) {
-        return -EINVAL; // past block
+    const void *segments[3] = {data, data2, data3};
+    int sizes[3] = {size, size2, size3};
+
+    int last = 2;
+    while (last >= 0 && (segments[last] == NULL || sizes[last] == 0)) { last--; }
+
+    // Relative to the start of the block for now
+    io_request_t request = {.op = op, .region = IO_REGION_DATA, .start = 0, .size = 0,
+                            .iovcnt = 0};
+
+    for (int i = 0; i <= last; i++) {
+        if (sizes[i] == 0) { continue; }
+
+        void *base = (void *) segments[i];
+        if (base == NULL) {
+            if (request.iovcnt == 0) {
+                request.start += sizes[i];
+                continue;
+            }
+
+            if (op == IO_OP_WRITE) { return -EINVAL; }
+            base = io->sink;
+        }
+
+        request.iov[request.iovcnt].iov_base = base;
+        request.iov[request.iovcnt].iov_len = sizes[i];
+        request.iovcnt++;
+        request.size += sizes[i];
     }
 
-    char buffer[size + size2 + size3];
-    if (data != NULL) { memcpy(buffer, data, size); }
-    if (data2 != NULL) { memcpy(buffer + size, data2, size2); }
-    if (data3 != NULL) { memcpy(buffer + size + size2, data3, size3); }
+    *count = 0;
+    if (request.size == 0) { return 0; } // nothing to do
+
+    int offset = request.start;
+    int end = offset + request.size;
+    int header_size = io->header_size;
+
+    if (header_size == 0 || offset >= header_size || end <= header_size) {
+        requests[0] = request;
+        requests[0].start = _io_offset(io, block, offset);
+        if (offset < header_size) { requests[0].region = IO_REGION_HEADER; }
+        *count = 1;
+        return 0;
+    }
 
-    if (io->fh != -1) {
-        pwrite(io->fh, buffer, size + size2 + size3, start);
-    } else if (io->buffer != NULL) {
-        memcpy(io->buffer + start, buffer, size + size2 + size3);
+    // Split the segments where the header ends
+    io_request_t *header = &requests[0];
+    io_request_t *payload = &requests[1];
+    *header = (io_request_t) {.op = op, .region = IO_REGION_HEADER,
+                              .start = _io_offset(io, block, offset),
+                              .size = header_size - offset, .iovcnt = 0};
+    *payload = (io_request_t) {.op = op, .region = IO_REGION_DATA,
+                               .start = _io_offset(io, block, header_size),
+                               .size = end - header_size, .iovcnt = 0};
+
+    size_t remaining = header->size;
+    for (int i = 0; i < request.iovcnt; i++) {
+        char *base = request.iov[i].iov_base;
+        size_t len = request.iov[i].iov_len;
+
+        size_t amount = len < remaining ? len : remaining;
+        if (amount > 0) {
+            header->iov[header->iovcnt].iov_base = base;
+            header->iov[header->iovcnt].iov_len = amount;
+            header->iovcnt++;
+            remaining -= amount;
+        }
+
+        if (amount < len) {
+            payload->iov[payload->iovcnt].iov_base = base + amount;
+            payload->iov[payload->iovcnt].iov_len = len - amount;
+            payload->iovcnt++;
+        }
     }
 
+    *count = 2;
     return 0;
 }
 
+/**
+ * Merge requests for neighbouring blocks into as few transfers as possible.
+ *
+ * Requests are merged in the order given, as long as each one starts at or after the
+ * end of the previous one. Writes must be exactly adjacent; small gaps between reads,
+ * such as skipped block headers, are read into the sink.
+ *
+ * Arguments:
+ *     io:          A pointer to the instance.
+ *     requests:    The requests to merge.
+ *     count:       The number of requests.
+ *     runs:        The destination for the merged runs; room for count entries.
+ *     iov:         Storage for the runs' segments; room for 4 * count entries.
+ *
+ * Returns:
+ *     The number of runs.
+ */
+size_t _io_coalesce(io_t *io, io_request_t *requests, size_t count, io_run_t *runs,
+                    struct iovec *iov) {
+    size_t num_runs = 0;
+    io_run_t *run = NULL;
+
+    for (size_t i = 0; i < count; i++) {
+        io_request_t *request = &requests[i];
+
+        off_t gap = -1;
+        if (run != NULL && run->op == request->op) {
+            gap = request->start - (run->start + run->size);
+        }
+
+        int mergeable = (gap == 0) ||
+            (gap > 0 && request->op == IO_OP_READ && gap <= io->block_size);
+        if (mergeable && run->iovcnt + request->iovcnt + 1 > IO_IOV_MAX) { mergeable = 0; }
+
+        if (!mergeable) {
+            run = &runs[num_runs++];
+            run->op = request->op;
+            run->start = request->start;
+            run->size = 0;
+            run->iovcnt = 0;
+            run->iov = iov;
+        } else if (gap > 0) {
+            iov->iov_base = io->sink;
+            iov->iov_len = gap;
+            iov++;
+            run->iovcnt++;
+            run->size += gap;
+        }
+
+        memcpy(iov, request->iov, request->iovcnt * sizeof(*iov));
+        iov += request->iovcnt;
+        run->iovcnt += request->iovcnt;
+        run->size += request->size;
+    }
+
+    return num_runs;
+}
+
+/**
+ * Merge requests into runs and hand them to a backend.
+ *
+ * Arguments:
+ *     io:          A pointer to the instance.
+ *     fh:          The descriptor to transfer through.
+ *     requests:    The requests to run.
+ *     count:       The number of requests.
+ *     fn:          The backend's function to run the merged transfers.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int _io_execute_merged(io_t *io, int fh, io_request_t *requests, size_t count,
+                       io_runs_fn_t fn) {
+    int r;
+
+    if (count == 1) {
+        // Common synchronous case; nothing to merge
+        io_run_t run = {
+            .op = requests->op,
+            .start = requests->start,
+            .size = requests->size,
+            .iovcnt = requests->iovcnt,
+            .iov = requests->iov
+        };
+        return fn(io, fh, &run, 1);
+    }
+
+    io_run_t *runs = malloc(count * sizeof(io_run_t));
+    struct iovec *iov = malloc(4 * count * sizeof(struct iovec));
+    if (runs == NULL || iov == NULL) {
+        free(runs);
+        free(iov);
+        return -ENOMEM;
+    }
+
+    size_t num_runs = _io_coalesce(io, requests, count, runs, iov);
+    r = fn(io, fh, runs, num_runs);
+
+    free(runs);
+    free(iov);
+
+    return r;
+}
+
+/**
+ * Run prepared requests as whole, aligned units through the bounce buffer pool.
+ *
+ * A unit is a block, or a payload slot when headers are kept apart. Writes pad the
+ * rest of each unit with zeros, which is safe since every write describes a complete
+ * record starting at the beginning of its block.
+ */
+int _io_execute_direct(io_t *io, io_request_t *requests, size_t count) {
+    int r = 0;
+
+    size_t unit = io->block_size - io->header_size;
+
+    // The pool holds one batch at a time
+    pthread_mutex_lock(&io->pool_lock);
+
+    for (size_t i = 0; r == 0 && i < count; i += IO_QUEUE_DEPTH) {
+        size_t amount = count - i;
+        if (amount > IO_QUEUE_DEPTH) { amount = IO_QUEUE_DEPTH; }
+
+        io_request_t whole[amount];
+        for (size_t j = 0; j < amount; j++) {
+            io_request_t *request = &requests[i + j];
+            char *buffer = io->pool + j * unit;
+            off_t offset = (request->start - io->data_offset) % unit;
+
+            if (request->op == IO_OP_WRITE) {
+                memset(buffer, 0, unit);
+
+                char *cursor = buffer + offset;
+                for (int k = 0; k < request->iovcnt; k++) {
+                    memcpy(cursor, request->iov[k].iov_base, request->iov[k].iov_len);
+                    cursor += request->iov[k].iov_len;
+                }
+            }
+
+            whole[j] = (io_request_t) {
+                .op = request->op,
+                .region = request->region,
+                .start = request->start - offset,
+                .size = unit,
+                .iovcnt = 1,
+                .iov = {{.iov_base = buffer, .iov_len = unit}}};
+        }
+
+        r = io->ops->execute(io, io->fh_direct, whole, amount);
+        if (r != 0) { break; }
+
+        for (size_t j = 0; j < amount; j++) {
+            io_request_t *request = &requests[i + j];
+            if (request->op != IO_OP_READ) { continue; }
+
+            off_t offset = (request->start - io->data_offset) % unit;
+            char *cursor = io->pool + j * unit + offset;
+            for (int k = 0; k < request->iovcnt; k++) {
+                memcpy(request->iov[k].iov_base, cursor, request->iov[k].iov_len);
+                cursor += request->iov[k].iov_len;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&io->pool_lock);
+
+    return r;
+}
+
+/**
+ * Run prepared requests for the payload, then for the header table.
+ *
+ * Payloads go first, so that a header never describes a payload that is not there.
+ */
+int _io_execute_split(io_t *io, io_request_t *requests, size_t count) {
+    int r;
+
+    io_request_t local[2];
+    io_request_t *sorted = local;
+    if (count > 2) {
+        sorted = malloc(count * sizeof(io_request_t));
+        if (sorted == NULL) { return -ENOMEM; }
+    }
+
+    size_t num_data = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (requests[i].region == IO_REGION_DATA) { sorted[num_data++] = requests[i]; }
+    }
+
+    size_t num_header = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (requests[i].region == IO_REGION_HEADER) {
+            sorted[num_data + num_header++] = requests[i];
+        }
+    }
+
+    r = 0;
+    if (num_data > 0) {
+        if (io->direct) {
+            r = _io_execute_direct(io, sorted, num_data);
+        } else {
+            r = io->ops->execute(io, io->fh, sorted, num_data);
+        }
+    }
+
+    if (r == 0 && num_header > 0) {
+        r = io->ops->execute(io, io->fh, sorted + num_data, num_header);
+    }
+
+    if (sorted != local) { free(sorted); }
+
+    return r;
+}
+
+uint64_t _io_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Count a call in a latency histogram.
+ */
+void _io_record(uint64_t *histogram, uint64_t start) {
+    uint64_t elapsed = _io_now() - start;
+
+    int bucket = 0;
+    while (elapsed > 1 && bucket < IO_HISTOGRAM_BUCKETS - 1) {
+        elapsed >>= 1;
+        bucket++;
+    }
+
+    __atomic_fetch_add(&histogram[bucket], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Run prepared requests.
+ */
+int _io_dispatch(io_t *io, io_request_t *requests, size_t count) {
+    if (io->header_size > 0 && io->buffer == NULL) {
+        // Keep neighbouring headers together so they merge; mapped storage needn't
+        return _io_execute_split(io, requests, count);
+    }
+
+    if (io->direct) {
+        return _io_execute_direct(io, requests, count);
+    }
+
+    return io->ops->execute(io, io->fh, requests, count);
+}
+
+/**
+ * Run prepared requests, keeping statistics.
+ */
+int _io_execute(io_t *io, io_request_t *requests, size_t count) {
+    int r;
+
+    if (count == 0) { return 0; }
+
+    // Counters are shared by concurrent callers
+    size_t dirty_start = -1;
+    size_t dirty_end = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (requests[i].op == IO_OP_WRITE) {
+            __atomic_fetch_add(&io->stats.writes, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&io->stats.bytes_written, requests[i].size,
+                               __ATOMIC_RELAXED);
+
+            size_t start = requests[i].start;
+            size_t end = start + requests[i].size;
+            if (start < dirty_start) { dirty_start = start; }
+            if (end > dirty_end) { dirty_end = end; }
+        } else {
+            __atomic_fetch_add(&io->stats.reads, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&io->stats.bytes_read, requests[i].size,
+                               __ATOMIC_RELAXED);
+        }
+    }
+
+    int any_write = dirty_start < dirty_end;
+    if (any_write) { __atomic_fetch_add(&io->writes_in_flight, 1, __ATOMIC_ACQ_REL); }
+
+    uint64_t start = _io_now();
+    r = _io_dispatch(io, requests, count);
+    _io_record(any_write ? io->stats.write_latency : io->stats.read_latency, start);
+
+    if (any_write) {
+        // Remember what the next sync has to flush, once it is there to be flushed; a
+        // sync taking the range earlier could finish before the write lands
+        pthread_mutex_lock(&io->sync_lock);
+        if (dirty_start < io->dirty_start) { io->dirty_start = dirty_start; }
+        if (dirty_end > io->dirty_end) { io->dirty_end = dirty_end; }
+        __atomic_fetch_sub(&io->writes_in_flight, 1, __ATOMIC_ACQ_REL);
+        pthread_mutex_unlock(&io->sync_lock);
+    }
+
+    return r;
+}
+
+int _io_transfer_blocks(io_t *io, int op, io_blockv_t *blocks, size_t count) {
+    int r;
+
+    if (count == 0) { return 0; }
+
+    // Up to two requests per block
+    io_request_t *requests = malloc(2 * count * sizeof(io_request_t));
+    if (requests == NULL) { return -ENOMEM; }
+
+    size_t num_requests = 0;
+    for (size_t i = 0; i < count; i++) {
+        io_blockv_t *b = &blocks[i];
+        int added;
+        r = _io_prepare(io, requests + num_requests, &added, op, b->block, b->data[0],
+                        b->size[0], b->data[1], b->size[1], b->data[2], b->size[2]);
+        if (r != 0) {
+            free(requests);
+            return r;
+        }
+        num_requests += added;
+    }
+
+    r = _io_execute(io, requests, num_requests);
+    free(requests);
+
+    return r;
+}
+
+int io_writev_blocks(io_t *io, io_blockv_t *blocks, size_t count) {
+    return _io_transfer_blocks(io, IO_OP_WRITE, blocks, count);
+}
+
+int io_readv_blocks(io_t *io, io_blockv_t *blocks, size_t count) {
+    return _io_transfer_blocks(io, IO_OP_READ, blocks, count);
+}
+
+int _io_queue(io_t *io, int op, size_t block, const void *data, int size,
+              const void *data2, int size2, const void *data3, int size3) {
+    int r;
+
+    io_request_t requests[2];
+    int count;
+    r = _io_prepare(io, requests, &count, op, block, data, size, data2, size2, data3,
+                    size3);
+    if (r != 0) { return r; }
+
+    for (int i = 0; i < count; i++) {
+        r = array_append(&io->queue, &requests[i]);
+        if (r != 0) { return r; }
+    }
+
+    return 0;
+}
+
+int io_queue_write3(io_t *io, size_t block, const void *data, int size, const void *data2,
+                    int size2, const void *data3, int size3) {
+    return _io_queue(io, IO_OP_WRITE, block, data, size, data2, size2, data3, size3);
+}
+
+int io_queue_read3(io_t *io, size_t block, void *data, int size, void *data2, int size2,
+                   void *data3, int size3) {
+    return _io_queue(io, IO_OP_READ, block, data, size, data2, size2, data3, size3);
+}
+
+int io_submit(io_t *io) {
+    int r;
+
+    r = _io_execute(io, (io_request_t *) io->queue.entries, array_len(&io->queue));
+
+    // Requests are discarded even on failure
+    io->queue.fill = 0;
+
+    return r;
+}
+
+int io_write3(io_t *io, size_t block, const void *data, int size, const void *data2,
+              int size2, const void *data3, int size3) {
+    int r;
+
+    // Segments go straight from the caller's buffers to the file
+    io_request_t requests[2];
+    int count;
+    r = _io_prepare(io, requests, &count, IO_OP_WRITE, block, data, size, data2, size2,
+                    data3, size3);
+    if (r != 0) { return r; }
+
+    return _io_execute(io, requests, count);
+}
+
 int io_read3(io_t *io, size_t block, void *data, int size, void *data2, int size2,
              void *data3, int size3) {
+    int r;
+
+    io_request_t requests[2];
+    int count;
+    r = _io_prepare(io, requests, &count, IO_OP_READ, block, data, size, data2, size2,
+                    data3, size3);
+    if (r != 0) { return r; }
+
+    return _io_execute(io, requests, count);
+}
+
+int io_peek(io_t *io, size_t block, int offset, const void **data) {
     if (block > io->last_valid_block) {
         return -EOVERFLOW; // past underlying file
     }
 
-    if (size + size2 + size3 > io->block_size) {
+    if (offset < 0 || offset > io->block_size) {
         return -EINVAL; // past block
     }
 
-    size_t start = block * io->block_size;
-    if (start < 0) {
+    if (io->buffer == NULL) {
+        return -ENOTSUP; // not mapped
+    }
+
+    *data = io->buffer + _io_offset(io, block, offset);
+    return 0;
+}
+
+int io_locate(io_t *io, size_t block, int offset, int *fh, off_t *position) {
+    if (block > io->last_valid_block) {
+        return -EOVERFLOW; // past underlying file
+    }
+
+    if (offset < 0 || offset > io->block_size) {
         return -EINVAL; // past block
     }
 
-    char buffer[size + size2 + size3];
+    // Simulated and custom backends must see every transfer
+    int backend = io->backend;
+    if (io->fh < 0 || (backend != IO_BACKEND_FILE && backend != IO_BACKEND_URING &&
+                       backend != IO_BACKEND_MMAP)) {
+        return -ENOTSUP;
+    }
 
-    if (io->fh != -1) {
-        pread(io->fh, buffer, size + size2 + size3, start);
-    } else if (io->buffer != NULL) {
-        memcpy(buffer, io->buffer + start, size + size2 + size3);
+    if (io->direct) {
+        return -ENOTSUP; // unaligned splices would fail on an O_DIRECT handle
     }
 
-    if (data != NULL) { memcpy(data, buffer, size); }
-    if (data2 != NULL) { memcpy(data2, buffer + size, size2); }
-    if (data3 != NULL) { memcpy(data3, buffer + size + size2, size3); }
+    *fh = io->fh;
+    *position = _io_offset(io, block, offset);
+    return 0;
+}
+
+void io_note_write(io_t *io, size_t block, int offset, size_t size) {
+    size_t start = _io_offset(io, block, offset);
+    size_t end = start + size;
+
+    __atomic_fetch_add(&io->stats.writes, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&io->stats.bytes_written, size, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&io->sync_lock);
+    if (start < io->dirty_start) { io->dirty_start = start; }
+    if (end > io->dirty_end) { io->dirty_end = end; }
+    pthread_mutex_unlock(&io->sync_lock);
+}
+
+/**
+ * Release the whole pages within a range of the underlying storage.
+ */
+int _io_discard_range(io_t *io, off_t start, off_t end) {
+    // Partial pages would have to be zeroed by writing, which is worse than keeping them
+    start = _io_align(start);
+    end = end / IO_DIRECT_ALIGNMENT * IO_DIRECT_ALIGNMENT;
+    if (start >= end) { return 0; }
+
+    return io->ops->discard(io, start, end);
+}
+
+int io_discard(io_t *io, size_t block, int offset, size_t count) {
+    int r;
+
+    if (count == 0) { return 0; }
+
+    if (block + count - 1 > io->last_valid_block) {
+        return -EOVERFLOW; // past underlying file
+    }
+
+    if (offset < 0 || offset > io->block_size) {
+        return -EINVAL; // past block
+    }
+
+    if (offset < io->header_size) {
+        return -EINVAL; // the header table is never discarded
+    }
+
+    if (io->header_size > 0 && offset == io->header_size) {
+        // Neighbouring payload slots form a single range
+        off_t start = _io_offset(io, block, offset);
+        size_t slot_size = io->block_size - io->header_size;
+        return _io_discard_range(io, start, start + count * slot_size);
+    }
+
+    for (size_t i = block; i < block + count; i++) {
+        off_t start = _io_offset(io, i, offset);
+        off_t end = _io_offset(io, i, io->block_size - 1) + 1;
+
+        r = _io_discard_range(io, start, end);
+        if (r != 0) { return r; }
+    }
 
     return 0;
 }
 
 int io_sync(io_t *io) {
-    if(io->fh != -1) {
-        return fsync(io->fh);
+    int r;
+
+    pthread_mutex_lock(&io->sync_lock);
+    io->stats.sync_requests++;
+
+    // A flush already running may have missed this caller's writes, so wait for one
+    // that starts later
+    uint64_t target = io->sync_open;
+    while (io->syncing) {
+        pthread_cond_wait(&io->sync_done, &io->sync_lock);
     }
 
-    return 0;
+    if (io->sync_completed >= target) {
+        // Another caller flushed on our behalf
+        r = io->sync_result;
+        pthread_mutex_unlock(&io->sync_lock);
+        return r;
+    }
+
+    io->syncing = 1;
+
+    if (io->sync_window > 0) {
+        // Give concurrent callers a chance to join this flush
+        pthread_mutex_unlock(&io->sync_lock);
+        struct timespec delay = {.tv_sec = io->sync_window / 1000000,
+                                 .tv_nsec = (io->sync_window % 1000000) * 1000L};
+        nanosleep(&delay, NULL);
+        pthread_mutex_lock(&io->sync_lock);
+    }
+
+    uint64_t generation = io->sync_open++;
+    size_t dirty_start = io->dirty_start;
+    size_t dirty_end = io->dirty_end;
+    io->dirty_start = -1;
+    io->dirty_end = 0;
+
+    // With writes still landing the range is incomplete, so the backend flushes
+    // everything; with none at all there is nothing to flush
+    int idle = dirty_start >= dirty_end &&
+               __atomic_load_n(&io->writes_in_flight, __ATOMIC_ACQUIRE) == 0;
+    pthread_mutex_unlock(&io->sync_lock);
+
+    uint64_t start = _io_now();
+    r = idle ? 0 : io->ops->sync(io, dirty_start, dirty_end);
+
+    pthread_mutex_lock(&io->sync_lock);
+    _io_record(io->stats.sync_latency, start);
+    io->stats.syncs++;
+
+    if (r != 0) {
+        // Flush the range again next time
+        if (dirty_start < io->dirty_start) { io->dirty_start = dirty_start; }
+        if (dirty_end > io->dirty_end) { io->dirty_end = dirty_end; }
+    }
+
+    io->syncing = 0;
+    io->sync_completed = generation;
+    io->sync_result = r;
+    pthread_cond_broadcast(&io->sync_done);
+    pthread_mutex_unlock(&io->sync_lock);
+
+    return r;
+}
+
+void io_get_stats(io_t *io, io_stats_t *result) {
+    *result = io->stats;
+}
+
+void io_reset_stats(io_t *io) {
+    memset(&io->stats, 0, sizeof(io->stats));
+}
+
+uint64_t io_histogram_percentile(const uint64_t *histogram, double fraction) {
+    uint64_t total = 0;
+    for (int i = 0; i < IO_HISTOGRAM_BUCKETS; i++) { total += histogram[i]; }
+    if (total == 0) { return 0; }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < IO_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram[i];
+        if (seen >= fraction * total) { return (uint64_t) 2 << i; } // bucket's upper end
+    }
+
+    return (uint64_t) 2 << (IO_HISTOGRAM_BUCKETS - 1);
+}
+
+int io_advise(io_t *io, int advice) {
+    return io->ops->advise(io, advice);
 }
 
 size_t io_block_size(io_t *io) {
@@ -6,23 +6,109 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 
+#include "array.h"
+
 #define IO_BLOCK_NULL 0
 #define IO_BLOCK_FIRST 1
 
+#define IO_BACKEND_DEFAULT 0 // file, or memory if path is ":memory:"
+#define IO_BACKEND_FILE 1
+#define IO_BACKEND_MEMORY 2
+#define IO_BACKEND_MMAP 3
+#define IO_BACKEND_URING 4 // falls back to file if io_uring is unavailable
+#define IO_BACKEND_SIM 5 // memory or file, slowed down to behave like a given device
+#define IO_BACKEND_CUSTOM 6 // given by io_config_t.ops
+
+// Storage behind the block layer; see io_backend.h
+typedef struct io_backend io_backend_t;
+
+// Maximum number of operations in flight at once
+#define IO_QUEUE_DEPTH 128
+
+// Alignment of buffers, offsets and sizes for direct (O_DIRECT) access
+#define IO_DIRECT_ALIGNMENT 4096
+
+#define IO_ADVICE_NORMAL 0
+#define IO_ADVICE_SEQUENTIAL 1
+#define IO_ADVICE_RANDOM 2
+
+// Latency histogram buckets; bucket i counts calls taking [2^i, 2^(i+1)) microseconds,
+// with bucket 0 also counting anything faster
+#define IO_HISTOGRAM_BUCKETS 32
+
+typedef struct io_stats {
+    uint64_t reads; // transfers requested, before merging
+    uint64_t writes;
+    uint64_t syncs; // flushes reaching storage
+    uint64_t sync_requests; // calls to io_sync; concurrent ones share a flush
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t read_latency[IO_HISTOGRAM_BUCKETS]; // per batch of transfers
+    uint64_t write_latency[IO_HISTOGRAM_BUCKETS]; // per batch containing any write
+    uint64_t sync_latency[IO_HISTOGRAM_BUCKETS];
+} io_stats_t;
+
+// Up to three segments at the start of a block
+typedef struct io_blockv {
+    size_t block;
+    void *data[3];
+    int size[3];
+} io_blockv_t;
+
+// Simulated device characteristics
+typedef struct io_sim_config {
+    int read_latency; // microseconds per operation
+    int write_latency;
+    int sync_latency;
+    size_t bandwidth; // bytes per second, or 0 for unlimited
+} io_sim_config_t;
+
 typedef struct {
     char *path;
     int block_size;
     size_t max_num_blocks;
+    int backend;
+    int direct; // bypass the page cache; block size must be a multiple of the alignment
+    int header_size; // leading bytes of each block kept apart in a header table, or 0
+    const io_backend_t *ops; // for IO_BACKEND_CUSTOM
+    io_sim_config_t sim; // for IO_BACKEND_SIM
+    int sync_window; // microseconds a flush waits for more io_sync callers to join
 } io_config_t;
 
 typedef struct {
     int fh;
+    int backend;
+    const io_backend_t *ops;
+    void *state; // backend specific
     int block_size;
     size_t last_valid_block;
-    void *buffer; // for in-memory operations
+    void *buffer; // for in-memory and memory mapped operations
+    size_t buffer_size;
+    size_t dirty_start; // range of bytes written since the last sync
+    size_t dirty_end;
+    int writes_in_flight; // dispatched but not yet in the dirty range
+    array_t queue; // operations waiting for io_submit
+    char *sink; // destination for skipped bytes in reads
+    int direct;
+    int fh_direct; // opened with O_DIRECT, for whole blocks or payload slots
+    char *pool; // aligned bounce buffers for direct access, one unit each
+    pthread_mutex_t pool_lock;
+    int header_size;
+    off_t data_offset; // start of the payload slots when headers are kept apart
+    size_t layout_size; // bytes of the underlying file in use
+    int is_device; // a block device rather than a regular file
+    io_stats_t stats;
+    pthread_mutex_t sync_lock; // group commit of concurrent io_sync calls
+    pthread_cond_t sync_done;
+    int syncing; // a flush is in progress
+    uint64_t sync_open; // generation of the flush new callers wait for
+    uint64_t sync_completed; // generation of the last finished flush
+    int sync_result;
+    int sync_window;
 } io_t;
 
 int io_init(io_t *io, io_config_t *config);
@@ -38,7 +124,50 @@ int io_read3(io_t *io, size_t block, void *data, int size, void *data2, int size
 #define io_read2(i, b, d, s, d2, s2) io_read3(i, b, d, s, d2, s2, NULL, 0)
 #define io_read(i, b, d, s) io_read2(i, b, d, s, NULL, 0)
 
+// Transfer many blocks at once, merging runs of neighbouring blocks into one operation
+int io_writev_blocks(io_t *io, io_blockv_t *blocks, size_t count);
+int io_readv_blocks(io_t *io, io_blockv_t *blocks, size_t count);
+
+// Batched operations; buffers must remain valid until io_submit returns
+int io_queue_write3(io_t *io, size_t block, const void *data, int size, const void *data2,
+                    int size2, const void *data3, int size3);
+#define io_queue_write2(i, b, d, s, d2, s2) io_queue_write3(i, b, d, s, d2, s2, NULL, 0)
+#define io_queue_write(i, b, d, s) io_queue_write2(i, b, d, s, NULL, 0)
+
+int io_queue_read3(io_t *io, size_t block, void *data, int size, void *data2, int size2,
+                   void *data3, int size3);
+#define io_queue_read2(i, b, d, s, d2, s2) io_queue_read3(i, b, d, s, d2, s2, NULL, 0)
+#define io_queue_read(i, b, d, s) io_queue_read2(i, b, d, s, NULL, 0)
+
+// Submit all queued operations and wait for them to complete
+int io_submit(io_t *io);
+
+// Get a pointer to the data of a block without copying; only for mapped backends. With a
+// header table, the data may not cross from the header into the payload.
+int io_peek(io_t *io, size_t block, int offset, const void **data);
+// Get the descriptor and position in the file of a byte of a block, for transfers that
+// bypass the block layer, such as splicing; only for file descriptor based backends,
+// and not with direct I/O. With a header table, the data may not cross from the header
+// into the payload.
+int io_locate(io_t *io, size_t block, int offset, int *fh, off_t *position);
+// Count bytes written around the block layer at a located position, so the next sync
+// covers them
+void io_note_write(io_t *io, size_t block, int offset, size_t size);
+
+// Release the storage behind the end of a run of blocks, from offset onwards; the
+// bytes read back as zeros afterwards
+int io_discard(io_t *io, size_t block, int offset, size_t count);
+
+// Make all writes so far durable. Callers arriving while a flush is in progress are
+// served together by the next one.
 int io_sync(io_t *io);
+int io_advise(io_t *io, int advice);
+
+// Get a snapshot of the counters and histograms, or clear them
+void io_get_stats(io_t *io, io_stats_t *result);
+void io_reset_stats(io_t *io);
+// Get the latency below which a fraction (0 to 1) of the calls in a histogram fall
+uint64_t io_histogram_percentile(const uint64_t *histogram, double fraction);
 
 size_t io_block_size(io_t *io);
 // Get the first valid block; others before it may be reserved
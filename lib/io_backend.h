@@ -0,0 +1,88 @@
+#ifndef _MICROFS_IO_BACKEND_H
+#define _MICROFS_IO_BACKEND_H
+
+/**
+ * Interface between the block layer and the storage backends behind it.
+ *
+ * The block layer turns block operations into requests against byte ranges of the
+ * underlying storage; a backend carries them out.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "io.h"
+
+#define IO_OP_READ 0
+#define IO_OP_WRITE 1
+
+#define IO_REGION_DATA 0 // whole blocks, or payload slots when headers are kept apart
+#define IO_REGION_HEADER 1
+
+// Most segments accepted by a single preadv or pwritev on Linux
+#define IO_IOV_MAX 1024
+
+typedef struct io_request {
+    int op;
+    int region;
+    off_t start;
+    size_t size;
+    int iovcnt;
+    struct iovec iov[3];
+} io_request_t;
+
+// One or more requests merged into a single contiguous transfer
+typedef struct io_run {
+    int op;
+    off_t start;
+    size_t size;
+    ssize_t result; // bytes transferred, otherwise an errno code
+    int iovcnt;
+    struct iovec *iov;
+} io_run_t;
+
+struct io_backend {
+    // Open the storage and lay out its blocks with _io_layout
+    int (*init)(io_t *io, io_config_t *config);
+    void (*close)(io_t *io);
+
+    // Run requests, through the given descriptor where there is one (fh or fh_direct)
+    int (*execute)(io_t *io, int fh, io_request_t *requests, size_t count);
+
+    // Flush writes to stable storage; the block layer passes the range of bytes
+    // written since the last flush, or an empty one (start >= end) to flush everything
+    int (*sync)(io_t *io, size_t start, size_t end);
+    int (*advise)(io_t *io, int advice);
+
+    // Release a range of whole pages
+    int (*discard)(io_t *io, off_t start, off_t end);
+};
+
+extern const io_backend_t io_backend_file;
+extern const io_backend_t io_backend_memory;
+extern const io_backend_t io_backend_mmap;
+extern const io_backend_t io_backend_uring;
+extern const io_backend_t io_backend_sim;
+
+// Shared by the block layer and the backends
+size_t _io_align(size_t size);
+size_t _io_layout_size(io_t *io, size_t num_blocks);
+int _io_layout(io_t *io, size_t num_blocks);
+
+typedef int (*io_runs_fn_t)(io_t *io, int fh, io_run_t *runs, size_t count);
+int _io_execute_merged(io_t *io, int fh, io_request_t *requests, size_t count,
+                       io_runs_fn_t fn);
+
+// File descriptor based backends
+int _io_file_init(io_t *io, io_config_t *config);
+void _io_file_close(io_t *io);
+void _io_advance(io_run_t *run, size_t amount);
+int _io_transfer(io_t *io, int fh, io_run_t *run);
+int _io_file_sync(io_t *io, size_t start, size_t end);
+int _io_file_advise(io_t *io, int advice);
+int _io_file_discard(io_t *io, off_t start, off_t end);
+
+// Memory based backends
+int _io_memory_execute(io_t *io, int fh, io_request_t *requests, size_t count);
+
+#endif
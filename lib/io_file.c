@@ -0,0 +1,194 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// for open
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// for pread, pwrite
+#include <unistd.h>
+
+// for preadv, pwritev
+#include <sys/uio.h>
+
+// for discard
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+
+#include "io_backend.h"
+
+/**
+ * Backend for regular files and block devices, one system call per transfer.
+ */
+
+/**
+ * Move the start of a run forward past bytes that were already transferred.
+ */
+void _io_advance(io_run_t *request, size_t amount) {
+    request->start += amount;
+    request->size -= amount;
+
+    while (amount > 0 && request->iovcnt > 0) {
+        struct iovec *iov = &request->iov[0];
+        if (amount < iov->iov_len) {
+            iov->iov_base = (char *) iov->iov_base + amount;
+            iov->iov_len -= amount;
+            break;
+        }
+
+        amount -= iov->iov_len;
+        request->iovcnt--;
+        request->iov++;
+    }
+}
+
+/**
+ * Synchronously transfer a run, retrying until it is complete.
+ */
+int _io_transfer(io_t *io, int fh, io_run_t *request) {
+    ssize_t amount;
+    while (request->size > 0) {
+        if (request->op == IO_OP_WRITE) {
+            amount = pwritev(fh, request->iov, request->iovcnt, request->start);
+        } else {
+            amount = preadv(fh, request->iov, request->iovcnt, request->start);
+        }
+
+        if (amount < 0) {
+            if (errno == EINTR) { continue; }
+            return -errno;
+        }
+
+        if (amount == 0) {
+            return -EIO; // no progress; past the end of the file
+        }
+
+        _io_advance(request, amount);
+    }
+
+    return 0;
+}
+
+size_t _io_file_size(io_config_t *config) {
+    FILE *fp = fopen(config->path, "r+b");
+    if (fp == NULL) { return 0; }
+    fseek(fp, 0, SEEK_END);
+    size_t size = ftell(fp);
+    fclose(fp);
+
+    return size;
+}
+
+int _io_file_init(io_t *io, io_config_t *config) {
+    int r;
+
+    // Determine size of underlying file
+    size_t size = _io_file_size(config);
+
+    // Config
+    size_t num_blocks = size / config->block_size;
+    while (num_blocks > 0 && _io_layout_size(io, num_blocks) > size) {
+        num_blocks--; // header table padding
+    }
+    if(config->max_num_blocks > 0 && config->max_num_blocks < num_blocks) {
+        num_blocks = config->max_num_blocks;
+    }
+
+    r = _io_layout(io, num_blocks);
+    if (r != 0) { return r; }
+
+    // Open
+    io->fh = open(config->path, O_RDWR);
+    if (io->fh == -1) { return -errno; }
+
+    struct stat st;
+    if (fstat(io->fh, &st) == 0 && S_ISBLK(st.st_mode)) { io->is_device = 1; }
+
+    if (config->direct) {
+        io->fh_direct = open(config->path, O_RDWR | O_DIRECT);
+        if (io->fh_direct == -1) {
+            r = -errno;
+            close(io->fh);
+            io->fh = -1;
+            return r;
+        }
+    }
+
+    return 0;
+}
+
+void _io_file_close(io_t *io) {
+    if (io->fh != -1) { close(io->fh); }
+    if (io->fh_direct != -1) { close(io->fh_direct); }
+}
+
+int _io_file_runs(io_t *io, int fh, io_run_t *runs, size_t count) {
+    int r;
+
+    for (size_t i = 0; i < count; i++) {
+        r = _io_transfer(io, fh, &runs[i]);
+        if (r != 0) { return r; }
+    }
+
+    return 0;
+}
+
+int _io_file_execute(io_t *io, int fh, io_request_t *requests, size_t count) {
+    return _io_execute_merged(io, fh, requests, count, _io_file_runs);
+}
+
+int _io_file_sync(io_t *io, size_t start, size_t end) {
+    if (!io->direct && start < end) {
+        // Write back only the pages of the blocks written, then let fdatasync flush the
+        // device cache and any allocation metadata, which sync_file_range does not
+        int flags = SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                    SYNC_FILE_RANGE_WAIT_AFTER;
+        if (sync_file_range(io->fh, start, end - start, flags) != 0) { return -errno; }
+    }
+
+    if (fdatasync(io->fh) != 0) { return -errno; }
+    return 0;
+}
+
+int _io_file_advise(io_t *io, int advice) {
+    int r;
+
+    int flag = POSIX_FADV_NORMAL;
+    if (advice == IO_ADVICE_SEQUENTIAL) {
+        flag = POSIX_FADV_SEQUENTIAL;
+    } else if (advice == IO_ADVICE_RANDOM) {
+        flag = POSIX_FADV_RANDOM;
+    }
+
+    r = posix_fadvise(io->fh, 0, 0, flag);
+    if (r != 0) { return -r; }
+
+    return 0;
+}
+
+int _io_file_discard(io_t *io, off_t start, off_t end) {
+    if (io->is_device) {
+        uint64_t range[2] = {start, end - start};
+        if (ioctl(io->fh, BLKDISCARD, &range) != 0) { return -errno; }
+        return 0;
+    }
+
+    if (fallocate(io->fh, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start,
+                  end - start) != 0) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+const io_backend_t io_backend_file = {
+    .init = _io_file_init,
+    .close = _io_file_close,
+    .execute = _io_file_execute,
+    .sync = _io_file_sync,
+    .advise = _io_file_advise,
+    .discard = _io_file_discard,
+};
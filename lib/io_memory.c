@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <string.h>
+
+// for madvise
+#include <sys/mman.h>
+
+#include "io_backend.h"
+
+/**
+ * Backend keeping all blocks in RAM.
+ */
+
+int _io_memory_init(io_t *io, io_config_t *config) {
+    if(config->max_num_blocks <= 0) {
+        return -EINVAL;
+    }
+
+    int r;
+
+    // Config
+    r = _io_layout(io, config->max_num_blocks);
+    if (r != 0) { return r; }
+
+    // Allocate
+    size_t size = io->layout_size;
+    void *buffer = calloc(1, size);
+    if (buffer == NULL) { return -ENOMEM; }
+    io->buffer = buffer;
+    io->buffer_size = size;
+
+    return 0;
+}
+
+void _io_memory_close(io_t *io) {
+    free(io->buffer);
+}
+
+/**
+ * Copy requests to or from the buffer, which may also be a memory mapping.
+ */
+int _io_memory_execute(io_t *io, int fh, io_request_t *requests, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        io_request_t *request = &requests[i];
+
+        char *cursor = io->buffer + request->start;
+        for (int j = 0; j < request->iovcnt; j++) {
+            if (request->op == IO_OP_WRITE) {
+                memcpy(cursor, request->iov[j].iov_base, request->iov[j].iov_len);
+            } else {
+                memcpy(request->iov[j].iov_base, cursor, request->iov[j].iov_len);
+            }
+            cursor += request->iov[j].iov_len;
+        }
+    }
+
+    return 0;
+}
+
+int _io_memory_sync(io_t *io, size_t start, size_t end) {
+    return 0;
+}
+
+int _io_memory_advise(io_t *io, int advice) {
+    return 0;
+}
+
+int _io_memory_discard(io_t *io, off_t start, off_t end) {
+    // Pages of the allocation read back as zeros once released; the buffer itself may
+    // not be aligned
+    uintptr_t from = _io_align((uintptr_t) io->buffer + start);
+    uintptr_t to = ((uintptr_t) io->buffer + end) / IO_DIRECT_ALIGNMENT *
+        IO_DIRECT_ALIGNMENT;
+    if (from >= to) { return 0; }
+
+    if (madvise((void *) from, to - from, MADV_DONTNEED) != 0) { return -errno; }
+    return 0;
+}
+
+const io_backend_t io_backend_memory = {
+    .init = _io_memory_init,
+    .close = _io_memory_close,
+    .execute = _io_memory_execute,
+    .sync = _io_memory_sync,
+    .advise = _io_memory_advise,
+    .discard = _io_memory_discard,
+};
@@ -0,0 +1,74 @@
+#include <stdlib.h>
+
+// for mmap
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "io_backend.h"
+
+/**
+ * Backend accessing a file through a shared memory mapping.
+ */
+
+int _io_mmap_init(io_t *io, io_config_t *config) {
+    int r;
+
+    r = _io_file_init(io, config);
+    if (r != 0) { return r; }
+
+    // Map only whole valid blocks
+    size_t size = io->layout_size;
+    void *buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, io->fh, 0);
+    if (buffer == MAP_FAILED) {
+        r = -errno;
+        close(io->fh);
+        io->fh = -1;
+        return r;
+    }
+
+    io->buffer = buffer;
+    io->buffer_size = size;
+
+    return 0;
+}
+
+void _io_mmap_close(io_t *io) {
+    if (io->buffer != NULL) { munmap(io->buffer, io->buffer_size); }
+    _io_file_close(io);
+}
+
+int _io_mmap_sync(io_t *io, size_t start, size_t end) {
+    if (start >= end) {
+        // The whole mapping
+        start = 0;
+        end = io->buffer_size;
+    }
+
+    // Flush only the pages covering written blocks
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    start = start / page_size * page_size;
+
+    if (msync(io->buffer + start, end - start, MS_SYNC) != 0) { return -errno; }
+    return 0;
+}
+
+int _io_mmap_advise(io_t *io, int advice) {
+    int flag = MADV_NORMAL;
+    if (advice == IO_ADVICE_SEQUENTIAL) {
+        flag = MADV_SEQUENTIAL;
+    } else if (advice == IO_ADVICE_RANDOM) {
+        flag = MADV_RANDOM;
+    }
+
+    if (madvise(io->buffer, io->buffer_size, flag) != 0) { return -errno; }
+    return 0;
+}
+
+const io_backend_t io_backend_mmap = {
+    .init = _io_mmap_init,
+    .close = _io_mmap_close,
+    .execute = _io_memory_execute,
+    .sync = _io_mmap_sync,
+    .advise = _io_mmap_advise,
+    .discard = _io_file_discard, // the mapping sees the holes
+};
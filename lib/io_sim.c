@@ -0,0 +1,112 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "io_backend.h"
+
+/**
+ * Backend simulating a slower device on top of the memory or file backend.
+ *
+ * Each batch of requests waits for the latency of its slowest operation, once per
+ * IO_QUEUE_DEPTH requests since that many are in flight at once, plus the time to
+ * move its bytes at the configured bandwidth.
+ */
+
+typedef struct io_sim {
+    const io_backend_t *inner;
+    io_sim_config_t config;
+} io_sim_t;
+
+void _io_sim_wait(long microseconds) {
+    if (microseconds <= 0) { return; }
+
+    struct timespec delay = {
+        .tv_sec = microseconds / 1000000,
+        .tv_nsec = (microseconds % 1000000) * 1000
+    };
+
+    // Resume after signals until the whole delay has passed
+    while (nanosleep(&delay, &delay) != 0) {}
+}
+
+int _io_sim_init(io_t *io, io_config_t *config) {
+    io_sim_t *sim = malloc(sizeof(io_sim_t));
+    if (sim == NULL) { return -ENOMEM; }
+
+    sim->config = config->sim;
+    sim->inner = &io_backend_file;
+    if (strcmp(config->path, ":memory:") == 0) {
+        sim->inner = &io_backend_memory;
+    }
+
+    io->state = sim;
+
+    return sim->inner->init(io, config);
+}
+
+void _io_sim_close(io_t *io) {
+    io_sim_t *sim = io->state;
+    if (sim == NULL) { return; }
+
+    sim->inner->close(io);
+    free(sim);
+}
+
+int _io_sim_execute(io_t *io, int fh, io_request_t *requests, size_t count) {
+    int r;
+
+    io_sim_t *sim = io->state;
+
+    r = sim->inner->execute(io, fh, requests, count);
+    if (r != 0) { return r; }
+
+    long latency = 0;
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        long op_latency = (requests[i].op == IO_OP_WRITE) ? sim->config.write_latency
+                                                           : sim->config.read_latency;
+        if (op_latency > latency) { latency = op_latency; }
+        bytes += requests[i].size;
+    }
+
+    long delay = latency * ((count + IO_QUEUE_DEPTH - 1) / IO_QUEUE_DEPTH);
+    if (sim->config.bandwidth > 0) {
+        delay += (long) ((double) bytes * 1000000 / sim->config.bandwidth);
+    }
+
+    _io_sim_wait(delay);
+
+    return 0;
+}
+
+int _io_sim_sync(io_t *io, size_t start, size_t end) {
+    int r;
+
+    io_sim_t *sim = io->state;
+
+    r = sim->inner->sync(io, start, end);
+    if (r != 0) { return r; }
+
+    _io_sim_wait(sim->config.sync_latency);
+
+    return 0;
+}
+
+int _io_sim_advise(io_t *io, int advice) {
+    io_sim_t *sim = io->state;
+    return sim->inner->advise(io, advice);
+}
+
+int _io_sim_discard(io_t *io, off_t start, off_t end) {
+    io_sim_t *sim = io->state;
+    return sim->inner->discard(io, start, end);
+}
+
+const io_backend_t io_backend_sim = {
+    .init = _io_sim_init,
+    .close = _io_sim_close,
+    .execute = _io_sim_execute,
+    .sync = _io_sim_sync,
+    .advise = _io_sim_advise,
+    .discard = _io_sim_discard,
+};
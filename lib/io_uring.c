@@ -0,0 +1,261 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// for mmap
+#include <sys/mman.h>
+
+// for io_uring
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "io_backend.h"
+
+/**
+ * File backend that batches transfers through io_uring, without liburing.
+ */
+
+struct io_ring {
+    int fd;
+    unsigned entries;
+
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    pthread_mutex_t lock; // one caller submits and reaps at a time
+};
+
+/**
+ * Set up a submission and completion queue pair without liburing.
+ */
+int _io_ring_init(struct io_ring *ring, unsigned entries) {
+    int r;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) { return -errno; }
+
+    // Nothing mapped yet, for the error path
+    ring->sq_ptr = MAP_FAILED;
+    ring->cq_ptr = MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+
+    ring->entries = params.sq_entries;
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    int single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring->cq_size > ring->sq_size) { ring->sq_size = ring->cq_size; }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) { goto error; }
+
+    if (single) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) { goto error; }
+    }
+
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) { goto error; }
+
+    char *sq = ring->sq_ptr;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+
+    char *cq = ring->cq_ptr;
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    return 0;
+
+error:
+    r = -errno;
+    // Release the mappings that succeeded, like _io_ring_free
+    if (ring->sqes != MAP_FAILED) { munmap(ring->sqes, ring->sqes_size); }
+    if (ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    if (ring->sq_ptr != MAP_FAILED) { munmap(ring->sq_ptr, ring->sq_size); }
+    close(ring->fd);
+    return r;
+}
+
+void _io_ring_free(struct io_ring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != ring->sq_ptr) { munmap(ring->cq_ptr, ring->cq_size); }
+    munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->fd);
+}
+
+/**
+ * Submit requests with a single system call and wait for all of them to complete.
+ *
+ * The outcome of each request is stored in its result. Requests the kernel did not
+ * take are withdrawn and left with a result of 0, for the caller to finish; the
+ * ring is empty again on return, as the kernel holds on to the iovecs until then.
+ */
+int _io_ring_submit(struct io_ring *ring, int fh, io_run_t *requests, unsigned count) {
+    int r;
+
+    unsigned first = *ring->sq_tail;
+    unsigned tail = first;
+    for (unsigned i = 0; i < count; i++) {
+        unsigned index = tail & *ring->sq_mask;
+
+        struct io_uring_sqe *sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = (requests[i].op == IO_OP_WRITE) ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = fh;
+        sqe->addr = (uintptr_t) requests[i].iov;
+        sqe->len = requests[i].iovcnt;
+        sqe->off = requests[i].start;
+        sqe->user_data = i;
+
+        requests[i].result = 0;
+        ring->sq_array[index] = index;
+        tail++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    unsigned submitted = 0;
+    while (submitted < count) {
+        r = syscall(__NR_io_uring_enter, ring->fd, count - submitted, count - submitted,
+                    IORING_ENTER_GETEVENTS, NULL, 0);
+        if (r > 0) { submitted += r; }
+        if (r >= 0 || errno == EINTR) { continue; }
+
+        // Take back whatever the kernel hasn't consumed; the rest must still be reaped
+        submitted = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) - first;
+        __atomic_store_n(ring->sq_tail, first + submitted, __ATOMIC_RELEASE);
+        break;
+    }
+
+    // Reap completions
+    unsigned completed = 0;
+    unsigned head = *ring->cq_head;
+    while (completed < submitted) {
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            // Completions are posted whether or not this succeeds, so keep waiting
+            syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            continue;
+        }
+
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        requests[cqe->user_data].result = cqe->res;
+
+        head++;
+        completed++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+/**
+ * Run transfers, up to one ring at a time, and finish short or unsubmitted ones
+ * synchronously.
+ */
+int _io_uring_runs(io_t *io, int fh, io_run_t *runs, size_t count) {
+    int r;
+
+    struct io_ring *ring = io->state;
+
+    pthread_mutex_lock(&ring->lock);
+    r = 0;
+    for (size_t i = 0; r == 0 && i < count; i += ring->entries) {
+        size_t amount = count - i;
+        if (amount > ring->entries) { amount = ring->entries; }
+
+        r = _io_ring_submit(ring, fh, runs + i, amount);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    if (r != 0) { return r; }
+
+    for (size_t i = 0; i < count; i++) {
+        io_run_t *run = &runs[i];
+        if (run->result < 0) { return run->result; }
+        if (run->result == run->size) { continue; }
+
+        _io_advance(run, run->result);
+        r = _io_transfer(io, fh, run);
+        if (r != 0) { return r; }
+    }
+
+    return 0;
+}
+
+int _io_uring_execute(io_t *io, int fh, io_request_t *requests, size_t count) {
+    return _io_execute_merged(io, fh, requests, count, _io_uring_runs);
+}
+
+int _io_uring_init(io_t *io, io_config_t *config) {
+    int r;
+
+    r = _io_file_init(io, config);
+    if (r != 0) { return r; }
+
+    struct io_ring *ring = malloc(sizeof(struct io_ring));
+    if (ring == NULL) { return -ENOMEM; }
+
+    r = _io_ring_init(ring, IO_QUEUE_DEPTH);
+    if (r != 0) {
+        // Not supported by this kernel or sandbox; queued operations run one by one
+        free(ring);
+        io->backend = IO_BACKEND_FILE;
+        io->ops = &io_backend_file;
+        return 0;
+    }
+
+    pthread_mutex_init(&ring->lock, NULL);
+    io->state = ring;
+    return 0;
+}
+
+void _io_uring_close(io_t *io) {
+    if (io->state != NULL) {
+        struct io_ring *ring = io->state;
+        pthread_mutex_destroy(&ring->lock);
+        _io_ring_free(ring);
+        free(ring);
+    }
+
+    _io_file_close(io);
+}
+
+const io_backend_t io_backend_uring = {
+    .init = _io_uring_init,
+    .close = _io_uring_close,
+    .execute = _io_uring_execute,
+    .sync = _io_file_sync,
+    .advise = _io_file_advise,
+    .discard = _io_file_discard,
+};
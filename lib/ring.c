@@ -0,0 +1,85 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+/**
+ * Each slot carries a sequence number. A slot is free for the producer claiming
+ * position p when its sequence is p, and holds an entry for the consumer at position
+ * p when its sequence is p + 1. Producers claim positions with a compare and swap on
+ * the tail, so none of them ever waits on a lock held by another.
+ */
+
+int ring_init(ring_t *ring, size_t capacity, int entry_size) {
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0) { return -EINVAL; }
+
+    ring->entries = malloc(capacity * entry_size);
+    ring->sequences = malloc(capacity * sizeof(size_t));
+    if (ring->entries == NULL || ring->sequences == NULL) {
+        ring_free(ring);
+        return -ENOMEM;
+    }
+
+    ring->entry_size = entry_size;
+    ring->capacity = capacity;
+    ring->mask = capacity - 1;
+    ring->head = 0;
+    ring->tail = 0;
+
+    for (size_t i = 0; i < capacity; i++) {
+        ring->sequences[i] = i;
+    }
+
+    return 0;
+}
+
+void ring_free(ring_t *ring) {
+    free(ring->entries);
+    free(ring->sequences);
+    ring->entries = NULL;
+    ring->sequences = NULL;
+}
+
+int ring_push(ring_t *ring, const void *entry) {
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+    while (1) {
+        size_t index = tail & ring->mask;
+        size_t sequence = __atomic_load_n(&ring->sequences[index], __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) sequence - (intptr_t) tail;
+
+        if (diff < 0) {
+            return -EAGAIN; // full; the consumer has not released this slot yet
+        }
+
+        if (diff > 0) {
+            // Another producer claimed this position first
+            tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (__atomic_compare_exchange_n(&ring->tail, &tail, tail + 1, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            memcpy(ring->entries + index * ring->entry_size, entry, ring->entry_size);
+            __atomic_store_n(&ring->sequences[index], tail + 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+    }
+}
+
+int ring_pop(ring_t *ring, void *result) {
+    size_t index = ring->head & ring->mask;
+    size_t sequence = __atomic_load_n(&ring->sequences[index], __ATOMIC_ACQUIRE);
+
+    // Empty, or the producer that claimed the slot is still copying its entry
+    if (sequence != ring->head + 1) { return -EAGAIN; }
+
+    memcpy(result, ring->entries + index * ring->entry_size, ring->entry_size);
+    __atomic_store_n(&ring->sequences[index], ring->head + ring->capacity,
+                     __ATOMIC_RELEASE);
+    ring->head++;
+
+    return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef _RING_H
+#define _RING_H
+
+/**
+ * A bounded queue for many producers and a single consumer, without locks.
+ */
+
+#include <stddef.h>
+
+typedef struct ring {
+    char *entries;
+    int entry_size;
+    size_t *sequences; // per slot, tells producers and the consumer whose turn it is
+    size_t capacity; // a power of two
+    size_t mask;
+
+    size_t head; // next slot to consume, only touched by the consumer
+    size_t tail; // next slot to claim, shared by producers
+} ring_t;
+
+int ring_init(ring_t *ring, size_t capacity, int entry_size);
+void ring_free(ring_t *ring);
+
+// Add an entry from any thread; fails with -EAGAIN when full
+int ring_push(ring_t *ring, const void *entry);
+// Take the oldest entry from the consumer thread; fails with -EAGAIN when empty
+int ring_pop(ring_t *ring, void *result);
+
+#endif
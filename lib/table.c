@@ -29,6 +29,32 @@ int table_init(table_t *table, int row_size, comparison_fn_t comparator) {
     return 0;
 }
 
+/**
+ * Bound the memory used by rows and indexes; any excess is spilled to a file in dir.
+ *
+ * The budget is shared between the rows and each index in proportion to their entry
+ * sizes. Must be called after all indexes have been added.
+ */
+int table_set_spill(table_t *table, const char *dir, size_t budget) {
+    int r;
+
+    size_t num_indexes = array_len(&table->indexes);
+    size_t total = table->rows.entry_size + num_indexes * sizeof(size_t);
+
+    r = array_set_spill(&table->rows, dir, budget / total * table->rows.entry_size);
+    if(r != 0) { return r; }
+
+    int _callback(void *raw) {
+        array_t *index = (array_t *) raw;
+        if(r != 0) { return r; }
+        r = array_set_spill(index, dir, budget / total * sizeof(size_t));
+        return r;
+    }
+
+    array_each(&table->indexes, _callback);
+    return r;
+}
+
 void table_free(table_t *table) {
     array_free(&table->rows);
 
@@ -148,8 +174,7 @@ int table_query_all(table_t *table, void *key, int table_index_id,
     
     int _callback(void *raw) {
         size_t *row_id = (size_t *) raw;
-        callback((void *) array_dereference(&index, row_id));
-        return 0;
+        return callback((void *) array_dereference(&index, row_id));
     }
 
     r = array_sorted_each(&index, comparator, key, _callback);
@@ -19,6 +19,7 @@ int table_init(table_t *table, int row_size, comparison_fn_t comparator);
 void table_free(table_t *table);
 
 int table_add_index(table_t *table, comparison_fn_t comparator);
+int table_set_spill(table_t *table, const char *dir, size_t budget);
 
 int table_insert(table_t *table, void *row);
 int table_insert_or_replace(table_t *table, void *row);
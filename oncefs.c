@@ -1,9 +1,11 @@
 #include <errno.h>
 #include <libgen.h>
+#include <sched.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
 #include <time.h>
 
 #include "oncefs.h"
@@ -11,18 +13,14 @@
 #define TABLE_INDEX_PRIMARY 0
 #define TABLE_INDEX_LOOKUP 1
 
-#define NODE_TYPE_DIR 1
-#define NODE_TYPE_FILE 2
-#define NODE_TYPE_LINK 3
-#define NODE_TYPE_LINK_PAYLOAD 4
+// Largest record of any version: a tag with a node, or a tag with a data header
+#define ONCEFS_RECORD_MAX_SIZE (sizeof(oncefs_tag_t) + sizeof(oncefs_node_t))
+#define ONCEFS_HEADER_MAX_SIZE ONCEFS_LEGACY_OVERHEAD_SIZE
 
-#define BLOCK_OPERATION_FREE 0
-#define BLOCK_OPERATION_NODE 1
-#define BLOCK_OPERATION_DATA 2
-#define BLOCK_OPERATION_TRUNCATE 3
-#define BLOCK_OPERATION_DELETE 4
-#define BLOCK_OPERATION_MOVE 5
-#define BLOCK_OPERATION_LAST 8
+static const char ONCEFS_MAGIC[8] = "oncefs\0\0";
+
+// Marks a pending discard whose block was reused
+#define ONCEFS_DISCARD_CANCELLED UINT64_MAX
 
 typedef struct oncefs_tagged_block_t {
     uint32_t block;
@@ -107,6 +105,22 @@ int _oncefs_block_cmp_primary(const void *raw_a, const void *raw_b) {
     return 0;
 }
 
+/**
+ * Comparison function ordering pending discards by block.
+ *
+ * Arguments:
+ *     raw_a:   A pointer to the first discard.
+ *     raw_b:   A pointer to the second discard.
+ *
+ * Returns:
+ *     Comparison value.
+ */
+int _oncefs_discard_cmp(const void *raw_a, const void *raw_b) {
+    uint32_t a = ((oncefs_discard_t *) raw_a)->block;
+    uint32_t b = ((oncefs_discard_t *) raw_b)->block;
+    return (a < b) ? -1 : (a > b);
+}
+
 /**
  * Comparison function to find all blocks for a specific operation and node.
  *
@@ -176,8 +190,302 @@ int _oncefs_block_cmp_lookup(const void *raw_a, const void *raw_b) {
     return 0;
 }
 
+void _oncefs_put(uint8_t **cursor, uint64_t value, int size) {
+    for (int i = 0; i < size; i++) {
+        (*cursor)[i] = value >> (8 * i);
+    }
+    *cursor += size;
+}
+
+uint64_t _oncefs_get(const uint8_t **cursor, int size) {
+    uint64_t value = 0;
+    for (int i = 0; i < size; i++) {
+        value |= (uint64_t) (*cursor)[i] << (8 * i);
+    }
+    *cursor += size;
+    return value;
+}
+
+/**
+ * Encode a record as stored on disk.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the instance.
+ *     buffer:  The destination; room for ONCEFS_RECORD_MAX_SIZE bytes.
+ *     tag:     The tag of the block.
+ *     data:    (optional) A data header to follow the tag.
+ *     node:    (optional) A node to follow the tag, if there is no data header.
+ *
+ * Returns:
+ *     The size of the record in bytes.
+ */
+size_t _oncefs_pack(oncefs_t *ofs, uint8_t *buffer, oncefs_tag_t *tag,
+                    oncefs_data_t *data, oncefs_node_t *node) {
+    if (ofs->version == ONCEFS_VERSION_LEGACY) {
+        memcpy(buffer, tag, sizeof(*tag));
+        if (data != NULL) {
+            memcpy(buffer + sizeof(*tag), data, sizeof(*data));
+            return sizeof(*tag) + sizeof(*data);
+        }
+        memcpy(buffer + sizeof(*tag), node, sizeof(*node));
+        return sizeof(*tag) + sizeof(*node);
+    }
+
+    uint8_t *cursor = buffer;
+    _oncefs_put(&cursor, tag->seq, 8);
+    _oncefs_put(&cursor, (uint8_t) tag->operation, 1);
+    if (ofs->version >= ONCEFS_VERSION) {
+        _oncefs_put(&cursor, ofs->epoch, 4);
+    }
+
+    if (data != NULL) {
+        _oncefs_put(&cursor, data->node, 4);
+        _oncefs_put(&cursor, data->fill, 2);
+        _oncefs_put(&cursor, data->offset, 8);
+    } else {
+        _oncefs_put(&cursor, node->node, 4);
+        _oncefs_put(&cursor, node->parent, 4);
+        _oncefs_put(&cursor, (uint8_t) node->type, 1);
+        _oncefs_put(&cursor, node->last_access, 8);
+        _oncefs_put(&cursor, node->last_modification, 8);
+        _oncefs_put(&cursor, node->mode, 2);
+        memcpy(cursor, node->name, ONCEFS_NAME_MAX_SIZE + 1);
+        cursor += ONCEFS_NAME_MAX_SIZE + 1;
+    }
+
+    return cursor - buffer;
+}
+
+/**
+ * Whether blocks of an operation carry a data header, rather than a node.
+ */
+int _oncefs_has_data(int operation) {
+    return operation == BLOCK_OPERATION_DATA || operation == BLOCK_OPERATION_TRUNCATE ||
+           operation == BLOCK_OPERATION_FREE;
+}
+
+/**
+ * Get the size of a tag as stored on disk.
+ */
+size_t _oncefs_tag_size(oncefs_t *ofs) {
+    if (ofs->version == ONCEFS_VERSION_LEGACY) { return sizeof(oncefs_tag_t); }
+    if (ofs->version == ONCEFS_VERSION_PACKED) { return ONCEFS_TAG_SIZE - 4; }
+
+    return ONCEFS_TAG_SIZE;
+}
+
+/**
+ * Get the size of what follows the tag of a block as stored on disk.
+ */
+size_t _oncefs_entry_size(oncefs_t *ofs, int is_data) {
+    if (ofs->version == ONCEFS_VERSION_LEGACY) {
+        return is_data ? sizeof(oncefs_data_t) : sizeof(oncefs_node_t);
+    }
+
+    return is_data ? ONCEFS_DATA_SIZE : ONCEFS_NODE_SIZE;
+}
+
+void _oncefs_unpack_tag(oncefs_t *ofs, const uint8_t *buffer, oncefs_tag_t *tag) {
+    if (ofs->version == ONCEFS_VERSION_LEGACY) {
+        memcpy(tag, buffer, sizeof(*tag));
+        tag->epoch = ofs->epoch; // padding
+        return;
+    }
+
+    tag->seq = _oncefs_get(&buffer, 8);
+    tag->operation = _oncefs_get(&buffer, 1);
+    tag->epoch = ofs->epoch;
+    if (ofs->version >= ONCEFS_VERSION) {
+        tag->epoch = _oncefs_get(&buffer, 4);
+    }
+}
+
+void _oncefs_unpack_data(oncefs_t *ofs, const uint8_t *buffer, oncefs_data_t *data) {
+    if (ofs->version == ONCEFS_VERSION_LEGACY) {
+        memcpy(data, buffer, sizeof(*data));
+        return;
+    }
+
+    data->node = _oncefs_get(&buffer, 4);
+    data->fill = _oncefs_get(&buffer, 2);
+    data->offset = _oncefs_get(&buffer, 8);
+}
+
+void _oncefs_unpack_node(oncefs_t *ofs, const uint8_t *buffer, oncefs_node_t *node) {
+    if (ofs->version == ONCEFS_VERSION_LEGACY) {
+        memcpy(node, buffer, sizeof(*node));
+        return;
+    }
+
+    node->node = _oncefs_get(&buffer, 4);
+    node->parent = _oncefs_get(&buffer, 4);
+    node->type = _oncefs_get(&buffer, 1);
+    node->last_access = _oncefs_get(&buffer, 8);
+    node->last_modification = _oncefs_get(&buffer, 8);
+    node->mode = _oncefs_get(&buffer, 2);
+    memcpy(node->name, buffer, ONCEFS_NAME_MAX_SIZE + 1);
+    node->name[ONCEFS_NAME_MAX_SIZE] = '\0';
+}
+
+/**
+ * Helper to count a block written to storage.
+ *
+ * Every block takes a whole block of storage whatever it holds, so its physical
+ * size includes the record header and any padding after a partial payload.
+ *
+ * Arguments:
+ *     ofs:         A pointer to the instance.
+ *     operation:   The operation of the block.
+ *     logical:     The bytes of caller data it carries.
+ */
+void _oncefs_account(oncefs_t *ofs, int operation, size_t logical) {
+    oncefs_amplification_t *counter = &ofs->amplification[operation];
+
+    counter->blocks++;
+    counter->logical += logical;
+    counter->physical += ofs->block_size;
+}
+
+/**
+ * Helper to persist a block holding a node.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the instance.
+ *     block:   The block to write to.
+ *     node:    The node to store.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int _oncefs_write_node(oncefs_t *ofs, oncefs_block_t *block, oncefs_node_t *node) {
+    uint8_t record[ONCEFS_RECORD_MAX_SIZE];
+    size_t size = _oncefs_pack(ofs, record, &block->tag, NULL, node);
+
+    _oncefs_account(ofs, block->tag.operation, 0);
+
+    return io_write(ofs->io, block->block, record, size);
+}
+
+/**
+ * Helper to persist a block holding a data header and payload.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the instance.
+ *     block:   The block to write to, with its data header.
+ *     payload: (optional) The payload of the block.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int _oncefs_write_data(oncefs_t *ofs, oncefs_block_t *block, const char *payload) {
+    uint8_t record[ONCEFS_RECORD_MAX_SIZE];
+    size_t size = _oncefs_pack(ofs, record, &block->tag, &block->data, NULL);
+
+    int fill = payload != NULL ? block->data.fill : 0;
+    _oncefs_account(ofs, block->tag.operation, fill);
+
+    return io_write2(ofs->io, block->block, record, size, payload, fill);
+}
+
 int _oncefs_format(oncefs_t *ofs);
 int _oncefs_load(oncefs_t *ofs);
+int _oncefs_del_node_at(oncefs_t *ofs, uint32_t parent, const char *name);
+
+/**
+ * Read the superblock of a container.
+ *
+ * Arguments:
+ *     io:      A pointer to an input-output instance.
+ *     result:  The destination for the superblock.
+ *
+ * Returns:
+ *     0 on success, -ENOENT if the container has no superblock (it is unformatted or
+ *     uses the legacy format), otherwise an errno code.
+ */
+int oncefs_probe(io_t *io, oncefs_super_t *result) {
+    int r;
+
+    uint8_t buffer[ONCEFS_SUPER_SIZE];
+    r = io_read(io, 0, buffer, sizeof(buffer));
+    if (r != 0) { return r; }
+
+    if (memcmp(buffer, ONCEFS_MAGIC, sizeof(ONCEFS_MAGIC)) != 0) { return -ENOENT; }
+
+    const uint8_t *cursor = buffer + sizeof(ONCEFS_MAGIC);
+    result->version = _oncefs_get(&cursor, 4);
+    result->block_size = _oncefs_get(&cursor, 4);
+    result->header_size = _oncefs_get(&cursor, 4);
+    result->num_blocks = _oncefs_get(&cursor, 8);
+    result->epoch = 0;
+    if (result->version >= ONCEFS_VERSION) {
+        result->epoch = _oncefs_get(&cursor, 4);
+    }
+
+    return 0;
+}
+
+/**
+ * Helper to write the superblock describing the container.
+ */
+int _oncefs_write_super(oncefs_t *ofs) {
+    uint8_t buffer[ONCEFS_SUPER_SIZE];
+
+    memcpy(buffer, ONCEFS_MAGIC, sizeof(ONCEFS_MAGIC));
+    uint8_t *cursor = buffer + sizeof(ONCEFS_MAGIC);
+    _oncefs_put(&cursor, ofs->version, 4);
+    _oncefs_put(&cursor, ofs->block_size, 4);
+    _oncefs_put(&cursor, ofs->io->header_size, 4);
+    _oncefs_put(&cursor, ofs->last_block_id + 1, 8);
+    _oncefs_put(&cursor, ofs->epoch, 4);
+
+    return io_write(ofs->io, 0, buffer, sizeof(buffer));
+}
+
+/**
+ * Helper to pick the on-disk format of the container.
+ */
+int _oncefs_detect_version(oncefs_t *ofs, int format) {
+    int r;
+
+    ofs->version = ONCEFS_VERSION;
+    ofs->epoch = 0;
+    if (ofs->io == NULL) { return 0; }
+
+    oncefs_super_t super;
+    r = oncefs_probe(ofs->io, &super);
+    if (format == 1) {
+        // Any tag left from before must not match the new epoch. Those of this version
+        // carry an older one; in other formats the same bytes hold anything, like the
+        // small node identifiers of version 1, so start from a random high epoch
+        if (r == 0 && super.version >= ONCEFS_VERSION) {
+            ofs->epoch = super.epoch + 1;
+        } else if (getrandom(&ofs->epoch, sizeof(ofs->epoch), 0) != sizeof(ofs->epoch)) {
+            return -errno;
+        }
+        ofs->epoch |= ONCEFS_EPOCH_MIN;
+        return 0;
+    }
+
+    if (r == -ENOENT) {
+        ofs->version = ONCEFS_VERSION_LEGACY;
+        return 0;
+    }
+    if (r != 0) { return r; }
+
+    if (super.version > ONCEFS_VERSION) { return -ENOTSUP; }
+
+    if (super.block_size != ofs->block_size || super.header_size != ofs->io->header_size) {
+        return -EINVAL; // opened with a different geometry
+    }
+
+    if (super.header_size > 0 && super.num_blocks != ofs->last_block_id + 1) {
+        return -EINVAL; // the header table would be in the wrong place
+    }
+
+    ofs->version = super.version;
+    ofs->epoch = super.epoch;
+    return 0;
+}
 
 /**
  * Initializer.
@@ -186,11 +494,12 @@ int _oncefs_load(oncefs_t *ofs);
  *     ofs:     A pointer to the instance. 
  *     io:      A pointer to an input-output instance.
  *     format:  Pass 1 to format the underlying file before reading, 0 otherwise.
+ *     config:  (optional) A pointer to additional settings.
  *
  * Returns:
  *     0 on success, otherwise an errno code.
  */
-int oncefs_init(oncefs_t *ofs, io_t *io, int format) {
+int oncefs_init2(oncefs_t *ofs, io_t *io, int format, oncefs_config_t *config) {
     int r;
     ofs->next_node_id = 1;
     ofs->next_seq_id = 1;
@@ -207,7 +516,23 @@ int oncefs_init(oncefs_t *ofs, io_t *io, int format) {
     }
 
     ofs->next_block_id = ofs->first_block_id;
-    ofs->payload_size = ofs->block_size - sizeof(oncefs_tag_t) - sizeof(oncefs_data_t);
+
+    array_init(&ofs->discards, sizeof(oncefs_discard_t));
+    array_sort(&ofs->discards, _oncefs_discard_cmp);
+    pthread_mutex_init(&ofs->discard_lock, NULL);
+    pthread_rwlock_init(&ofs->lock, NULL);
+    ofs->writer_running = 0;
+    ofs->generation = 0;
+    ofs->discard_rate = (config != NULL) ? config->discard_rate : 0;
+    ofs->discard_max = ONCEFS_DISCARD_MAX;
+    ofs->discard_round = 0;
+    memset(ofs->amplification, 0, sizeof(ofs->amplification));
+
+    r = _oncefs_detect_version(ofs, format);
+    if (r != 0) { return r; }
+
+    ofs->overhead_size = _oncefs_tag_size(ofs) + _oncefs_entry_size(ofs, 1);
+    ofs->payload_size = ofs->block_size - ofs->overhead_size;
     if (ofs->payload_size < 0) { return -EINVAL; }
 
     r = table_init(&ofs->nodes, sizeof(oncefs_node_t), _oncefs_node_cmp_primary);
@@ -220,6 +545,15 @@ int oncefs_init(oncefs_t *ofs, io_t *io, int format) {
     r = table_add_index(&ofs->blocks, _oncefs_block_cmp_lookup);
     if (r != 0) { return r; }
 
+    if (config != NULL && config->memory_budget > 0) {
+        // Nodes are few compared to blocks, so give most of the budget to blocks
+        size_t budget = config->memory_budget;
+        r = table_set_spill(&ofs->nodes, config->spill_path, budget / 4);
+        if (r != 0) { return r; }
+        r = table_set_spill(&ofs->blocks, config->spill_path, budget - budget / 4);
+        if (r != 0) { return r; }
+    }
+
     if (io != NULL) {
         if (format == 1) {
             r = _oncefs_format(ofs);
@@ -241,141 +575,457 @@ int oncefs_init(oncefs_t *ofs, io_t *io, int format) {
  *     ofs:     A pointer to the instance. 
  */
 void oncefs_free(oncefs_t *ofs) {
+    oncefs_stop_writer(ofs);
+
     table_free(&ofs->nodes);
     table_free(&ofs->blocks);
+    array_free(&ofs->discards);
+    pthread_mutex_destroy(&ofs->discard_lock);
+    pthread_rwlock_destroy(&ofs->lock);
 }
 
+// A change waiting for the writer thread, described by a callback on its caller's stack
+typedef struct oncefs_request {
+    int (*apply)();
+    int *result;
+    sem_t *done;
+} oncefs_request_t;
+
 /**
- * Allocate a block, reusing an existing one if possible.
+ * Apply a change with the instance locked for writing.
+ *
+ * With the writer thread running, the change is queued for it instead and the caller
+ * waits for its result, so changes are applied in the order they arrive.
  *
  * Arguments:
- *     ofs:     A pointer to the instance. 
- *     block:   The destination for the newly allocated block id.
- *     node:    (optional) A node id for which any associated block may be reused.
+ *     ofs:     A pointer to the instance.
+ *     apply:   The change; it runs with the lock held and returns an errno code.
  *
  * Returns:
- *     0 on success, otherwise an errno code.
+ *     The result of the change.
  */
-int _oncefs_block_reuse(oncefs_t *ofs, uint32_t *block, uint32_t node) {
+int _oncefs_write(oncefs_t *ofs, int (*apply)()) {
     int r;
 
-    int _filter(const void *raw_key, const void *raw_other) {
-        oncefs_block_t *k = (oncefs_block_t *) raw_key;
-        oncefs_block_t *o = (oncefs_block_t *) raw_other;
+    if (!__atomic_load_n(&ofs->writer_running, __ATOMIC_ACQUIRE)) {
+        pthread_rwlock_wrlock(&ofs->lock);
+        ofs->generation++;
+        r = apply();
+        pthread_rwlock_unlock(&ofs->lock);
+        return r;
+    }
 
-        if (k->tag.operation < o->tag.operation) {
-            return -1;
-        } else if (k->tag.operation > o->tag.operation) {
-            return 1;
-        }
+    sem_t done;
+    sem_init(&done, 0, 0);
 
-        return 0;
-    };
+    oncefs_request_t request = {.apply = apply, .result = &r, .done = &done};
+    while (ring_push(&ofs->requests, &request) != 0) {
+        sched_yield(); // full; the writer is busy with a batch
+    }
+    sem_post(&ofs->writer_wake);
 
-    oncefs_block_t key;
-    key.tag.operation = BLOCK_OPERATION_FREE;
+    while (sem_wait(&done) != 0) {} // resume after signals
+    sem_destroy(&done);
 
-    oncefs_block_t result;
+    return r;
+}
 
-    r = table_query_first(&ofs->blocks, (void *) &key, TABLE_INDEX_LOOKUP, _filter,
-                           (void *) &result);
-    if (r == 0) {
-        *block = result.block;
-        return 0;
-    }
+/**
+ * Writer thread applying queued changes, each batch under a single hold of the lock.
+ */
+void *_oncefs_writer(void *raw) {
+    oncefs_t *ofs = (oncefs_t *) raw;
 
-    // If there are no free blocks then any "delete" block
-    // can safely be treated as obsolete
-    key.tag.operation = BLOCK_OPERATION_DELETE;
-    r = table_query_first(&ofs->blocks, (void *) &key, TABLE_INDEX_LOOKUP, _filter,
-                           (void *) &result);
-    if (r == 0) {
-        *block = result.block;
-        return 0;
-    }
+    oncefs_request_t batch[ONCEFS_WRITER_QUEUE];
+    int stopping = 0;
 
-    if (node < 1) {
-        // not a valid node id (disable takeover mode)
-        return -ENOSPC;
-    }
+    while (1) {
+        if (!stopping) {
+            while (sem_wait(&ofs->writer_wake) != 0) {}
+            stopping = !__atomic_load_n(&ofs->writer_running, __ATOMIC_ACQUIRE);
+        }
 
-    // Attempt a same-node takeover
-    key.tag.operation = BLOCK_OPERATION_NODE;
-    key.data.node = node;
-    r = table_query_first(&ofs->blocks, (void *) &key, TABLE_INDEX_LOOKUP,
-                           _oncefs_block_cmp_lookup_fuzzy, (void *) &result);
-    if (r == 0) {
-        *block = result.block;
-        return 0;
+        size_t count = 0;
+        pthread_rwlock_wrlock(&ofs->lock);
+        while (count < ONCEFS_WRITER_QUEUE &&
+               ring_pop(&ofs->requests, &batch[count]) == 0) {
+            ofs->generation++;
+            *batch[count].result = batch[count].apply();
+            count++;
+        }
+        pthread_rwlock_unlock(&ofs->lock);
+
+        for (size_t i = 0; i < count; i++) {
+            sem_post(batch[i].done);
+        }
+
+        // Drain whatever is left before leaving
+        if (stopping && count == 0) { break; }
     }
 
-    return -ENOSPC;
+    return NULL;
 }
 
-/**
- * Initializer for the block type.
- *
- * Arguments:
- *     ofs:         A pointer to the parent instance. 
- *     block:       A pointer to the instance to initialize.
- *     block_id:    The block identifier to assign.
- *     tag:         The tag to assign.
- *     node:        The node identifier to assign.
- *     size:        The size to assign.
- *     offset:      The offset to assign.
- *
- * Returns:
- *     0 on success, otherwise an errno code.
- */
-int _oncefs_init_block(oncefs_t *ofs, oncefs_block_t *block, uint32_t block_id,
-                       oncefs_tag_t tag, uint32_t node, uint16_t size, uint64_t offset) {
-
-    block->block = block_id;
+int oncefs_start_writer(oncefs_t *ofs) {
+    int r;
 
-    block->tag = tag;
+    if (ofs->writer_running) { return -EINVAL; }
 
-    block->data.node = node;
-    block->data.fill = size;
-    block->data.offset = offset;
+    r = ring_init(&ofs->requests, ONCEFS_WRITER_QUEUE, sizeof(oncefs_request_t));
+    if (r != 0) { return r; }
 
+    sem_init(&ofs->writer_wake, 0, 0);
+    __atomic_store_n(&ofs->writer_running, 1, __ATOMIC_RELEASE);
 
-    if(node >= ofs->next_node_id) {
-        ofs->next_node_id = node + 1;
+    r = pthread_create(&ofs->writer, NULL, _oncefs_writer, ofs);
+    if (r != 0) {
+        ofs->writer_running = 0;
+        sem_destroy(&ofs->writer_wake);
+        ring_free(&ofs->requests);
+        return -r;
     }
 
     return 0;
 }
 
+void oncefs_stop_writer(oncefs_t *ofs) {
+    if (!ofs->writer_running) { return; }
+
+    __atomic_store_n(&ofs->writer_running, 0, __ATOMIC_RELEASE);
+    sem_post(&ofs->writer_wake);
+    pthread_join(ofs->writer, NULL);
+
+    sem_destroy(&ofs->writer_wake);
+    ring_free(&ofs->requests);
+}
+
 /**
- * Helper to allocate and initialize a block.
+ * Helper to find the pending discard of a block.
  *
  * Arguments:
- *     ofs:         A pointer to the parent instance. 
- *     block:       A pointer to the instance to initialize.
- *     operation:   The block operation to associate with this block.
- *     node:        The node identifier to assign.
- *     size:        The size to assign.
- *     offset:      The offset to assign.
+ *     ofs:     A pointer to the instance.
+ *     block:   The block identifier.
  *
  * Returns:
- *     0 on success, otherwise an errno code.
+ *     The entry, or NULL if there is none. Must be called with discard_lock held.
  */
-int _oncefs_create_block(oncefs_t *ofs, oncefs_block_t *block, char operation,
-                         uint32_t node, uint16_t size, uint64_t offset) {
-    int r;
+oncefs_discard_t *_oncefs_discard_find(oncefs_t *ofs, uint32_t block) {
+    oncefs_discard_t *entries = (oncefs_discard_t *) ofs->discards.entries;
+
+    size_t low = 0;
+    size_t high = array_len(&ofs->discards);
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (entries[mid].block < block) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
 
-    uint32_t block_id;
-    if (ofs->next_block_id <= ofs->last_block_id) {
-        block_id = ofs->next_block_id++;
-    } else {
-        r = _oncefs_block_reuse(ofs, &block_id, node);
-        if (r != 0) { return r; }
+    if (low < array_len(&ofs->discards) && entries[low].block == block) {
+        return &entries[low];
     }
 
-    oncefs_tag_t tag = {.seq = ofs->next_seq_id++, .operation = operation};
+    return NULL;
+}
 
-    r = _oncefs_init_block(ofs, block, block_id, tag, node, size, offset);
-    if (r != 0) { return r; }
+/**
+ * Helper to make room for more pending discards, by dropping cancelled ones or else
+ * the oldest quarter. Their payloads simply stay allocated. Must be called with
+ * discard_lock held.
+ */
+void _oncefs_discard_prune(oncefs_t *ofs) {
+    oncefs_discard_t *entries = (oncefs_discard_t *) ofs->discards.entries;
+
+    size_t count = 0;
+    for (size_t i = 0; i < array_len(&ofs->discards); i++) {
+        if (entries[i].round != ONCEFS_DISCARD_CANCELLED) { entries[count++] = entries[i]; }
+    }
+    if (count < array_len(&ofs->discards)) {
+        ofs->discards.fill = count;
+        return;
+    }
+
+    int _cmp(const void *raw_a, const void *raw_b) {
+        uint64_t a = *(uint64_t *) raw_a;
+        uint64_t b = *(uint64_t *) raw_b;
+        return (a < b) ? -1 : (a > b);
+    }
+
+    uint64_t *rounds = malloc(count * sizeof(uint64_t));
+    if (rounds == NULL) {
+        ofs->discards.fill = 0;
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) { rounds[i] = entries[i].round; }
+    qsort(rounds, count, sizeof(uint64_t), _cmp);
+
+    // Everything before the round a quarter in, then from that round until done
+    size_t quota = count / 4 + 1;
+    uint64_t oldest = rounds[quota - 1];
+    free(rounds);
+
+    size_t dropped = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].round < oldest) { dropped++; }
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].round < oldest) { continue; }
+        if (entries[i].round == oldest && dropped < quota) {
+            dropped++;
+            continue;
+        }
+
+        entries[kept++] = entries[i];
+    }
+    ofs->discards.fill = kept;
+}
+
+/**
+ * Helper to remember that the payload of a freed data block is no longer needed.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the instance.
+ *     block:   The block that was freed.
+ */
+void _oncefs_discard_later(oncefs_t *ofs, oncefs_block_t *block) {
+    if (ofs->discard_rate == 0 || block->tag.operation != BLOCK_OPERATION_DATA) {
+        return; // node records are needed to replay the log
+    }
+
+    // Best effort; on failure the payload simply stays allocated
+    pthread_mutex_lock(&ofs->discard_lock);
+
+    oncefs_discard_t *entry = _oncefs_discard_find(ofs, block->block);
+    if (entry != NULL) {
+        entry->round = ofs->discard_round; // freed again since it was cancelled
+    } else {
+        if (array_len(&ofs->discards) >= ofs->discard_max) { _oncefs_discard_prune(ofs); }
+
+        oncefs_discard_t discard = {.block = block->block, .round = ofs->discard_round};
+        array_sorted_insert(&ofs->discards, &discard);
+    }
+
+    pthread_mutex_unlock(&ofs->discard_lock);
+}
+
+/**
+ * Helper to forget a pending discard for a block that is about to be rewritten.
+ *
+ * The entry is marked rather than removed, and dropped by the next discard.
+ */
+void _oncefs_discard_cancel(oncefs_t *ofs, uint32_t block) {
+    pthread_mutex_lock(&ofs->discard_lock);
+
+    oncefs_discard_t *entry = _oncefs_discard_find(ofs, block);
+    if (entry != NULL) { entry->round = ONCEFS_DISCARD_CANCELLED; }
+
+    pthread_mutex_unlock(&ofs->discard_lock);
+}
+
+/**
+ * Helper to release the payloads of freed data blocks to storage.
+ *
+ * Runs of neighbouring blocks are released together, and at most discard_rate blocks
+ * are released per call; the rest wait for the next one. The records that freed the
+ * blocks must already be durable, or a crash could replay a released payload, so only
+ * blocks freed up to the round of the last flush are considered. Must be called with
+ * discard_lock held.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the instance.
+ *     round:   The last round whose records are durable.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int _oncefs_discard(oncefs_t *ofs, uint64_t round) {
+    int r = 0;
+
+    size_t count = array_len(&ofs->discards);
+    oncefs_discard_t *entries = (oncefs_discard_t *) ofs->discards.entries;
+
+    // Entries are in order of block, so runs are neighbours among the released ones
+    uint32_t run = 0;
+    size_t run_size = 0;
+    size_t released = 0;
+
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        oncefs_discard_t *entry = &entries[i];
+        if (entry->round == ONCEFS_DISCARD_CANCELLED) { continue; }
+
+        if (r != 0 || entry->round > round || released == ofs->discard_rate) {
+            entries[kept++] = *entry;
+            continue;
+        }
+
+        if (run_size > 0 && entry->block != run + run_size) {
+            r = io_discard(ofs->io, run, ofs->overhead_size, run_size);
+            run_size = 0;
+        }
+        if (r != 0) {
+            entries[kept++] = *entry;
+            continue;
+        }
+
+        if (run_size == 0) { run = entry->block; }
+        run_size++;
+        released++;
+    }
+
+    if (r == 0 && run_size > 0) {
+        r = io_discard(ofs->io, run, ofs->overhead_size, run_size);
+    }
+    ofs->discards.fill = kept;
+
+    if (r == -EOPNOTSUPP) {
+        // Not supported by the underlying storage; stop trying
+        ofs->discard_rate = 0;
+        ofs->discards.fill = 0;
+        return 0;
+    }
+
+    return r;
+}
+
+/**
+ * Allocate a block, reusing an existing one if possible.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the instance. 
+ *     block:   The destination for the newly allocated block id.
+ *     node:    (optional) A node id for which any associated block may be reused.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int _oncefs_block_reuse(oncefs_t *ofs, uint32_t *block, uint32_t node) {
+    int r;
+
+    int _filter(const void *raw_key, const void *raw_other) {
+        oncefs_block_t *k = (oncefs_block_t *) raw_key;
+        oncefs_block_t *o = (oncefs_block_t *) raw_other;
+
+        if (k->tag.operation < o->tag.operation) {
+            return -1;
+        } else if (k->tag.operation > o->tag.operation) {
+            return 1;
+        }
+
+        return 0;
+    };
+
+    oncefs_block_t key;
+    key.tag.operation = BLOCK_OPERATION_FREE;
+
+    oncefs_block_t result;
+
+    r = table_query_first(&ofs->blocks, (void *) &key, TABLE_INDEX_LOOKUP, _filter,
+                           (void *) &result);
+    if (r == 0) {
+        _oncefs_discard_cancel(ofs, result.block);
+        *block = result.block;
+        return 0;
+    }
+
+    // If there are no free blocks then any "delete" block
+    // can safely be treated as obsolete
+    key.tag.operation = BLOCK_OPERATION_DELETE;
+    r = table_query_first(&ofs->blocks, (void *) &key, TABLE_INDEX_LOOKUP, _filter,
+                           (void *) &result);
+    if (r == 0) {
+        *block = result.block;
+        return 0;
+    }
+
+    if (node < 1) {
+        // not a valid node id (disable takeover mode)
+        return -ENOSPC;
+    }
+
+    // Attempt a same-node takeover
+    key.tag.operation = BLOCK_OPERATION_NODE;
+    key.data.node = node;
+    r = table_query_first(&ofs->blocks, (void *) &key, TABLE_INDEX_LOOKUP,
+                           _oncefs_block_cmp_lookup_fuzzy, (void *) &result);
+    if (r == 0) {
+        *block = result.block;
+        return 0;
+    }
+
+    return -ENOSPC;
+}
+
+/**
+ * Initializer for the block type.
+ *
+ * Arguments:
+ *     ofs:         A pointer to the parent instance. 
+ *     block:       A pointer to the instance to initialize.
+ *     block_id:    The block identifier to assign.
+ *     tag:         The tag to assign.
+ *     node:        The node identifier to assign.
+ *     size:        The size to assign.
+ *     offset:      The offset to assign.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int _oncefs_init_block(oncefs_t *ofs, oncefs_block_t *block, uint32_t block_id,
+                       oncefs_tag_t tag, uint32_t node, uint16_t size, uint64_t offset) {
+
+    block->block = block_id;
+
+    block->tag = tag;
+
+    block->data.node = node;
+    block->data.fill = size;
+    block->data.offset = offset;
+
+
+    if(node >= ofs->next_node_id) {
+        ofs->next_node_id = node + 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Helper to allocate and initialize a block.
+ *
+ * Arguments:
+ *     ofs:         A pointer to the parent instance. 
+ *     block:       A pointer to the instance to initialize.
+ *     operation:   The block operation to associate with this block.
+ *     node:        The node identifier to assign.
+ *     size:        The size to assign.
+ *     offset:      The offset to assign.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int _oncefs_create_block(oncefs_t *ofs, oncefs_block_t *block, char operation,
+                         uint32_t node, uint16_t size, uint64_t offset) {
+    int r;
+
+    uint32_t block_id;
+    if (ofs->next_block_id <= ofs->last_block_id) {
+        block_id = ofs->next_block_id++;
+    } else {
+        r = _oncefs_block_reuse(ofs, &block_id, node);
+        if (r != 0) { return r; }
+    }
+
+    oncefs_tag_t tag = {.seq = ofs->next_seq_id++, .operation = operation,
+                        .epoch = ofs->epoch};
+
+    r = _oncefs_init_block(ofs, block, block_id, tag, node, size, offset);
+    if (r != 0) { return r; }
 
     r = table_insert_or_replace(&ofs->blocks, block);
     if (r != 0) { return r; }
@@ -383,6 +1033,73 @@ int _oncefs_create_block(oncefs_t *ofs, oncefs_block_t *block, char operation,
     return 0;
 }
 
+/**
+ * Helper to return a block to the free pool when its record could not be written.
+ *
+ * A free record takes its place on storage, so a reload neither stops scanning at the
+ * block nor takes whatever it holds for data. Writing it is best effort, as storage
+ * that just failed may fail again.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the parent instance. 
+ *     block:   The block identifier.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int _oncefs_release_block(oncefs_t *ofs, uint32_t block) {
+    int r;
+
+    oncefs_tag_t tag = {.seq = ofs->next_seq_id++, .operation = BLOCK_OPERATION_FREE,
+                        .epoch = ofs->epoch};
+
+    oncefs_block_t free_block;
+    r = _oncefs_init_block(ofs, &free_block, block, tag, 0, 0, 0);
+    if (r != 0) { return r; }
+
+    r = table_insert_or_replace(&ofs->blocks, &free_block);
+    if (r != 0) { return r; }
+
+    if (ofs->io != NULL) {
+        r = _oncefs_write_data(ofs, &free_block, NULL);
+        if (r != 0) { return r; }
+    }
+
+    return 0;
+}
+
+/**
+ * Helper to write a batch of data blocks, counting them once they are stored.
+ *
+ * On failure every block of the batch is released, since none of them can be relied
+ * upon to survive a reload.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the parent instance.
+ *     blocks:  The blocks being written.
+ *     batch:   Their records and payloads, in the same order.
+ *     count:   The number of blocks.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int _oncefs_write_blocks(oncefs_t *ofs, oncefs_block_t *blocks, io_blockv_t *batch,
+                         int count) {
+    int r;
+
+    r = io_writev_blocks(ofs->io, batch, count);
+    if (r != 0) {
+        for (int i = 0; i < count; i++) { _oncefs_release_block(ofs, blocks[i].block); }
+        return r;
+    }
+
+    for (int i = 0; i < count; i++) {
+        _oncefs_account(ofs, BLOCK_OPERATION_DATA, blocks[i].data.fill);
+    }
+
+    return 0;
+}
+
 /**
  * Helper to allocate and initialize a block for a node.
  */
@@ -442,11 +1159,22 @@ int _oncefs_reserve_node_id(oncefs_t *ofs, uint32_t *node) {
     return 0;
 }
 
+/**
+ * Helper to describe the root directory, which is not stored.
+ */
+void _oncefs_root(oncefs_t *ofs, oncefs_node_t *result) {
+    memset(result, 0, sizeof(*result));
+    result->node = 0;
+    result->last_access = ofs->time;
+    result->last_modification = ofs->time;
+    result->type = NODE_TYPE_DIR;
+}
+
 /**
  * Helper to find the node associated with a path.
  *
  * Arguments:
- *     ofs:     A pointer to the parent instance. 
+ *     ofs:     A pointer to the parent instance.
  *     path:    A string path.
  *     result:  The destination for the associated node.
  *
@@ -458,10 +1186,7 @@ int _oncefs_resolve_node(oncefs_t *ofs, const char *path, oncefs_node_t *result)
 
     if (strcmp(path, "/") == 0) {
         // Root always exists
-        result->node = 0;
-        result->last_access = ofs->time;
-        result->last_modification = ofs->time;
-        result->type = NODE_TYPE_DIR;
+        _oncefs_root(ofs, result);
         return 0;
     }
 
@@ -504,231 +1229,432 @@ int _oncefs_resolve_node(oncefs_t *ofs, const char *path, oncefs_node_t *result)
 }
 
 /**
- * Initializer for a node.
+ * Helper to find a node by its identifier.
  *
  * Arguments:
- *     ofs:     A pointer to the parent instance. 
- *     path:    A string path.
- *     type:    The type of the node.
- *     result:  A pointer to the node to initialize.
+ *     ofs:     A pointer to the parent instance.
+ *     node:    The node identifier; 0 is the root.
+ *     result:  The destination for the node.
  *
  * Returns:
  *     0 on success, otherwise an errno code.
  */
-int _oncefs_init_node(oncefs_t *ofs, const char *path, char type,
-                      oncefs_node_t *result) {
+int _oncefs_find_node(oncefs_t *ofs, uint32_t node, oncefs_node_t *result) {
     int r;
 
-    // Check if node with this name already exists
-    r = _oncefs_resolve_node(ofs, path, NULL);
-    if (r == 0) {
-        return -EEXIST; // a node with this name already exists
-    } else if (r != -ENOENT) {
-        return r; // other error
-    }             // else a node with this name does not exist yet
-
+    if (node == 0) {
+        _oncefs_root(ofs, result);
+        return 0;
+    }
 
-    // Check if parent is directory
-    char *tmp = strdup(path);
-    char *dir = dirname(tmp);
-    oncefs_node_t parent;
-    r = _oncefs_resolve_node(ofs, dir, &parent);
-    free(tmp);
+    int _filter(const void *raw_key, const void *raw_other) {
+        oncefs_node_t *k = (oncefs_node_t *) raw_key;
+        oncefs_node_t *o = (oncefs_node_t *) raw_other;
 
-    if (r != 0) { return r; }
-    if (parent.type != NODE_TYPE_DIR) { return -EINVAL; }
+        if (k->node < o->node) {
+            return -1;
+        } else if (k->node > o->node) {
+            return 1;
+        }
 
-    // Populate
+        return 0;
+    };
 
-    result->parent = parent.node;
-    result->type = type;
-    result->last_access = (uint64_t) time(NULL);
-    result->last_modification = (uint64_t) time(NULL);
-    result->mode = 0;
+    // A link's payload shares its identifier but sorts after it
+    oncefs_node_t key = {.node = node};
+    r = table_query_first(&ofs->nodes, (void *) &key, TABLE_INDEX_PRIMARY, _filter,
+                           (void *) result);
+    if (r != 0) { return r; }
 
-    // Copy name
-    tmp = strdup(path);
-    char *name = basename(tmp);
-    strncpy(result->name, name, ONCEFS_NAME_MAX_SIZE);
-    free(tmp);
+    if (result->type == NODE_TYPE_LINK_PAYLOAD) { return -ENOENT; }
 
-    if (strlen(result->name) > ONCEFS_NAME_MAX_SIZE) { return -EINVAL; }
+    return 0;
+}
 
-    // Assign node id
-    r = _oncefs_reserve_node_id(ofs, &result->node);
-    if (r != 0) { return r; }
+/**
+ * Helper to check a single path component.
+ */
+int _oncefs_check_name(const char *name) {
+    size_t length = strlen(name);
+    if (length == 0 || length > ONCEFS_NAME_MAX_SIZE) { return -EINVAL; }
+    if (strchr(name, '/') != NULL) { return -EINVAL; }
 
     return 0;
 }
 
 /**
- * Filesystem operation to create a file.
+ * Helper to find a node by name within a directory.
  *
  * Arguments:
- *     ofs:     A pointer to the parent instance. 
- *     path:    A string path.
+ *     ofs:     A pointer to the parent instance.
+ *     parent:  The node identifier of the directory.
+ *     name:    The name of the node.
+ *     result:  (optional) The destination for the node.
  *
  * Returns:
  *     0 on success, otherwise an errno code.
  */
-int oncefs_set_file(oncefs_t *ofs, const char *path) {
+int _oncefs_find_child(oncefs_t *ofs, uint32_t parent, const char *name,
+                       oncefs_node_t *result) {
     int r;
 
-    oncefs_node_t entry;
-    r = _oncefs_init_node(ofs, path, NODE_TYPE_FILE, &entry);
+    oncefs_node_t dir;
+    r = _oncefs_find_node(ofs, parent, &dir);
     if (r != 0) { return r; }
 
-    r = table_insert_or_replace(&ofs->nodes, &entry);
+    if (dir.type != NODE_TYPE_DIR) { return -EINVAL; }
+
+    r = _oncefs_check_name(name);
     if (r != 0) { return r; }
 
-    oncefs_block_t block;
-    r = _oncefs_create_blockn(ofs, &block, BLOCK_OPERATION_NODE, entry.node);
+    oncefs_node_t key = {.parent = parent};
+    strcpy(key.name, name);
+
+    oncefs_node_t tmp;
+    r = table_query_first(&ofs->nodes, (void *) &key, TABLE_INDEX_LOOKUP, NULL,
+                           (void *) &tmp);
     if (r != 0) { return r; }
 
-    if (ofs->io != NULL) {
-        r = io_write2(ofs->io, block.block, &block.tag, sizeof(block.tag), &entry,
-                      sizeof(entry));
-        if (r != 0) { return r; }
-    }
+    if (result != NULL) { memcpy(result, &tmp, sizeof(*result)); }
 
     return 0;
 }
 
 /**
- * Filesystem operation to create a directory.
+ * Helper to split a path into the directory holding it and its last component.
  *
  * Arguments:
- *     ofs:     A pointer to the parent instance. 
+ *     ofs:     A pointer to the parent instance.
  *     path:    A string path.
+ *     parent:  The destination for the node identifier of the directory.
+ *     name:    The destination for the last component, of ONCEFS_NAME_MAX_SIZE + 1
+ *              bytes.
  *
  * Returns:
  *     0 on success, otherwise an errno code.
  */
-int oncefs_set_dir(oncefs_t *ofs, const char *path) {
+int _oncefs_resolve_parent(oncefs_t *ofs, const char *path, uint32_t *parent,
+                           char *name) {
     int r;
 
-    oncefs_node_t entry;
-    r = _oncefs_init_node(ofs, path, NODE_TYPE_DIR, &entry);
-    if (r != 0) { return r; }
+    char *tmp = strdup(path);
+    oncefs_node_t dir;
+    r = _oncefs_resolve_node(ofs, dirname(tmp), &dir);
+    free(tmp);
 
-    r = table_insert_or_replace(&ofs->nodes, &entry);
     if (r != 0) { return r; }
 
-    oncefs_block_t block;
-    r = _oncefs_create_blockn(ofs, &block, BLOCK_OPERATION_NODE, entry.node);
-    if (r != 0) { return r; }
+    tmp = strdup(path);
+    char *base = basename(tmp);
+    r = _oncefs_check_name(base);
+    if (r == 0) { strcpy(name, base); }
+    free(tmp);
 
-    if (ofs->io != NULL) {
-        r = io_write2(ofs->io, block.block, &block.tag, sizeof(block.tag), &entry,
-                      sizeof(entry));
-        if (r != 0) { return r; }
-    }
+    *parent = dir.node;
 
-    return 0;
+    return r;
 }
 
 /**
- * Filesystem operation to create a link.
+ * Initializer for a node.
  *
  * Arguments:
- *     ofs:     A pointer to the parent instance. 
- *     from:    The path where the link will exist.
- *     to:      The path that the link will point to.
+ *     ofs:     A pointer to the parent instance.
+ *     parent:  The node identifier of the directory to create it in.
+ *     name:    The name of the node.
+ *     type:    The type of the node.
+ *     result:  A pointer to the node to initialize.
  *
  * Returns:
  *     0 on success, otherwise an errno code.
  */
-int oncefs_set_link(oncefs_t *ofs, const char *from, const char *to) {
+int _oncefs_init_node(oncefs_t *ofs, uint32_t parent, const char *name, char type,
+                      oncefs_node_t *result) {
     int r;
 
-    if (strlen(to) > ONCEFS_NAME_MAX_SIZE) { return -EINVAL; }
+    // Check if node with this name already exists, in a directory
+    r = _oncefs_find_child(ofs, parent, name, NULL);
+    if (r == 0) {
+        return -EEXIST; // a node with this name already exists
+    } else if (r != -ENOENT) {
+        return r; // other error
+    }             // else a node with this name does not exist yet
 
-    // Entry in filesystem
-    oncefs_node_t entry;
-    r = _oncefs_init_node(ofs, from, NODE_TYPE_LINK, &entry);
+    // The directory itself may be what is missing
+    oncefs_node_t dir;
+    r = _oncefs_find_node(ofs, parent, &dir);
     if (r != 0) { return r; }
 
-    r = table_insert_or_replace(&ofs->nodes, &entry);
+    // Populate
+    memset(result, 0, sizeof(*result));
+    result->parent = parent;
+    result->type = type;
+    result->last_access = (uint64_t) time(NULL);
+    result->last_modification = (uint64_t) time(NULL);
+    result->mode = 0;
+    strcpy(result->name, name);
+
+    // Assign node id
+    r = _oncefs_reserve_node_id(ofs, &result->node);
     if (r != 0) { return r; }
 
-    // Link content
-    oncefs_node_t entry_payload = {
-        .node = entry.node,
-        .parent = entry.node,
-        .last_access = 0, // Not used
-        .last_modification = 0, // Not used
-        .type = NODE_TYPE_LINK_PAYLOAD,
-    };
-    strncpy(entry_payload.name, to, ONCEFS_NAME_MAX_SIZE);
+    return 0;
+}
+
+/**
+ * Helper to index a node and persist it in a new block.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the parent instance.
+ *     node:    The node to store.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int _oncefs_store_node(oncefs_t *ofs, oncefs_node_t *node) {
+    int r;
 
-    r = table_insert_or_replace(&ofs->nodes, &entry_payload);
+    r = table_insert_or_replace(&ofs->nodes, node);
     if (r != 0) { return r; }
 
-    // Persist
     oncefs_block_t block;
-    r = _oncefs_create_blockn(ofs, &block, BLOCK_OPERATION_NODE, entry.node);
+    r = _oncefs_create_blockn(ofs, &block, BLOCK_OPERATION_NODE, node->node);
     if (r != 0) { return r; }
 
     if (ofs->io != NULL) {
-        r = io_write2(ofs->io, block.block, &block.tag, sizeof(block.tag), &entry,
-                      sizeof(entry));
+        r = _oncefs_write_node(ofs, &block, node);
         if (r != 0) { return r; }
     }
 
-    r = _oncefs_create_blockn(ofs, &block, BLOCK_OPERATION_NODE, entry_payload.node);
+    return 0;
+}
+
+/**
+ * Helper to create a file, directory or link within a directory.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the parent instance.
+ *     parent:  The node identifier of the directory.
+ *     name:    The name of the new node.
+ *     type:    The type of the new node.
+ *     to:      The path that a link will point to, otherwise NULL.
+ *     node:    (optional) The destination for the new node identifier.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int _oncefs_set_node_at(oncefs_t *ofs, uint32_t parent, const char *name, int type,
+                        const char *to, uint32_t *node) {
+    int r;
+
+    if (to != NULL && strlen(to) > ONCEFS_NAME_MAX_SIZE) { return -EINVAL; }
+
+    // Entry in filesystem
+    oncefs_node_t entry;
+    r = _oncefs_init_node(ofs, parent, name, type, &entry);
+    if (r != 0) { return r; }
+
+    r = _oncefs_store_node(ofs, &entry);
     if (r != 0) { return r; }
 
-    if (ofs->io != NULL) {
-        r = io_write2(ofs->io, block.block, &block.tag, sizeof(block.tag),
-                      &entry_payload, sizeof(entry_payload));
+    if (type == NODE_TYPE_LINK) {
+        // Link content
+        oncefs_node_t entry_payload = {
+            .node = entry.node,
+            .parent = entry.node,
+            .last_access = 0, // Not used
+            .last_modification = 0, // Not used
+            .type = NODE_TYPE_LINK_PAYLOAD,
+        };
+        strncpy(entry_payload.name, to, ONCEFS_NAME_MAX_SIZE);
+
+        r = _oncefs_store_node(ofs, &entry_payload);
         if (r != 0) { return r; }
     }
 
+    if (node != NULL) { *node = entry.node; }
+
     return 0;
 }
 
-int oncefs_set_time(oncefs_t *ofs, const char *path, time_t last_access, time_t last_modification) {
-    int r;
+/**
+ * Helper to create a file, directory or link at a path.
+ */
+int _oncefs_set_node(oncefs_t *ofs, const char *path, int type, const char *to) {
+    int _apply() {
+        int r;
 
-    oncefs_node_t node;
-    r = _oncefs_resolve_node(ofs, path, &node);
-    if (r != 0) { return r; }
+        uint32_t parent;
+        char name[ONCEFS_NAME_MAX_SIZE + 1];
+        r = _oncefs_resolve_parent(ofs, path, &parent, name);
+        if (r != 0) { return r; }
 
-    if(last_modification == node.last_modification) {
-        // Updating access is expensive, so skip this
-        return 0;
+        return _oncefs_set_node_at(ofs, parent, name, type, to, NULL);
     }
 
-    node.last_access = last_access;
-    node.last_modification = last_modification;
+    return _oncefs_write(ofs, _apply);
+}
 
-    r = table_insert_or_replace(&ofs->nodes, &node);
-    if (r != 0) { return r; }
+/**
+ * Filesystem operation to create a file within a directory.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the parent instance.
+ *     parent:  The node identifier of the directory.
+ *     name:    The name of the file.
+ *     node:    (optional) The destination for the new node identifier.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int oncefs_set_file_at(oncefs_t *ofs, uint32_t parent, const char *name,
+                       uint32_t *node) {
+    int _apply() {
+        return _oncefs_set_node_at(ofs, parent, name, NODE_TYPE_FILE, NULL, node);
+    }
 
-    oncefs_block_t block;
-    r = _oncefs_create_blockn(ofs, &block, BLOCK_OPERATION_NODE, node.node);
-    if (r != 0) { return r; }
+    return _oncefs_write(ofs, _apply);
+}
 
-    if (ofs->io != NULL) {
-        r = io_write2(ofs->io, block.block, &block.tag, sizeof(block.tag), &node,
-                      sizeof(node));
-        if (r != 0) { return r; }
+/**
+ * Filesystem operation to create a file.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the parent instance.
+ *     path:    A string path.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int oncefs_set_file(oncefs_t *ofs, const char *path) {
+    return _oncefs_set_node(ofs, path, NODE_TYPE_FILE, NULL);
+}
+
+/**
+ * Filesystem operation to create a directory within a directory.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the parent instance.
+ *     parent:  The node identifier of the directory.
+ *     name:    The name of the new directory.
+ *     node:    (optional) The destination for the new node identifier.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int oncefs_set_dir_at(oncefs_t *ofs, uint32_t parent, const char *name,
+                      uint32_t *node) {
+    int _apply() {
+        return _oncefs_set_node_at(ofs, parent, name, NODE_TYPE_DIR, NULL, node);
     }
 
-    return 0;
+    return _oncefs_write(ofs, _apply);
 }
 
 /**
- * Filesystem operation to get the status of the system.
+ * Filesystem operation to create a directory.
  *
  * Arguments:
- *     ofs:     A pointer to the parent instance. 
- *     result:  A pointer to the resulting status. 
+ *     ofs:     A pointer to the parent instance.
+ *     path:    A string path.
  *
  * Returns:
  *     0 on success, otherwise an errno code.
  */
-int oncefs_get_status(oncefs_t *ofs, oncefs_status_t *result) {
+int oncefs_set_dir(oncefs_t *ofs, const char *path) {
+    return _oncefs_set_node(ofs, path, NODE_TYPE_DIR, NULL);
+}
+
+/**
+ * Filesystem operation to create a link within a directory.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the parent instance.
+ *     parent:  The node identifier of the directory.
+ *     name:    The name of the link.
+ *     to:      The path that the link will point to.
+ *     node:    (optional) The destination for the new node identifier.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int oncefs_set_link_at(oncefs_t *ofs, uint32_t parent, const char *name,
+                       const char *to, uint32_t *node) {
+    int _apply() {
+        return _oncefs_set_node_at(ofs, parent, name, NODE_TYPE_LINK, to, node);
+    }
+
+    return _oncefs_write(ofs, _apply);
+}
+
+/**
+ * Filesystem operation to create a link.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the parent instance.
+ *     from:    The path where the link will exist.
+ *     to:      The path that the link will point to.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int oncefs_set_link(oncefs_t *ofs, const char *from, const char *to) {
+    return _oncefs_set_node(ofs, from, NODE_TYPE_LINK, to);
+}
+
+/**
+ * Helper to update the times of a node.
+ */
+int _oncefs_set_time(oncefs_t *ofs, oncefs_node_t *node, time_t last_access,
+                     time_t last_modification) {
+    if(last_modification == node->last_modification) {
+        // Updating access is expensive, so skip this
+        return 0;
+    }
+
+    if (node->node == 0) {
+        return 0; // the root is not stored
+    }
+
+    node->last_access = last_access;
+    node->last_modification = last_modification;
+
+    return _oncefs_store_node(ofs, node);
+}
+
+int oncefs_set_time_id(oncefs_t *ofs, uint32_t node, time_t last_access,
+                       time_t last_modification) {
+    int _apply() {
+        int r;
+
+        oncefs_node_t result;
+        r = _oncefs_find_node(ofs, node, &result);
+        if (r != 0) { return r; }
+
+        return _oncefs_set_time(ofs, &result, last_access, last_modification);
+    }
+
+    return _oncefs_write(ofs, _apply);
+}
+
+int oncefs_set_time(oncefs_t *ofs, const char *path, time_t last_access, time_t last_modification) {
+    int _apply() {
+        int r;
+
+        oncefs_node_t node;
+        r = _oncefs_resolve_node(ofs, path, &node);
+        if (r != 0) { return r; }
+
+        return _oncefs_set_time(ofs, &node, last_access, last_modification);
+    }
+
+    return _oncefs_write(ofs, _apply);
+}
+
+/**
+ * Helper to get the status of the system.
+ */
+int _oncefs_get_status(oncefs_t *ofs, oncefs_status_t *result) {
     int r;
 
     size_t last_valid_block = ofs->last_block_id;
@@ -771,313 +1697,1373 @@ int oncefs_get_status(oncefs_t *ofs, oncefs_status_t *result) {
                           &delete_blocks);
     if (r != 0 && r != -ENOENT) { return r; }
 
-    result->free_blocks = unused_blocks + free_blocks + delete_blocks;
+    result->free_blocks = unused_blocks + free_blocks + delete_blocks;
+
+    return 0;
+}
+
+/**
+ * Filesystem operation to get the status of the system.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the parent instance. 
+ *     result:  A pointer to the resulting status. 
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int oncefs_get_status(oncefs_t *ofs, oncefs_status_t *result) {
+    pthread_rwlock_rdlock(&ofs->lock);
+    int r = _oncefs_get_status(ofs, result);
+    pthread_rwlock_unlock(&ofs->lock);
+
+    return r;
+}
+
+/**
+ * Helper to describe a node.
+ */
+void _oncefs_stat(oncefs_t *ofs, oncefs_node_t *node, oncefs_stat_t *result) {
+    int r;
+
+    result->node = node->node;
+    result->mode = node->mode;
+    result->is_dir = (node->type == NODE_TYPE_DIR) ? 1 : 0;
+    result->is_file = (node->type == NODE_TYPE_FILE) ? 1 : 0;
+    result->is_link = (node->type == NODE_TYPE_LINK) ? 1 : 0;
+
+    oncefs_block_t key;
+
+    key.tag.operation = BLOCK_OPERATION_DATA;
+    key.data.node = node->node;
+
+    oncefs_block_t tmp;
+
+    // Resolve size
+    result->size = 0;
+    if (result->is_file == 1) {
+        r = table_query_last(&ofs->blocks, (void *) &key, TABLE_INDEX_LOOKUP,
+                               _oncefs_block_cmp_lookup_fuzzy, (void *) &tmp);
+        if (r == 0) { result->size = tmp.data.offset + tmp.data.fill; }
+    } else if (result->is_link == 1) {
+        // TODO fetch size of link
+    }
+
+    result->last_access = node->last_access;
+    result->last_modification = node->last_modification;
+}
+
+/**
+ * Filesystem operation to fetch the node at a given path.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the parent instance. 
+ *     path:    A string path.
+ *     result:  The destination for the associated node.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int oncefs_get_node(oncefs_t *ofs, const char *path, oncefs_stat_t *result) {
+    int r;
+
+    oncefs_node_t node;
+
+    pthread_rwlock_rdlock(&ofs->lock);
+    r = _oncefs_resolve_node(ofs, path, &node);
+    if (r == 0) { _oncefs_stat(ofs, &node, result); }
+    pthread_rwlock_unlock(&ofs->lock);
+
+    return r;
+}
+
+int oncefs_get_node_id(oncefs_t *ofs, uint32_t node, oncefs_stat_t *result) {
+    int r;
+
+    oncefs_node_t tmp;
+
+    pthread_rwlock_rdlock(&ofs->lock);
+    r = _oncefs_find_node(ofs, node, &tmp);
+    if (r == 0) { _oncefs_stat(ofs, &tmp, result); }
+    pthread_rwlock_unlock(&ofs->lock);
+
+    return r;
+}
+
+/**
+ * Filesystem operation to find and describe a node by name within a directory.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the parent instance.
+ *     parent:  The node identifier of the directory.
+ *     name:    The name of the node.
+ *     result:  A pointer to the resulting description.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int oncefs_lookup(oncefs_t *ofs, uint32_t parent, const char *name,
+                  oncefs_stat_t *result) {
+    int r;
+
+    oncefs_node_t tmp;
+
+    pthread_rwlock_rdlock(&ofs->lock);
+    r = _oncefs_find_child(ofs, parent, name, &tmp);
+    if (r == 0) { _oncefs_stat(ofs, &tmp, result); }
+    pthread_rwlock_unlock(&ofs->lock);
+
+    return r;
+}
+
+/**
+ * Helper to list the nodes of a directory.
+ */
+int _oncefs_get_dir(oncefs_t *ofs, oncefs_node_t *key,
+                    int (*callback)(oncefs_node_t *entry)) {
+    int r;
+
+    int _filter(const void *raw_a, const void *raw_b) {
+        oncefs_node_t *a = (oncefs_node_t *) raw_a;
+        oncefs_node_t *b = (oncefs_node_t *) raw_b;
+
+        if (a->node < b->parent) {
+            return -1;
+        } else if (a->node > b->parent) {
+            return 1;
+        }
+
+        return 0;
+    };
+
+    int _callback(void *raw) {
+        return callback((oncefs_node_t *) raw);
+    }
+
+    r = table_query_all(&ofs->nodes, key, TABLE_INDEX_LOOKUP, _filter, _callback);
+    if(r != 0 && r != -ENOENT) { return r; }
+
+    return 0;
+}
+
+/**
+ * Filesystem operation to read a directory.
+ *
+ * Arguments:
+ *     ofs:         A pointer to the parent instance.
+ *     path:        A string path of the directory.
+ *     callback:    A function to be called once per node in the directory.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int oncefs_get_dir(oncefs_t *ofs, const char *path,
+                   int (*callback)(oncefs_node_t *entry)) {
+    int r;
+
+    oncefs_node_t key;
+
+    pthread_rwlock_rdlock(&ofs->lock);
+    r = _oncefs_resolve_node(ofs, path, &key);
+    if (r == 0) { r = _oncefs_get_dir(ofs, &key, callback); }
+    pthread_rwlock_unlock(&ofs->lock);
+
+    return r;
+}
+
+int oncefs_get_dir_id(oncefs_t *ofs, uint32_t node,
+                      int (*callback)(oncefs_node_t *entry)) {
+    int r;
+
+    oncefs_node_t key;
+
+    pthread_rwlock_rdlock(&ofs->lock);
+    r = _oncefs_find_node(ofs, node, &key);
+    if (r == 0 && key.type != NODE_TYPE_DIR) { r = -EINVAL; }
+    if (r == 0) { r = _oncefs_get_dir(ofs, &key, callback); }
+    pthread_rwlock_unlock(&ofs->lock);
+
+    return r;
+}
+
+/**
+ * Helper to list the nodes of a directory that sort after a name.
+ */
+int _oncefs_get_dir_after(oncefs_t *ofs, oncefs_node_t *key, const char *after,
+                          int with_stat,
+                          int (*callback)(oncefs_node_t *entry, oncefs_stat_t *stat)) {
+    int r;
+
+    int _filter(const void *raw_a, const void *raw_b) {
+        oncefs_node_t *a = (oncefs_node_t *) raw_a;
+        oncefs_node_t *b = (oncefs_node_t *) raw_b;
+
+        if (a->node < b->parent) {
+            return -1;
+        } else if (a->node > b->parent) {
+            return 1;
+        }
+
+        // Names up to and including the last one seen sort before the range
+        if (after != NULL && strcmp(after, b->name) >= 0) { return 1; }
+
+        return 0;
+    };
+
+    int _callback(void *raw) {
+        oncefs_node_t *entry = (oncefs_node_t *) raw;
+        if (!with_stat) { return callback(entry, NULL); }
+
+        oncefs_stat_t stat;
+        _oncefs_stat(ofs, entry, &stat);
+        return callback(entry, &stat);
+    }
+
+    r = table_query_all(&ofs->nodes, key, TABLE_INDEX_LOOKUP, _filter, _callback);
+    if(r != 0 && r != -ENOENT) { return r; }
+
+    return 0;
+}
+
+/**
+ * Filesystem operation to continue reading a directory from a given position.
+ *
+ * Entries come in name order, so the name of the last one seen is a position that
+ * survives other entries being added or removed in between.
+ *
+ * Arguments:
+ *     ofs:         A pointer to the parent instance.
+ *     node:        The identifier of the directory.
+ *     after:       The name to continue after, or NULL to start from the beginning.
+ *     with_stat:   Whether to pass the attributes of each node along, else NULL.
+ *     callback:    A function to be called once per node, returning non-zero to stop.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int oncefs_get_dir_after(oncefs_t *ofs, uint32_t node, const char *after, int with_stat,
+                         int (*callback)(oncefs_node_t *entry, oncefs_stat_t *stat)) {
+    int r;
+
+    oncefs_node_t key;
+
+    pthread_rwlock_rdlock(&ofs->lock);
+    r = _oncefs_find_node(ofs, node, &key);
+    if (r == 0 && key.type != NODE_TYPE_DIR) { r = -EINVAL; }
+    if (r == 0) { r = _oncefs_get_dir_after(ofs, &key, after, with_stat, callback); }
+    pthread_rwlock_unlock(&ofs->lock);
+
+    return r;
+}
+
+/**
+ * Helper to read the target of a link.
+ */
+int _oncefs_get_link(oncefs_t *ofs, oncefs_node_t *result) {
+    int r;
+
+    if (result->type != NODE_TYPE_LINK) { return -EINVAL; }
+
+    oncefs_node_t key = {
+        .node = result->node, .parent = result->node, .type = NODE_TYPE_LINK_PAYLOAD};
+
+    oncefs_node_t tmp;
+
+    r = table_query_first(&ofs->nodes, (void *) &key, TABLE_INDEX_PRIMARY, NULL, 
+                           (void *) &tmp);
+    if (r != 0) { return r; }
+
+    memcpy(result, &tmp, sizeof(*result));
+
+    return r;
+}
+
+/**
+ * Filesystem operation to read a link.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the parent instance.
+ *     path:    A string path.
+ *     result:  The destination dummy node; only the name will be filled.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int oncefs_get_link(oncefs_t *ofs, const char *path, oncefs_node_t *result) {
+    int r;
+
+    pthread_rwlock_rdlock(&ofs->lock);
+    r = _oncefs_resolve_node(ofs, path, result);
+    if (r == 0) { r = _oncefs_get_link(ofs, result); }
+    pthread_rwlock_unlock(&ofs->lock);
+
+    return r;
+}
+
+int oncefs_get_link_id(oncefs_t *ofs, uint32_t node, oncefs_node_t *result) {
+    int r;
+
+    pthread_rwlock_rdlock(&ofs->lock);
+    r = _oncefs_find_node(ofs, node, result);
+    if (r == 0) { r = _oncefs_get_link(ofs, result); }
+    pthread_rwlock_unlock(&ofs->lock);
+
+    return r;
+}
+
+/**
+ * Helper to write data associated with a node, counting how much of it is stored
+ * should it fail part way.
+ */
+int _oncefs_set_data_partial(oncefs_t *ofs, uint32_t node, const char *data, size_t size,
+                             uint64_t offset, size_t *done) {
+    int r = 0;
+
+    *done = 0;
+
+    // New blocks are usually neighbours, so each batch becomes a few large writes
+    oncefs_block_t blocks[IO_QUEUE_DEPTH];
+    uint8_t headers[IO_QUEUE_DEPTH][ONCEFS_RECORD_MAX_SIZE];
+    io_blockv_t batch[IO_QUEUE_DEPTH];
+    int queued = 0;
+
+    size_t written = 0;
+    size_t amount;
+    while (written < size) {
+        // write in blocks
+        amount = size - written;
+        if (amount > ofs->payload_size) { amount = ofs->payload_size; }
+
+        oncefs_block_t *block = &blocks[queued];
+        r = _oncefs_create_block(ofs, block, BLOCK_OPERATION_DATA, node, amount,
+                                 offset + written);
+        if (r != 0) { break; }
+
+        size_t header_size = _oncefs_pack(ofs, headers[queued], &block->tag,
+                                          &block->data, NULL);
+        batch[queued] = (io_blockv_t) {
+            .block = block->block,
+            .data = {headers[queued], (void *) (data + written)},
+            .size = {header_size, amount}};
+
+        written += amount;
+
+        if (ofs->io != NULL && ++queued == IO_QUEUE_DEPTH) {
+            r = _oncefs_write_blocks(ofs, blocks, batch, queued);
+            if (r != 0) { return r; }
+            queued = 0;
+            *done = written;
+        }
+    }
+
+    if (ofs->io != NULL) {
+        // Flush whatever was batched, even if allocation failed part way
+        int r2 = _oncefs_write_blocks(ofs, blocks, batch, queued);
+        if (r2 == 0) { *done = written; }
+        if (r == 0) { r = r2; }
+    } else {
+        *done = written;
+    }
+
+    return r;
+}
+
+/**
+ * Helper to write data associated with a node.
+ */
+size_t _oncefs_set_data(oncefs_t *ofs, uint32_t node, const char *data, size_t size,
+                    uint64_t offset) {
+    size_t done;
+    return _oncefs_set_data_partial(ofs, node, data, size, offset, &done);
+}
+
+/**
+ * Filesystem operation to write data associated with a node.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the parent instance. 
+ *     node:    The node identifier.
+ *     data:    The data to write.
+ *     size:    The size of data in bytes.
+ *     offset:  The byte location of the data within the node.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+size_t oncefs_set_data(oncefs_t *ofs, uint32_t node, const char *data, size_t size,
+                    uint64_t offset) {
+    int _apply() {
+        return _oncefs_set_data(ofs, node, data, size, offset);
+    }
+
+    return _oncefs_write(ofs, _apply);
+}
+
+/**
+ * Helper to write data supplied by the caller straight into the payloads of new
+ * blocks, see oncefs_set_data_in_place.
+ */
+int _oncefs_set_data_in_place(oncefs_t *ofs, uint32_t node, size_t size,
+                              uint64_t offset,
+                              int (*place)(uint32_t block, int offset, size_t amount)) {
+    int r = 0;
+
+    // A header alone can't be written to a block without clearing its payload, unless
+    // headers are kept apart
+    if (ofs->io == NULL || (ofs->io->direct && ofs->io->header_size == 0)) {
+        return -ENOTSUP;
+    }
+
+    oncefs_block_t blocks[IO_QUEUE_DEPTH];
+    uint8_t headers[IO_QUEUE_DEPTH][ONCEFS_RECORD_MAX_SIZE];
+    io_blockv_t batch[IO_QUEUE_DEPTH];
+    int queued = 0;
+
+    size_t written = 0;
+    while (r == 0 && written < size) {
+        size_t amount = size - written;
+        if (amount > ofs->payload_size) { amount = ofs->payload_size; }
+
+        oncefs_block_t *block = &blocks[queued];
+        r = _oncefs_create_block(ofs, block, BLOCK_OPERATION_DATA, node, amount,
+                                 offset + written);
+        if (r != 0) { break; }
+
+        r = place(block->block, ofs->overhead_size, amount);
+        if (r != 0) {
+            // Nothing usable reached the block, so it must not shadow older data
+            _oncefs_release_block(ofs, block->block);
+            break;
+        }
+        io_note_write(ofs->io, block->block, ofs->overhead_size, amount);
+
+        size_t header_size = _oncefs_pack(ofs, headers[queued], &block->tag,
+                                          &block->data, NULL);
+        batch[queued] = (io_blockv_t) {
+            .block = block->block, .data = {headers[queued]}, .size = {header_size}};
+
+        written += amount;
+
+        // Headers follow their payloads, so none describes a payload not yet there
+        if (++queued == IO_QUEUE_DEPTH) {
+            r = _oncefs_write_blocks(ofs, blocks, batch, queued);
+            queued = 0;
+        }
+    }
+
+    if (queued > 0) {
+        // Whatever was placed, even if a later block failed
+        int r2 = _oncefs_write_blocks(ofs, blocks, batch, queued);
+        if (r == 0) { r = r2; }
+    }
+
+    return r;
+}
+
+/**
+ * Helper to lay an extent over a sorted list of extents covering a range, replacing
+ * the bytes it overlaps.
+ *
+ * Arguments:
+ *     extents: The list, which covers the extent.
+ *     extent:  The extent to lay over it.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int _oncefs_paint(array_t *extents, oncefs_extent_t *extent) {
+    int r;
+
+    oncefs_extent_t *entries = (oncefs_extent_t *) extents->entries;
+    size_t count = array_len(extents);
+    uint64_t start = extent->offset;
+    uint64_t end = start + extent->size;
+
+    // First extent ending after the start, and first starting at or after the end
+    size_t low = 0;
+    size_t high = count;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (entries[middle].offset + entries[middle].size <= start) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    size_t first = low;
+    size_t last = first;
+    while (last < count && entries[last].offset < end) { last++; }
+
+    // Up to three pieces replace the overlapped extents
+    oncefs_extent_t pieces[3];
+    size_t num_pieces = 0;
+
+    oncefs_extent_t left = entries[first];
+    if (left.offset < start) {
+        left.size = start - left.offset;
+        pieces[num_pieces++] = left;
+    }
+
+    pieces[num_pieces++] = *extent;
+
+    oncefs_extent_t right = entries[last - 1];
+    if (right.offset + right.size > end) {
+        if (!right.hole) { right.skip += end - right.offset; }
+        right.size = right.offset + right.size - end;
+        right.offset = end;
+        pieces[num_pieces++] = right;
+    }
+
+    size_t replaced = last - first;
+    for (size_t i = replaced; i < num_pieces; i++) {
+        r = array_append(extents, extent); // room, overwritten below
+        if (r != 0) { return r; }
+    }
+    entries = (oncefs_extent_t *) extents->entries;
+
+    memmove(entries + first + num_pieces, entries + last,
+            (count - last) * sizeof(oncefs_extent_t));
+    memcpy(entries + first, pieces, num_pieces * sizeof(oncefs_extent_t));
+    extents->fill = count - replaced + num_pieces;
+
+    return 0;
+}
+
+/**
+ * Helper to find where the bytes of a range of a file are stored.
+ *
+ * Newer blocks take precedence over older ones where they overlap. Bytes not covered
+ * by any block form holes, except past the end of the last block, where the extents
+ * stop.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the parent instance.
+ *     node:    The node identifier.
+ *     size:    The size of the range in bytes.
+ *     offset:  The byte location of the range within the node.
+ *     extents: An initialised array of oncefs_extent_t to hold the result, in order.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int _oncefs_get_extents(oncefs_t *ofs, uint32_t node, size_t size, uint64_t offset,
+                        array_t *extents) {
+    int r;
+
+    int _filter(const void *raw_key, const void *raw_other) {
+        int r;
+
+        r = _oncefs_block_cmp_lookup_fuzzy(raw_key, raw_other);
+        if (r != 0) { return r; }
+
+        oncefs_block_t *k = (oncefs_block_t *) raw_key;
+        oncefs_block_t *o = (oncefs_block_t *) raw_other;
+
+        // stretch to include any blocks that could potentially contain
+        // overlapping data
+        if (k->data.offset + size <= o->data.offset) { return -1; }
+        if (k->data.offset >= o->data.offset + ofs->payload_size) { return 1; }
+
+        return 0;
+    };
+
+    int _order_by(const void *raw_a, const void *raw_b) {
+        oncefs_block_t *a = (oncefs_block_t *) raw_a;
+        oncefs_block_t *b = (oncefs_block_t *) raw_b;
+
+        if (a->tag.seq < b->tag.seq) {
+            return -1;
+        } else if (a->tag.seq > b->tag.seq) {
+            return 1;
+        }
+
+        return 0;
+    };
+
+    oncefs_block_t key = {.tag = {.operation = BLOCK_OPERATION_DATA},
+                          .data = {.node = node, .offset = offset}};
+
+    // Relative to file
+    uint64_t tgt_start = offset;
+    uint64_t tgt_end = offset + size;
+    uint64_t fill = tgt_start; // end of the data found
+
+    extents->fill = 0;
+    oncefs_extent_t hole = {.offset = offset, .size = size, .hole = 1};
+    r = array_append(extents, &hole);
+    if (r != 0) { return r; }
+
+    int status = 0;
+
+    int _callback(void *raw) {
+        oncefs_block_t *result = (oncefs_block_t *) raw;
+
+        if (status != 0) { return 0; }
+
+        // Relative to file
+        uint64_t src_start = result->data.offset;
+        uint64_t src_end = src_start + result->data.fill;
+
+        int skip = 0;
+        if (src_start < tgt_start) {
+            skip = tgt_start - src_start;
+            src_start = tgt_start;
+        }
+        if (src_end > tgt_end) { src_end = tgt_end; }
+
+        if (src_start >= src_end) { return 0; } // no bytes overlap
+
+        oncefs_extent_t extent = {
+            .offset = src_start,
+            .size = src_end - src_start,
+            .hole = 0,
+            .block = result->block,
+            .skip = skip};
+        status = _oncefs_paint(extents, &extent);
+
+        if (src_end > fill) { fill = src_end; }
+
+        return 0;
+    };
+
+    r = table_query_order_by(&ofs->blocks, &key, TABLE_INDEX_LOOKUP, _filter, _order_by,
+                             _callback);
+    if (r != 0 && r != -ENOENT) { return r; }
+    if (status != 0) { return status; }
+
+    // Nothing past the end of the data
+    oncefs_extent_t *entries = (oncefs_extent_t *) extents->entries;
+    while (extents->fill > 0 && entries[extents->fill - 1].offset >= fill) {
+        extents->fill--;
+    }
+    if (extents->fill > 0) {
+        oncefs_extent_t *tail = &entries[extents->fill - 1];
+        if (tail->offset + tail->size > fill) { tail->size = fill - tail->offset; }
+    }
+
+    return 0;
+}
+
+/**
+ * Helper to read the data of a range of a file from its extents, zero filling holes.
+ *
+ * Returns:
+ *     The number of bytes up to the end of the last extent, otherwise an errno code.
+ */
+int _oncefs_read_extents(oncefs_t *ofs, oncefs_extent_t *entries, size_t count,
+                         char *data, size_t size, uint64_t offset) {
+    int r;
+
+    // Extents never overlap, so all reads go out as one batch
+    io_blockv_t *batch = malloc((count + 1) * sizeof(io_blockv_t));
+    if (batch == NULL) { return -ENOMEM; }
+
+    memset(data, 0, size);
+
+    size_t num_reads = 0;
+    int fill = 0;
+    for (size_t i = 0; i < count; i++) {
+        oncefs_extent_t *extent = &entries[i];
+        fill = extent->offset + extent->size - offset;
+        if (extent->hole) { continue; }
+
+        batch[num_reads++] = (io_blockv_t) {
+            .block = extent->block,
+            .data = {NULL, NULL, data + (extent->offset - offset)},
+            .size = {ofs->overhead_size, extent->skip, extent->size}};
+    }
+
+    r = io_readv_blocks(ofs->io, batch, num_reads);
+
+    free(batch);
+
+    if (r != 0) { return r; }
+
+    return fill;
+}
+
+/**
+ * Helper to read data asssociated with a node.
+ *
+ * Ranges not covered by any block are zero filled.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the parent instance. 
+ *     node:    The node identifier.
+ *     data:    A buffer to hold the resulting data.
+ *     size:    The size of data buffer in bytes.
+ *     offset:  The byte location of the data within the node.
+ *
+ * Returns:
+ *     The number of bytes up to the end of the last block read, otherwise an errno
+ *     code.
+ */
+int _oncefs_get_data(oncefs_t *ofs, uint32_t node, char *data, size_t size,
+                    uint64_t offset) {
+    int r;
+
+    array_t extents;
+    array_init(&extents, sizeof(oncefs_extent_t));
+
+    r = _oncefs_get_extents(ofs, node, size, offset, &extents);
+    if (r == 0) {
+        r = _oncefs_read_extents(ofs, (oncefs_extent_t *) extents.entries,
+                                 array_len(&extents), data, size, offset);
+    }
+
+    array_free(&extents);
+
+    return r;
+}
+
+/**
+ * Helper to read data associated with a node, in chunks.
+ */
+size_t _oncefs_read_data(oncefs_t *ofs, uint32_t node, char *data, size_t size,
+                    uint64_t offset) {
+    size_t chunk = (size_t) ofs->payload_size * IO_QUEUE_DEPTH;
+
+    size_t total = 0; // total amount requested so far
+    size_t end = 0; // end of the data actually found
+    size_t limit; // max amount to read
+    int read; // amount read
+    while (total < size) {
+        limit = (size - total > chunk) ? chunk : size - total;
+
+        read = _oncefs_get_data(ofs, node, data + total, limit, offset + total);
+        if(read == -ENOENT || read == 0) { break; }
+        if(read < 0) { return read; }
+
+        end = total + read;
+        total += limit;
+    }
+
+    return end;
+}
+
+/**
+ * Filesystem operation to read data asssociated with a node.
+ *
+ * Breaks up read operations into chunks of at most one batch of blocks.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the parent instance. 
+ *     node:    The node identifier.
+ *     data:    A buffer to hold the resulting data.
+ *     size:    The size of data buffer in bytes.
+ *     offset:  The byte location of the data within the node.
+ *
+ * Returns:
+ *     The number of bytes read, otherwise an errno code.
+ */
+size_t oncefs_get_data(oncefs_t *ofs, uint32_t node, char *data, size_t size,
+                    uint64_t offset) {
+    pthread_rwlock_rdlock(&ofs->lock);
+    size_t r = _oncefs_read_data(ofs, node, data, size, offset);
+    pthread_rwlock_unlock(&ofs->lock);
+
+    return r;
+}
+
+/**
+ * Filesystem operation to write data associated with a node, for callers that move
+ * it into the container without copying.
+ *
+ * New blocks are allocated as for oncefs_set_data, and the callback puts each part of
+ * the data into the payload of one, in order; io_locate gives where that is stored.
+ * The headers are written after the payloads they describe. If the callback fails,
+ * the parts placed before it are kept and the block it was given is freed again.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the parent instance.
+ *     node:    The node identifier.
+ *     size:    The size of data in bytes.
+ *     offset:  The byte location of the data within the node.
+ *     place:   A function writing the next amount bytes of the data at a byte offset
+ *              of a block, returning an errno code.
+ *
+ * Returns:
+ *     0 on success, -ENOTSUP if the container's layout does not allow it, otherwise
+ *     an errno code.
+ */
+int oncefs_set_data_in_place(oncefs_t *ofs, uint32_t node, size_t size, uint64_t offset,
+                             int (*place)(uint32_t block, int offset, size_t amount)) {
+    int _apply() {
+        return _oncefs_set_data_in_place(ofs, node, size, offset, place);
+    }
+
+    return _oncefs_write(ofs, _apply);
+}
+
+/**
+ * Filesystem operation to find where the bytes of a range of a file are stored, for
+ * callers that transfer them without copying.
+ *
+ * Arguments:
+ *     ofs:         A pointer to the parent instance.
+ *     node:        The node identifier.
+ *     size:        The size of the range in bytes.
+ *     offset:      The byte location of the range within the node.
+ *     callback:    A function given the extents in order, up to the end of the data.
+ *                  It runs with the instance locked, so the blocks stay in place
+ *                  until it returns.
+ *
+ * Returns:
+ *     0 or the result of the callback, otherwise an errno code.
+ */
+int oncefs_get_extents(oncefs_t *ofs, uint32_t node, size_t size, uint64_t offset,
+                       int (*callback)(oncefs_extent_t *extents, size_t count)) {
+    int r;
+
+    array_t extents;
+    array_init(&extents, sizeof(oncefs_extent_t));
+
+    pthread_rwlock_rdlock(&ofs->lock);
+    r = _oncefs_get_extents(ofs, node, size, offset, &extents);
+    if (r == 0) {
+        r = callback((oncefs_extent_t *) extents.entries, array_len(&extents));
+    }
+    pthread_rwlock_unlock(&ofs->lock);
+
+    array_free(&extents);
+
+    return r;
+}
+
+/**
+ * Helper to find the size of a file.
+ */
+int _oncefs_file_size(oncefs_t *ofs, uint32_t node, uint64_t *size) {
+    int r;
+
+    oncefs_node_t result;
+    r = _oncefs_find_node(ofs, node, &result);
+    if (r != 0) { return r; }
+    if (result.type != NODE_TYPE_FILE) { return -EINVAL; }
+
+    oncefs_stat_t stat;
+    _oncefs_stat(ofs, &result, &stat);
+    *size = stat.size;
+
+    return 0;
+}
+
+/**
+ * Filesystem operation to find the next data or the next hole in a file.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the parent instance.
+ *     node:    The node identifier.
+ *     offset:  The byte location to search from.
+ *     hole:    Whether to find a hole rather than data; the end of the file counts as
+ *              one.
+ *     result:  The byte location found, at or after offset.
+ *
+ * Returns:
+ *     0 on success, -ENXIO if offset is at or past the end of the file or no data
+ *     follows it, otherwise an errno code.
+ */
+int oncefs_seek(oncefs_t *ofs, uint32_t node, uint64_t offset, int hole,
+                uint64_t *result) {
+    int r;
+
+    int _filter(const void *raw_key, const void *raw_other) {
+        int r;
+
+        r = _oncefs_block_cmp_lookup_fuzzy(raw_key, raw_other);
+        if (r != 0) { return r; }
+
+        oncefs_block_t *k = (oncefs_block_t *) raw_key;
+        oncefs_block_t *o = (oncefs_block_t *) raw_other;
+
+        // Blocks that could reach the offset, and all those after it
+        if (k->data.offset >= o->data.offset + ofs->payload_size) { return 1; }
+
+        return 0;
+    };
+
+    // In order of where they start, so the first gap or the first block found is it
+    uint64_t position = offset;
+    int found = 0;
+
+    int _callback(void *raw) {
+        oncefs_block_t *block = (oncefs_block_t *) raw;
+
+        uint64_t start = block->data.offset;
+        uint64_t end = start + block->data.fill;
+        if (end <= position) { return 0; }
+
+        if (hole) {
+            if (start > position) {
+                found = 1;
+                return 1;
+            }
+            position = end;
+            return 0;
+        }
+
+        if (start > position) { position = start; }
+        found = 1;
+        return 1;
+    };
+
+    oncefs_block_t key = {.tag = {.operation = BLOCK_OPERATION_DATA},
+                          .data = {.node = node, .offset = offset}};
+
+    pthread_rwlock_rdlock(&ofs->lock);
+
+    uint64_t size;
+    r = _oncefs_file_size(ofs, node, &size);
+    if (r == 0 && offset >= size) { r = -ENXIO; }
+    if (r == 0) {
+        r = table_query_all(&ofs->blocks, &key, TABLE_INDEX_LOOKUP, _filter, _callback);
+        if (r == -ENOENT) { r = 0; }
+    }
+
+    pthread_rwlock_unlock(&ofs->lock);
+
+    if (r != 0) { return r; }
+
+    if (hole) {
+        *result = (position < size) ? position : size;
+        return 0;
+    }
+
+    if (!found) { return -ENXIO; }
 
+    *result = position;
     return 0;
 }
 
 /**
- * Filesystem operation to fetch the node at a given path.
- *
- * Arguments:
- *     ofs:     A pointer to the parent instance. 
- *     path:    A string path.
- *     result:  The destination for the associated node.
- *
- * Returns:
- *     0 on success, otherwise an errno code.
+ * Helper to check that a range of a file fits, see oncefs_allocate.
  */
-int oncefs_get_node(oncefs_t *ofs, const char *path, oncefs_stat_t *result) {
+int _oncefs_allocate(oncefs_t *ofs, uint32_t node, size_t size, uint64_t offset,
+                     int keep_size) {
     int r;
 
-    oncefs_node_t node;
-    r = _oncefs_resolve_node(ofs, path, &node);
+    uint64_t file_size;
+    r = _oncefs_file_size(ofs, node, &file_size);
     if (r != 0) { return r; }
 
-    result->node = node.node;
-    result->mode = node.mode;
-    result->is_dir = (node.type == NODE_TYPE_DIR) ? 1 : 0;
-    result->is_file = (node.type == NODE_TYPE_FILE) ? 1 : 0;
-    result->is_link = (node.type == NODE_TYPE_LINK) ? 1 : 0;
+    // The size of a file is where its data ends; growing it would take zero blocks
+    if (!keep_size && offset + size > file_size) { return -EOPNOTSUPP; }
 
-    oncefs_block_t key;
-
-    key.tag.operation = BLOCK_OPERATION_DATA;
-    key.data.node = node.node;
-
-    oncefs_block_t tmp;
-
-    // Resolve size
-    result->size = 0;
-    if (result->is_file == 1) {
-        r = table_query_last(&ofs->blocks, (void *) &key, TABLE_INDEX_LOOKUP,
-                               _oncefs_block_cmp_lookup_fuzzy, (void *) &tmp);
-        if (r == 0) { result->size = tmp.data.offset + tmp.data.fill; }
-    } else if (result->is_link == 1) {
-        // TODO fetch size of link
-    }
+    // Every write takes new blocks, whether or not the range holds data already
+    size_t needed = (size + ofs->payload_size - 1) / ofs->payload_size;
 
-    result->last_access = node.last_access;
-    result->last_modification = node.last_modification;
+    oncefs_status_t status;
+    r = _oncefs_get_status(ofs, &status);
+    if (r != 0) { return r; }
+    if (needed > status.free_blocks) { return -ENOSPC; }
 
     return 0;
 }
 
 /**
- * Filesystem operation to read a directory.
+ * Filesystem operation to check that a range of a file can be written, ahead of
+ * writing it.
+ *
+ * Blocks are never overwritten, so no space can be set aside: this only fails early
+ * when the range does not fit now, and later writes may still run out of space.
+ * Nothing is written, so holes in the range stay holes.
  *
  * Arguments:
- *     ofs:         A pointer to the parent instance. 
- *     path:        A string path of the directory.
- *     callback:    A function to be called once per node in the directory.
+ *     ofs:         A pointer to the parent instance.
+ *     node:        The node identifier.
+ *     size:        The size of the range in bytes.
+ *     offset:      The byte location of the range within the node.
+ *     keep_size:   Whether the size of the file must stay the same; it cannot grow
+ *                  without writing data, so the range must be within the file
+ *                  otherwise.
  *
  * Returns:
- *     0 on success, otherwise an errno code.
+ *     0 on success, -ENOSPC if the range does not fit, -EOPNOTSUPP if it would grow
+ *     the file, otherwise an errno code.
  */
-int oncefs_get_dir(oncefs_t *ofs, const char *path,
-                   int (*callback)(oncefs_node_t *entry)) {
+int oncefs_allocate(oncefs_t *ofs, uint32_t node, size_t size, uint64_t offset,
+                    int keep_size) {
     int r;
 
-    oncefs_node_t key;
-    r = _oncefs_resolve_node(ofs, path, &key);
+    // Only checks, so it need not wait for the writer
+    pthread_rwlock_rdlock(&ofs->lock);
+    r = _oncefs_allocate(ofs, node, size, offset, keep_size);
+    pthread_rwlock_unlock(&ofs->lock);
+
+    return r;
+}
+
+/**
+ * Helper to copy a range of data between files, see oncefs_copy_data.
+ */
+int _oncefs_copy_data(oncefs_t *ofs, uint32_t from, uint64_t from_offset, uint32_t to,
+                      uint64_t to_offset, size_t size, size_t *copied) {
+    int r;
+
+    *copied = 0;
+
+    uint64_t from_size;
+    r = _oncefs_file_size(ofs, from, &from_size);
     if (r != 0) { return r; }
 
-    int _filter(const void *raw_a, const void *raw_b) {
-        oncefs_node_t *a = (oncefs_node_t *) raw_a;
-        oncefs_node_t *b = (oncefs_node_t *) raw_b;
+    uint64_t to_size;
+    r = _oncefs_file_size(ofs, to, &to_size);
+    if (r != 0) { return r; }
 
-        if (a->node < b->parent) {
-            return -1;
-        } else if (a->node > b->parent) {
-            return 1;
+    if (from_offset >= from_size) { return 0; }
+    if (size > from_size - from_offset) { size = from_size - from_offset; }
+
+    if (from == to && from_offset < to_offset + size && to_offset < from_offset + size) {
+        return -EINVAL; // overlapping
+    }
+
+    size_t chunk = (size_t) ofs->payload_size * IO_QUEUE_DEPTH;
+    char *buffer = malloc((size < chunk) ? size : chunk);
+    if (buffer == NULL) { return -ENOMEM; }
+
+    array_t extents;
+    array_init(&extents, sizeof(oncefs_extent_t));
+
+    while (r == 0 && *copied < size) {
+        size_t amount = (size - *copied > chunk) ? chunk : size - *copied;
+        uint64_t position = from_offset + *copied;
+
+        r = _oncefs_get_extents(ofs, from, amount, position, &extents);
+        if (r != 0) { break; }
+
+        oncefs_extent_t *entries = (oncefs_extent_t *) extents.entries;
+        size_t count = array_len(&extents);
+
+        int read = _oncefs_read_extents(ofs, entries, count, buffer, amount, position);
+        if (read < 0) {
+            r = read;
+            break;
         }
 
-        return 0;
-    };
+        for (size_t i = 0; r == 0 && i < count; i++) {
+            oncefs_extent_t *extent = &entries[i];
+            uint64_t target = to_offset + (extent->offset - from_offset);
 
-    int _callback(void *raw) {
-        return callback((oncefs_node_t *) raw);
+            // Holes stay holes where nothing is written yet
+            if (extent->hole && target >= to_size) {
+                *copied = extent->offset + extent->size - from_offset;
+                continue;
+            }
+
+            size_t done;
+            r = _oncefs_set_data_partial(ofs, to, buffer + (extent->offset - position),
+                                         extent->size, target, &done);
+            if (target + done > to_size) { to_size = target + done; }
+            *copied = extent->offset + done - from_offset;
+        }
+
+        if (r == 0) { *copied = position + amount - from_offset; }
     }
 
-    r = table_query_all(&ofs->nodes, &key, TABLE_INDEX_LOOKUP, _filter, _callback);
-    if(r != 0 && r != -ENOENT) { return r; }
+    array_free(&extents);
+    free(buffer);
 
-    return 0;
+    // Like a short write, what was copied before the failure counts
+    if (*copied > 0) { return 0; }
+
+    return r;
 }
 
 /**
- * Filesystem operation to read a link.
+ * Filesystem operation to copy a range of data from one file to another.
+ *
+ * Each block records the node it belongs to, so the copy gets blocks of its own; the
+ * data does not leave the filesystem though, and holes in the source stay holes.
  *
  * Arguments:
- *     ofs:     A pointer to the parent instance. 
- *     path:    A string path.
- *     result:  The destination dummy node; only the name will be filled.
+ *     ofs:         A pointer to the parent instance.
+ *     from:        The node identifier to copy from.
+ *     from_offset: The byte location within the source.
+ *     to:          The node identifier to copy to.
+ *     to_offset:   The byte location within the destination.
+ *     size:        The size of the range in bytes.
+ *     copied:      The number of bytes copied, fewer than size at the end of the
+ *                  source or if copying failed partway.
  *
  * Returns:
- *     0 on success, otherwise an errno code.
+ *     0 if anything was copied or the source ends before the range, -EINVAL for
+ *     overlapping ranges of one file, otherwise an errno code.
  */
-int oncefs_get_link(oncefs_t *ofs, const char *path, oncefs_node_t *result) {
-    int r;
-    r = _oncefs_resolve_node(ofs, path, result);
-    if (r != 0) { return r; }
+int oncefs_copy_data(oncefs_t *ofs, uint32_t from, uint64_t from_offset, uint32_t to,
+                     uint64_t to_offset, size_t size, size_t *copied) {
+    int _apply() {
+        return _oncefs_copy_data(ofs, from, from_offset, to, to_offset, size, copied);
+    }
 
-    if (result->type != NODE_TYPE_LINK) { return -EINVAL; }
+    return _oncefs_write(ofs, _apply);
+}
 
-    oncefs_node_t key = {
-        .node = result->node, .parent = result->node, .type = NODE_TYPE_LINK_PAYLOAD};
+/**
+ * Helper to bring the cached state of an open file up to date.
+ */
+int _oncefs_handle_refresh(oncefs_t *ofs, oncefs_handle_t *handle) {
+    int r;
 
-    oncefs_node_t tmp;
+    if (handle->generation == ofs->generation) { return 0; }
 
-    r = table_query_first(&ofs->nodes, (void *) &key, TABLE_INDEX_PRIMARY, NULL, 
-                           (void *) &tmp);
+    oncefs_node_t node;
+    r = _oncefs_find_node(ofs, handle->node.node, &node);
     if (r != 0) { return r; }
 
-    memcpy(result, &tmp, sizeof(*result));
+    handle->node = node;
+    _oncefs_stat(ofs, &node, &handle->stat);
 
-    return r;
+    handle->extents.fill = 0;
+    handle->window = 0;
+    handle->window_end = 0;
+    handle->generation = ofs->generation;
+
+    return 0;
 }
 
 /**
- * Filesystem operation to write data associated with a node.
+ * Helper to find the extents of a range of an open file.
+ *
+ * A read that follows on from the last one continues from the extent it ended in,
+ * and looks up a whole window ahead once it runs past the extents at hand.
  *
  * Arguments:
- *     ofs:     A pointer to the parent instance. 
- *     node:    The node identifier.
- *     data:    The data to write.
- *     size:    The size of data in bytes.
- *     offset:  The byte location of the data within the node.
+ *     ofs:     A pointer to the parent instance.
+ *     handle:  The open file, locked by the caller.
+ *     size:    The size of the range in bytes.
+ *     offset:  The byte location of the range within the file.
+ *     result:  The extents of the range, up to the end of the data.
  *
  * Returns:
  *     0 on success, otherwise an errno code.
  */
-size_t oncefs_set_data(oncefs_t *ofs, uint32_t node, const char *data, size_t size,
-                    uint64_t offset) {
+int _oncefs_handle_extents(oncefs_t *ofs, oncefs_handle_t *handle, size_t size,
+                           uint64_t offset, array_t *result) {
     int r;
 
-    size_t written = 0;
-    size_t amount;
-    while (written < size) {
-        // write in blocks
-        amount = size - written;
-        if (amount > ofs->payload_size) { amount = ofs->payload_size; }
+    r = _oncefs_handle_refresh(ofs, handle);
+    if (r != 0) { return r; }
 
-        oncefs_block_t block;
-        r = _oncefs_create_block(ofs, &block, BLOCK_OPERATION_DATA, node, amount,
-                                 offset + written);
-        if (r != 0) { return r; }
+    uint64_t end = offset + size;
+    int sequential = offset == handle->next;
 
-        oncefs_data_t data_entry = {
-            .node = node, .fill = amount, .offset = offset + written};
+    if (offset < handle->window || end > handle->window_end) {
+        uint64_t window_end = end;
+        if (sequential && size < ONCEFS_HANDLE_WINDOW) {
+            window_end = offset + ONCEFS_HANDLE_WINDOW;
+        }
 
-        if (ofs->io != NULL) {
-            r = io_write3(ofs->io, block.block, &block.tag, sizeof(block.tag),
-                          &data_entry, sizeof(data_entry), data + written, amount);
-            if (r != 0) { return r; }
+        r = _oncefs_get_extents(ofs, handle->node.node, window_end - offset, offset,
+                                &handle->extents);
+        if (r != 0) {
+            handle->extents.fill = 0;
+            handle->window_end = 0;
+            return r;
         }
 
-        written += amount;
+        handle->window = offset;
+        handle->window_end = window_end;
+        handle->cursor = 0;
+        sequential = 1;
+    }
+
+    size_t count = array_len(&handle->extents);
+    oncefs_extent_t *entries = (oncefs_extent_t *) handle->extents.entries;
+
+    size_t i = 0;
+    if (sequential) {
+        i = handle->cursor;
+    } else {
+        size_t high = count;
+        while (i < high) {
+            size_t mid = i + (high - i) / 2;
+            if (entries[mid].offset + entries[mid].size <= offset) {
+                i = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+    }
+    while (i < count && entries[i].offset + entries[i].size <= offset) { i++; }
+
+    result->fill = 0;
+    for (; i < count && entries[i].offset < end; i++) {
+        oncefs_extent_t extent = entries[i];
+        if (extent.offset < offset) {
+            extent.skip += offset - extent.offset;
+            extent.size -= offset - extent.offset;
+            extent.offset = offset;
+        }
+        if (extent.offset + extent.size > end) { extent.size = end - extent.offset; }
+
+        r = array_append(result, &extent);
+        if (r != 0) { return r; }
     }
 
+    // The next read may continue in the last extent touched
+    handle->cursor = (i > 0) ? i - 1 : 0;
+    handle->next = end;
+
     return 0;
 }
 
 /**
- * Helper to read data asssociated with a node.
+ * Filesystem operation to open a file for repeated access.
+ *
+ * The handle caches the node, its attributes and the extents of the part last read,
+ * until any change to the instance makes them stale. Accesses through one handle from
+ * several threads at once are safe; all but one of them bypass the cache.
  *
  * Arguments:
- *     ofs:     A pointer to the parent instance. 
+ *     ofs:     A pointer to the parent instance.
  *     node:    The node identifier.
- *     data:    A buffer to hold the resulting data.
- *     size:    The size of data buffer in bytes.
- *     offset:  The byte location of the data within the node.
+ *     handle:  A pointer to the instance to initialize, released with oncefs_close.
  *
  * Returns:
- *     0 on success, otherwise an errno code.
+ *     0 on success, -EINVAL if the node is not a file, otherwise an errno code.
  */
-int _oncefs_get_data(oncefs_t *ofs, uint32_t node, char *data, uint16_t size,
-                    uint64_t offset) {
+int oncefs_open(oncefs_t *ofs, uint32_t node, oncefs_handle_t *handle) {
     int r;
 
-    int _filter(const void *raw_key, const void *raw_other) {
-        int r;
-
-        r = _oncefs_block_cmp_lookup_fuzzy(raw_key, raw_other);
-        if (r != 0) { return r; }
-
-        oncefs_block_t *k = (oncefs_block_t *) raw_key;
-        oncefs_block_t *o = (oncefs_block_t *) raw_other;
-
-        // stretch to include any blocks that could potentially contain
-        // overlapping data
-        int window = k->data.fill + ofs->payload_size;
+    array_init(&handle->extents, sizeof(oncefs_extent_t));
+    pthread_mutex_init(&handle->lock, NULL);
+    handle->window = 0;
+    handle->window_end = 0;
+    handle->cursor = 0;
+    handle->next = 0;
 
-        if (k->data.offset + window < o->data.offset) { return -1; }
-        if (k->data.offset > o->data.offset + window) { return 1; }
+    pthread_rwlock_rdlock(&ofs->lock);
+    r = _oncefs_find_node(ofs, node, &handle->node);
+    if (r == 0 && handle->node.type != NODE_TYPE_FILE) { r = -EINVAL; }
+    if (r == 0) {
+        _oncefs_stat(ofs, &handle->node, &handle->stat);
+        handle->generation = ofs->generation;
+    }
+    pthread_rwlock_unlock(&ofs->lock);
 
-        return 0;
-    };
+    if (r != 0) { oncefs_close(handle); }
 
-    int _order_by(const void *raw_a, const void *raw_b) {
-        oncefs_block_t *a = (oncefs_block_t *) raw_a;
-        oncefs_block_t *b = (oncefs_block_t *) raw_b;
+    return r;
+}
 
-        if (a->tag.seq < b->tag.seq) {
-            return -1;
-        } else if (a->tag.seq > b->tag.seq) {
-            return 1;
-        }
+void oncefs_close(oncefs_handle_t *handle) {
+    array_free(&handle->extents);
+    pthread_mutex_destroy(&handle->lock);
+}
 
-        return 0;
-    };
+int oncefs_handle_stat(oncefs_t *ofs, oncefs_handle_t *handle, oncefs_stat_t *result) {
+    int r;
 
-    oncefs_block_t key = {.tag = {.operation = BLOCK_OPERATION_DATA},
-                          .data = {.node = node, .fill = size, .offset = offset}};
+    if (pthread_mutex_trylock(&handle->lock) != 0) {
+        return oncefs_get_node_id(ofs, handle->node.node, result);
+    }
 
-    // Relative to file
-    off_t tgt_start = offset;
-    off_t tgt_end = offset + size;
+    pthread_rwlock_rdlock(&ofs->lock);
+    r = _oncefs_handle_refresh(ofs, handle);
+    if (r == 0) { *result = handle->stat; }
+    pthread_rwlock_unlock(&ofs->lock);
 
-    int fill = 0;
+    pthread_mutex_unlock(&handle->lock);
 
-    int _callback(void *raw) {
-        int r;
-        oncefs_block_t *result = (oncefs_block_t *) raw;
+    return r;
+}
 
-        // Relative to file
-        off_t src_start = result->data.offset;
-        off_t src_end = src_start + result->data.fill;
+/**
+ * Filesystem operation to read data from an open file, see oncefs_get_data.
+ */
+size_t oncefs_handle_get_data(oncefs_t *ofs, oncefs_handle_t *handle, char *data,
+                              size_t size, uint64_t offset) {
+    int r;
 
-        if (src_start > tgt_end || src_end < tgt_start) {
-            return 0; // no bytes overlap
-        }
+    if (pthread_mutex_trylock(&handle->lock) != 0) {
+        return oncefs_get_data(ofs, handle->node.node, data, size, offset);
+    }
 
-        int skip = 0;
-        int seek = 0;
-        if (src_start < tgt_start) {
-            skip = tgt_start - src_start;
-            src_start = tgt_start;
-        } else if (src_start > tgt_start) {
-            seek = src_start - tgt_start;
-        }
+    array_t extents;
+    array_init(&extents, sizeof(oncefs_extent_t));
 
-        if (src_end > tgt_end) { src_end = tgt_end; }
+    pthread_rwlock_rdlock(&ofs->lock);
+    r = _oncefs_handle_extents(ofs, handle, size, offset, &extents);
+    if (r == 0) {
+        r = _oncefs_read_extents(ofs, (oncefs_extent_t *) extents.entries,
+                                 array_len(&extents), data, size, offset);
+    }
+    pthread_rwlock_unlock(&ofs->lock);
 
-        int amount = src_end - src_start;
+    pthread_mutex_unlock(&handle->lock);
+    array_free(&extents);
 
-        // printf("skip seek amount %i %i %i\n", skip, seek, amount);
+    return r;
+}
 
-        if (amount <= 0) { return 0; }
+/**
+ * Filesystem operation to find where the bytes of a range of an open file are stored,
+ * see oncefs_get_extents.
+ */
+int oncefs_handle_get_extents(oncefs_t *ofs, oncefs_handle_t *handle, size_t size,
+                              uint64_t offset,
+                              int (*callback)(oncefs_extent_t *extents, size_t count)) {
+    int r;
 
-        r = io_read3(ofs->io, result->block, NULL, sizeof(oncefs_tag_t), NULL,
-                     sizeof(oncefs_data_t) + skip, data + seek, amount);
-        if (r != 0) { return r; }
+    if (pthread_mutex_trylock(&handle->lock) != 0) {
+        return oncefs_get_extents(ofs, handle->node.node, size, offset, callback);
+    }
 
-        if (skip + amount > fill) {
-            fill = skip + amount;
-        }
+    array_t extents;
+    array_init(&extents, sizeof(oncefs_extent_t));
 
-        return 0;
-    };
+    pthread_rwlock_rdlock(&ofs->lock);
+    r = _oncefs_handle_extents(ofs, handle, size, offset, &extents);
+    if (r == 0) {
+        r = callback((oncefs_extent_t *) extents.entries, array_len(&extents));
+    }
+    pthread_rwlock_unlock(&ofs->lock);
 
-    r = table_query_order_by(&ofs->blocks, &key, TABLE_INDEX_LOOKUP, _filter, _order_by,
-                             _callback);
-    if (r != 0) { return r; }
+    pthread_mutex_unlock(&handle->lock);
+    array_free(&extents);
 
-    return fill;
+    return r;
 }
 
 /**
- * Filesystem operation to read data asssociated with a node.
- *
- * Breaks up read operations into block sized chunks.
- *
- * Arguments:
- *     ofs:     A pointer to the parent instance. 
- *     node:    The node identifier.
- *     data:    A buffer to hold the resulting data.
- *     size:    The size of data buffer in bytes.
- *     offset:  The byte location of the data within the node.
+ * Filesystem operation to write data to an open file, see oncefs_set_data.
  *
- * Returns:
- *     0 on success, otherwise an errno code.
+ * If nothing else changed since the handle was last brought up to date, it stays
+ * valid, so appending does not throw away the extents of what was read.
  */
-size_t oncefs_get_data(oncefs_t *ofs, uint32_t node, char *data, size_t size,
-                    uint64_t offset) {
-    size_t total = 0; // total amount read
-    int limit; // max amount to read
-    int read; // amount read
-    while (total < size) {
-        // total in blocks
-        limit = (size - total > ofs->payload_size) ? ofs->payload_size : size - total;
+size_t oncefs_handle_set_data(oncefs_t *ofs, oncefs_handle_t *handle, const char *data,
+                              size_t size, uint64_t offset) {
+    int r;
 
-        read = _oncefs_get_data(ofs, node, data + total, limit, offset + total);
-        if(read == -ENOENT || read  == 0) { break; }
-        if(read < 0) { return read ; }
+    if (pthread_mutex_trylock(&handle->lock) != 0) {
+        return oncefs_set_data(ofs, handle->node.node, data, size, offset);
+    }
+
+    int _apply() {
+        int r;
+
+        // Counting this change
+        int fresh = handle->generation + 1 == ofs->generation;
+
+        r = _oncefs_set_data(ofs, handle->node.node, data, size, offset);
+        if (r != 0 || !fresh) { return r; }
+
+        if (offset + size > handle->stat.size) { handle->stat.size = offset + size; }
+        if (offset < handle->window_end && offset + size > handle->window) {
+            handle->extents.fill = 0;
+            handle->window = 0;
+            handle->window_end = 0;
+        }
+        handle->generation = ofs->generation;
 
-        total += read ;
+        return 0;
     }
 
-    return total;
+    r = _oncefs_write(ofs, _apply);
+
+    pthread_mutex_unlock(&handle->lock);
+
+    return r;
 }
 
 /**
@@ -1114,54 +3100,36 @@ int _oncefs_move_node(oncefs_t *ofs, oncefs_node_t *node) {
     return 0;
 }
 
-/**
- * Filesystem operation to rename or move a node.
- *
- * Breaks up read operations into block sized chunks.
- *
- * Arguments:
- *     ofs:     A pointer to the parent instance. 
- *     from:    The node's current path. 
- *     to:      The node's desired new path. 
- *
- * Returns:
- *     0 on success, otherwise an errno code.
+/**
+ * Helper to rename or move a node between directories.
  */
-int oncefs_move_node(oncefs_t *ofs, const char *from, const char *to) {
+int _oncefs_move_node_at(oncefs_t *ofs, uint32_t parent, const char *name,
+                         uint32_t new_parent, const char *new_name) {
     int r;
 
     // Find the node
     oncefs_node_t result;
-    r = _oncefs_resolve_node(ofs, from, &result);
+    r = _oncefs_find_child(ofs, parent, name, &result);
     if (r != 0) { return r; }
 
     // Check if target parent is directory
-    char *tmp = strdup(to);
-    char *dir = dirname(tmp);
-
-    oncefs_node_t parent;
-    r = _oncefs_resolve_node(ofs, dir, &parent);
-
-    free(tmp);
-
+    oncefs_node_t dir;
+    r = _oncefs_find_node(ofs, new_parent, &dir);
     if (r != 0) { return r; }
-    if (parent.type != NODE_TYPE_DIR) { return -EINVAL; }
+    if (dir.type != NODE_TYPE_DIR) { return -EINVAL; }
 
-    // Set new parent
-    result.parent = parent.node;
+    r = _oncefs_check_name(new_name);
+    if (r != 0) { return r; }
 
-    // Set new name
-    tmp = strdup(to);
-    char *name = basename(tmp);
-    strncpy(result.name, name, ONCEFS_NAME_MAX_SIZE);
-    free(tmp);
-    if (strlen(result.name) > ONCEFS_NAME_MAX_SIZE) { return -EINVAL; }
+    // Set new parent and name
+    result.parent = new_parent;
+    strcpy(result.name, new_name);
 
     // Perform move
     r = _oncefs_move_node(ofs, &result);
     if (r == -EEXIST) {
         // Conflict
-        r = oncefs_del_node(ofs, to);
+        r = _oncefs_del_node_at(ofs, new_parent, new_name);
         if (r != 0) { return r; }
 
         // try again
@@ -1176,14 +3144,66 @@ int oncefs_move_node(oncefs_t *ofs, const char *from, const char *to) {
     if (r != 0) { return r; }
 
     if (ofs->io != NULL) {
-        r = io_write2(ofs->io, block.block, &block.tag, sizeof(block.tag), &result,
-                      sizeof(result));
+        r = _oncefs_write_node(ofs, &block, &result);
         if (r != 0) { return r; }
     }
 
     return 0;
 }
 
+/**
+ * Filesystem operation to rename or move a node between directories.
+ *
+ * Arguments:
+ *     ofs:         A pointer to the parent instance.
+ *     parent:      The node identifier of the current directory.
+ *     name:        The current name.
+ *     new_parent:  The node identifier of the desired directory.
+ *     new_name:    The desired name.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int oncefs_move_node_at(oncefs_t *ofs, uint32_t parent, const char *name,
+                        uint32_t new_parent, const char *new_name) {
+    int _apply() {
+        return _oncefs_move_node_at(ofs, parent, name, new_parent, new_name);
+    }
+
+    return _oncefs_write(ofs, _apply);
+}
+
+/**
+ * Filesystem operation to rename or move a node.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the parent instance. 
+ *     from:    The node's current path. 
+ *     to:      The node's desired new path. 
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int oncefs_move_node(oncefs_t *ofs, const char *from, const char *to) {
+    int _apply() {
+        int r;
+
+        uint32_t parent;
+        char name[ONCEFS_NAME_MAX_SIZE + 1];
+        r = _oncefs_resolve_parent(ofs, from, &parent, name);
+        if (r != 0) { return r; }
+
+        uint32_t new_parent;
+        char new_name[ONCEFS_NAME_MAX_SIZE + 1];
+        r = _oncefs_resolve_parent(ofs, to, &new_parent, new_name);
+        if (r != 0) { return r; }
+
+        return _oncefs_move_node_at(ofs, parent, name, new_parent, new_name);
+    }
+
+    return _oncefs_write(ofs, _apply);
+}
+
 /**
  * Helper to delete a node and associated data.
  *
@@ -1250,6 +3270,7 @@ int _oncefs_del_node(oncefs_t *ofs, oncefs_node_t *node, int check_for_children)
     // Set all blocks to be free
     int _mutator2(void *raw) {
         oncefs_block_t *block = (oncefs_block_t *) raw;
+        _oncefs_discard_later(ofs, block);
         block->tag.operation = BLOCK_OPERATION_FREE;
         return 0;
     }
@@ -1267,20 +3288,13 @@ int _oncefs_del_node(oncefs_t *ofs, oncefs_node_t *node, int check_for_children)
 }
 
 /**
- * Filesystem operation to delete a node and associated data.
- *
- * Arguments:
- *     ofs:     A pointer to the parent instance. 
- *     path:    A string path.
- *
- * Returns:
- *     0 on success, otherwise an errno code.
+ * Helper to delete a node by name within a directory, and its data.
  */
-int oncefs_del_node(oncefs_t *ofs, const char *path) {
+int _oncefs_del_node_at(oncefs_t *ofs, uint32_t parent, const char *name) {
     int r;
 
     oncefs_node_t result;
-    r = _oncefs_resolve_node(ofs, path, &result);
+    r = _oncefs_find_child(ofs, parent, name, &result);
     if (r != 0) { return r; }
 
     r = _oncefs_del_node(ofs, &result, 1);
@@ -1292,14 +3306,57 @@ int oncefs_del_node(oncefs_t *ofs, const char *path) {
     if (r != 0) { return r; }
 
     if (ofs->io != NULL) {
-        r = io_write2(ofs->io, block.block, &block.tag, sizeof(block.tag), &result,
-                      sizeof(result));
+        r = _oncefs_write_node(ofs, &block, &result);
         if (r != 0) { return r; }
     }
 
     return 0;
 }
 
+/**
+ * Filesystem operation to delete a node by name within a directory, and its data.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the parent instance.
+ *     parent:  The node identifier of the directory.
+ *     name:    The name of the node.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int oncefs_del_node_at(oncefs_t *ofs, uint32_t parent, const char *name) {
+    int _apply() {
+        return _oncefs_del_node_at(ofs, parent, name);
+    }
+
+    return _oncefs_write(ofs, _apply);
+}
+
+/**
+ * Filesystem operation to delete a node and associated data.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the parent instance. 
+ *     path:    A string path.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int oncefs_del_node(oncefs_t *ofs, const char *path) {
+    int _apply() {
+        int r;
+
+        uint32_t parent;
+        char name[ONCEFS_NAME_MAX_SIZE + 1];
+        r = _oncefs_resolve_parent(ofs, path, &parent, name);
+        if (r != 0) { return r; }
+
+        return _oncefs_del_node_at(ofs, parent, name);
+    }
+
+    return _oncefs_write(ofs, _apply);
+}
+
 /**
  * Helper to delete a range of data.
  *
@@ -1337,6 +3394,7 @@ int _oncefs_del_data(oncefs_t *ofs, uint32_t node, uint64_t new_size) {
         off_t start = block->data.offset;
         if (start >= new_size) {
             // No bytes to keep
+            _oncefs_discard_later(ofs, block);
             block->tag.operation = BLOCK_OPERATION_FREE;
             return 0;
         }
@@ -1374,18 +3432,9 @@ int _oncefs_del_data(oncefs_t *ofs, uint32_t node, uint64_t new_size) {
 }
 
 /**
- * Filesystem operation to delete or truncate a range of data.
- *
- * Arguments:
- *     ofs:         A pointer to the parent instance. 
- *     node:        The node identifier to delete from.
- *     new_size:    The desired size in bytes of the node after the delete has been
- *                  performed.
- *
- * Returns:
- *     0 on success, otherwise an errno code.
+ * Helper to truncate a file and register the truncate block.
  */
-int oncefs_del_data(oncefs_t *ofs, uint32_t node, uint64_t new_size) {
+int _oncefs_truncate(oncefs_t *ofs, uint32_t node, uint64_t new_size) {
     int r;
 
     // Check that the node exists in the first place?
@@ -1405,8 +3454,7 @@ int oncefs_del_data(oncefs_t *ofs, uint32_t node, uint64_t new_size) {
     if (r != 0) { return r; }
 
     if (ofs->io != NULL) {
-        r = io_write2(ofs->io, block.block, &block.tag, sizeof(block.tag), &block.data,
-                      sizeof(block.data));
+        r = _oncefs_write_data(ofs, &block, NULL);
         if (r != 0) { return r; }
     }
 
@@ -1414,43 +3462,30 @@ int oncefs_del_data(oncefs_t *ofs, uint32_t node, uint64_t new_size) {
 }
 
 /**
- * Helper to format all data in a container.
- *
- * The tag portion of all blocks will be overwritten to invalid values.
+ * Filesystem operation to delete or truncate a range of data.
  *
  * Arguments:
  *     ofs:         A pointer to the parent instance. 
+ *     node:        The node identifier to delete from.
+ *     new_size:    The desired size in bytes of the node after the delete has been
+ *                  performed.
  *
  * Returns:
  *     0 on success, otherwise an errno code.
  */
-int _oncefs_format(oncefs_t *ofs) {
-    int r;
-
-    size_t start = io_block_first(ofs->io);
-    size_t end = io_block_last(ofs->io);
-
-    oncefs_tag_t tag;
-    size_t tag_size = sizeof(tag);
-
-    for (size_t i = start; i <= end; i++) {
-        // Overwrite all tag operations to invalid values
-        tag.seq = random();
-        do {
-            tag.operation = random();
-        } while (tag.operation <= BLOCK_OPERATION_LAST);
-
-        r = io_write(ofs->io, i, &tag, tag_size);
-        if (r != 0) { return r; }
+int oncefs_del_data(oncefs_t *ofs, uint32_t node, uint64_t new_size) {
+    int _apply() {
+        return _oncefs_truncate(ofs, node, new_size);
     }
 
-    return 0;
+    return _oncefs_write(ofs, _apply);
 }
 
 /**
- * Helper to load data from a container.
+ * Helper to format all data in a container.
  *
- * Blocks are processed in order of their sequence number.
+ * Only the superblock is written. Its new epoch invalidates the tags of all blocks
+ * written before.
  *
  * Arguments:
  *     ofs:         A pointer to the parent instance. 
@@ -1458,30 +3493,70 @@ int _oncefs_format(oncefs_t *ofs) {
  * Returns:
  *     0 on success, otherwise an errno code.
  */
-int _oncefs_load(oncefs_t *ofs) {
+int _oncefs_format(oncefs_t *ofs) {
+    int r;
+
+    r = _oncefs_write_super(ofs);
+    if (r != 0) { return r; }
+
+    return 0;
+}
+
+/**
+ * Helper to load the blocks of a container, collecting their tags, see _oncefs_load.
+ */
+int _oncefs_load_tags(oncefs_t *ofs, array_t *tags) {
     int r;
 
     size_t start = io_block_first(ofs->io);
     size_t end = io_block_last(ofs->io);
-    size_t num_blocks = end - start + 1; // +1 since end is a valid block
 
     size_t count = 0;
 
-    // Read all tags
-    oncefs_tagged_block_t tags[num_blocks];
+    // Tags are scanned front to back, then blocks are replayed in sequence order
+    r = io_advise(ofs->io, IO_ADVICE_SEQUENTIAL);
+    if (r != 0) { return r; }
+
+    // Read all tags, one batch at a time
+    oncefs_tagged_block_t batch_tags[IO_QUEUE_DEPTH];
+    oncefs_tagged_block_t item;
     oncefs_tagged_block_t *cursor;
 
-    size_t item_size = sizeof(oncefs_tagged_block_t);
-    for (size_t i = start; i <= end; i++) {
-        cursor = &tags[count];
-        cursor->block = i;
+    size_t tag_size = _oncefs_tag_size(ofs);
+    uint8_t raw[IO_QUEUE_DEPTH][ONCEFS_RECORD_MAX_SIZE];
+
+    for (size_t batch = start; batch <= end; batch += IO_QUEUE_DEPTH) {
+        size_t batch_end = batch + IO_QUEUE_DEPTH - 1;
+        if (batch_end > end) { batch_end = end; }
+
+        for (size_t i = batch; i <= batch_end; i++) {
+            cursor = &batch_tags[i - batch];
+            cursor->block = i;
+
+            r = io_queue_read(ofs->io, i, raw[i - batch], tag_size);
+            if (r != 0) { return r; }
+        }
 
-        r = io_read(ofs->io, i, &cursor->tag, item_size);
+        r = io_submit(ofs->io);
         if (r != 0) { return r; }
 
-        if (cursor->tag.operation >= BLOCK_OPERATION_LAST) { break; }
+        for (size_t i = batch; i <= batch_end; i++) {
+            _oncefs_unpack_tag(ofs, raw[i - batch], &batch_tags[i - batch].tag);
+        }
+
+        // Stop at the first block that has not been written since the last format
+        for (size_t i = batch; i <= batch_end; i++) {
+            oncefs_tag_t *tag = &batch_tags[i - batch].tag;
+            if (tag->operation >= BLOCK_OPERATION_LAST) { break; }
+            if (tag->epoch != ofs->epoch) { break; }
+            if (tag->operation == BLOCK_OPERATION_FREE && tag->seq == 0) { break; }
 
-        count += 1;
+            r = array_append(tags, &batch_tags[i - batch]);
+            if (r != 0) { return r; }
+            count += 1;
+        }
+
+        if (count < batch_end - start + 1) { break; }
     }
 
     // Sort tags by sequence id
@@ -1496,76 +3571,93 @@ int _oncefs_load(oncefs_t *ofs) {
         return 0;
     }
 
-    qsort(&tags, count, item_size, &cmp);
+    r = array_sort(tags, &cmp);
+    if (r != 0) { return r; }
 
     // Process tags
-    oncefs_node_t node_entry;
-    oncefs_data_t data_entry;
+    oncefs_node_t node;
+    oncefs_data_t data;
+    oncefs_node_t *node_entry = &node;
+    oncefs_data_t *data_entry = &data;
 
-    // Load blocks one by one
+    // Block contents are read in batches but replayed one by one
 
     int operation;
     for (size_t i = 0; i < count; i++) {
-        cursor = &tags[i];
+        size_t slot = i % IO_QUEUE_DEPTH;
+        if (slot == 0) {
+            for (size_t j = i; j < count && j < i + IO_QUEUE_DEPTH; j++) {
+                r = array_get(tags, j, &item);
+                if (r != 0) { return r; }
+                cursor = &item;
+
+                operation = cursor->tag.operation;
+                int entry_size = _oncefs_entry_size(ofs, _oncefs_has_data(operation));
+
+                r = io_queue_read2(ofs->io, cursor->block, NULL, tag_size, raw[j - i],
+                                   entry_size);
+                if (r != 0) { return r; }
+            }
+
+            r = io_submit(ofs->io);
+            if (r != 0) { return r; }
+        }
+
+        r = array_get(tags, i, &item);
+        if (r != 0) { return r; }
+        cursor = &item;
+
+        operation = cursor->tag.operation;
+        if (_oncefs_has_data(operation)) {
+            _oncefs_unpack_data(ofs, raw[slot], data_entry);
+        } else {
+            _oncefs_unpack_node(ofs, raw[slot], node_entry);
+        }
 
         // printf("Loading seq block op: %lu %i %i\n", cursor->tag.seq, cursor->block, cursor->tag.operation);
 
         operation = cursor->tag.operation;
         if (operation == BLOCK_OPERATION_DATA) {
-            r = io_read2(ofs->io, cursor->block, &cursor->tag, sizeof(cursor->tag),
-                         &data_entry, sizeof(data_entry));
-
-            // printf(" %i: truncate size %i offset %lu\n", data_entry.node, data_entry.fill, data_entry.offset);
+            // printf(" %i: truncate size %i offset %lu\n", data_entry->node, data_entry->fill, data_entry->offset);
 
-            r = _oncefs_load_block_data(ofs, cursor, &data_entry);
+            r = _oncefs_load_block_data(ofs, cursor, data_entry);
             if (r != 0) { return r; }
         } else if (operation == BLOCK_OPERATION_NODE) {
-            r = io_read2(ofs->io, cursor->block, &cursor->tag, sizeof(cursor->tag),
-                         &node_entry, sizeof(node_entry));
-            if (r != 0) { return r; }
-
-            // printf(" %i: node %s parent %i\n", node_entry.node, node_entry.name, node_entry.parent);
+            // printf(" %i: node %s parent %i\n", node_entry->node, node_entry->name, node_entry->parent);
 
-            r = table_insert_or_replace(&ofs->nodes, &node_entry);
+            r = table_insert_or_replace(&ofs->nodes, node_entry);
             if (r != 0) { return r; }
 
-            r = _oncefs_load_block_node(ofs, cursor, &node_entry);
+            r = _oncefs_load_block_node(ofs, cursor, node_entry);
             if (r != 0) { return r; }
 
         } else if (operation == BLOCK_OPERATION_MOVE) {
-            r = io_read2(ofs->io, cursor->block, &cursor->tag, sizeof(cursor->tag),
-                         &node_entry, sizeof(node_entry));
-            if (r != 0) { return r; }
-
-            // printf(" %i: move %s parent %i\n", node_entry.node, node_entry.name, node_entry.parent);
+            // printf(" %i: move %s parent %i\n", node_entry->node, node_entry->name, node_entry->parent);
 
-            r = _oncefs_move_node(ofs, &node_entry);
+            r = _oncefs_move_node(ofs, node_entry);
             if (r != 0) { return r; }
 
-            r = _oncefs_load_block_node(ofs, cursor, &node_entry);
+            r = _oncefs_load_block_node(ofs, cursor, node_entry);
             if (r != 0) { return r; }
         } else if (operation == BLOCK_OPERATION_DELETE) {
-            r = io_read2(ofs->io, cursor->block, &cursor->tag, sizeof(cursor->tag),
-                         &node_entry, sizeof(node_entry));
-            if (r != 0) { return r; }
-
-            // printf(" %i: delete %s parent %i\n", node_entry.node, node_entry.name, node_entry.parent);
+            // printf(" %i: delete %s parent %i\n", node_entry->node, node_entry->name, node_entry->parent);
 
-            r = _oncefs_del_node(ofs, &node_entry, 0); // do not check for children
+            r = _oncefs_del_node(ofs, node_entry, 0); // do not check for children
             if (r != 0 && r != -ENOENT) { return r; }
 
-            r = _oncefs_load_block_node(ofs, cursor, &node_entry);
+            r = _oncefs_load_block_node(ofs, cursor, node_entry);
             if (r != 0) { return r; }
         } else if (operation == BLOCK_OPERATION_TRUNCATE) {
-            r = io_read2(ofs->io, cursor->block, &cursor->tag, sizeof(cursor->tag),
-                         &data_entry, sizeof(data_entry));
+            // printf(" %i: truncate offset %lu\n", data_entry->node, data_entry->offset);
 
-            // printf(" %i: truncate offset %lu\n", data_entry.node, data_entry.offset);
-
-            r = _oncefs_del_data(ofs, data_entry.node, data_entry.offset);
+            r = _oncefs_del_data(ofs, data_entry->node, data_entry->offset);
             if (r != 0) { return r; }
 
-            r = _oncefs_load_block_data(ofs, cursor, &data_entry);
+            r = _oncefs_load_block_data(ofs, cursor, data_entry);
+            if (r != 0) { return r; }
+        } else if (operation == BLOCK_OPERATION_FREE) {
+            // A record that could not be written was replaced by this one
+            r = _oncefs_load_block_data(ofs, cursor, data_entry);
             if (r != 0) { return r; }
         } else {
             return -ENOSYS; // TODO not implemented
@@ -1577,14 +3669,216 @@ int _oncefs_load(oncefs_t *ofs) {
     }
 
     if(count > 0) {
-        ofs->next_seq_id = tags[count - 1].tag.seq + 1;
+        ofs->next_seq_id = cursor->tag.seq + 1; // the last in sequence order
     }
 
+    // Blocks freed while replaying were released when they were first freed
+    ofs->discards.fill = 0;
+
+    // From here on blocks are accessed through the index
+    r = io_advise(ofs->io, IO_ADVICE_RANDOM);
+    if (r != 0) { return r; }
+
     return 0;
 }
 
+/**
+ * Helper to load data from a container.
+ *
+ * Blocks are processed in order of their sequence number.
+ *
+ * Arguments:
+ *     ofs:         A pointer to the parent instance. 
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int _oncefs_load(oncefs_t *ofs) {
+    int r;
+
+    // There is a tag for every block written, as many as the block index holds, so
+    // spill them the same way
+    array_t tags;
+    array_init(&tags, sizeof(oncefs_tagged_block_t));
+
+    array_t *rows = &ofs->blocks.rows;
+    r = 0;
+    if (rows->spill_dir != NULL) {
+        r = array_set_spill(&tags, rows->spill_dir, rows->spill_limit);
+    }
+    if (r == 0) { r = _oncefs_load_tags(ofs, &tags); }
+
+    array_free(&tags);
+    return r;
+}
+
+/**
+ * Helper to copy the log to a new container.
+ */
+int _oncefs_migrate(oncefs_t *ofs, io_t *target) {
+    int r;
+
+    if (ofs->next_block_id > io_block_last(target) + 1) { return -ENOSPC; }
+
+    oncefs_t copy;
+    r = oncefs_init(&copy, target, 1); // format
+    if (r != 0) { return r; }
+
+    // Payloads only ever grow, since packed headers are smaller
+    if (copy.payload_size < ofs->payload_size) {
+        oncefs_free(&copy);
+        return -EINVAL;
+    }
+
+    size_t tag_size = _oncefs_tag_size(ofs);
+    uint8_t raw[ONCEFS_RECORD_MAX_SIZE];
+    char payload[ofs->payload_size];
+
+    r = io_advise(ofs->io, IO_ADVICE_SEQUENTIAL);
+
+    for (size_t i = ofs->first_block_id; r == 0 && i < ofs->next_block_id; i++) {
+        oncefs_block_t block = {.block = i};
+
+        r = io_read(ofs->io, i, raw, tag_size);
+        if (r != 0) { break; }
+        _oncefs_unpack_tag(ofs, raw, &block.tag);
+
+        int operation = block.tag.operation;
+        if (_oncefs_has_data(operation)) {
+            r = io_read2(ofs->io, i, NULL, tag_size, raw, _oncefs_entry_size(ofs, 1));
+            if (r != 0) { break; }
+            _oncefs_unpack_data(ofs, raw, &block.data);
+
+            char *source = NULL;
+            if (operation == BLOCK_OPERATION_DATA) {
+                r = io_read2(ofs->io, i, NULL, ofs->overhead_size, payload,
+                             block.data.fill);
+                if (r != 0) { break; }
+                source = payload;
+            }
+
+            r = _oncefs_write_data(&copy, &block, source);
+        } else {
+            oncefs_node_t node;
+            r = io_read2(ofs->io, i, NULL, tag_size, raw, _oncefs_entry_size(ofs, 0));
+            if (r != 0) { break; }
+            _oncefs_unpack_node(ofs, raw, &node);
+
+            r = _oncefs_write_node(&copy, &block, &node);
+        }
+    }
+
+    if (r == 0) { r = io_sync(target); }
+
+    oncefs_free(&copy);
+
+    return r;
+}
+
+/**
+ * Copy a container into a new one using the current on-disk format.
+ *
+ * Every block keeps its position and sequence number, so the copy replays exactly like
+ * the original. The original is not modified, so an interrupted migration can simply be
+ * started over.
+ *
+ * Arguments:
+ *     ofs:     A pointer to a loaded instance, in any format.
+ *     target:  A pointer to an input-output instance for the new container. It is
+ *              formatted first, and must have at least as many blocks as are in use.
+ *
+ * Returns:
+ *     0 on success, otherwise an errno code.
+ */
+int oncefs_migrate(oncefs_t *ofs, io_t *target) {
+    pthread_rwlock_rdlock(&ofs->lock);
+    int r = _oncefs_migrate(ofs, target);
+    pthread_rwlock_unlock(&ofs->lock);
+
+    return r;
+}
+
 int oncefs_sync(oncefs_t *ofs) {
-    return io_sync(ofs->io);
+    int r;
+
+    // Blocks freed from here on may not be covered by the flush; writers hold the
+    // lock until the records freeing them are written
+    pthread_rwlock_rdlock(&ofs->lock);
+    pthread_mutex_lock(&ofs->discard_lock);
+    uint64_t round = ofs->discard_round++;
+    pthread_mutex_unlock(&ofs->discard_lock);
+    pthread_rwlock_unlock(&ofs->lock);
+
+    r = io_sync(ofs->io);
+    if (r != 0) { return r; }
+
+    pthread_mutex_lock(&ofs->discard_lock);
+    r = _oncefs_discard(ofs, round);
+    pthread_mutex_unlock(&ofs->discard_lock);
+
+    return r;
+}
+
+void oncefs_get_amplification(oncefs_t *ofs, oncefs_amplification_t *result) {
+    pthread_rwlock_rdlock(&ofs->lock);
+    memcpy(result, ofs->amplification, sizeof(ofs->amplification));
+    pthread_rwlock_unlock(&ofs->lock);
+}
+
+/**
+ * Helper to dump the blocks and bytes written per operation to a table.
+ *
+ * Arguments:
+ *     ofs:     A pointer to the instance.
+ *     buffer:  The buffer to dump string data to.
+ */
+void oncefs_dumps_amplification(oncefs_t *ofs, char *buffer) {
+    int printer(const char *format, ...) {
+        int r;
+        va_list args;
+        va_start(args, format);
+        if (buffer != NULL) {
+            r = vsprintf(buffer, format, args);
+            buffer += r;
+        } else {
+            r = vprintf(format, args);
+        }
+        va_end(args);
+        return r;
+    }
+
+    static const char *names[BLOCK_OPERATION_LAST] = {
+        "free", "node", "data", "truncate", "delete", "move", "?", "?"};
+
+    oncefs_amplification_t total = {0};
+
+    pthread_rwlock_rdlock(&ofs->lock);
+
+    printer("\n  write amplification\n");
+    printer("+----------+------------+--------------+--------------+\n");
+    printer("| op       |     blocks |      logical |     physical |\n");
+    printer("+----------+------------+--------------+--------------+\n");
+    for (int i = 0; i < BLOCK_OPERATION_LAST; i++) {
+        oncefs_amplification_t *counter = &ofs->amplification[i];
+        if (counter->blocks == 0) { continue; }
+
+        printer("| %-8s | %10lu | %12lu | %12lu |\n", names[i], counter->blocks,
+                counter->logical, counter->physical);
+
+        total.blocks += counter->blocks;
+        total.logical += counter->logical;
+        total.physical += counter->physical;
+    }
+    printer("+----------+------------+--------------+--------------+\n");
+    printer("| total    | %10lu | %12lu | %12lu |\n", total.blocks, total.logical,
+            total.physical);
+    printer("+----------+------------+--------------+--------------+\n");
+    if (total.logical > 0) {
+        printer("| ratio    | %40.2f |\n", (double) total.physical / total.logical);
+        printer("+----------+------------------------------------------+\n");
+    }
+
+    pthread_rwlock_unlock(&ofs->lock);
 }
 
 /**
@@ -1612,6 +3906,8 @@ void oncefs_dumps(oncefs_t *ofs, char *buffer) {
         return r;
     }
 
+    pthread_rwlock_rdlock(&ofs->lock);
+
     printer("\n info \n");
     printer("+--------------+-------+\n");
     printer("| name         | value |\n");
@@ -1629,7 +3925,7 @@ void oncefs_dumps(oncefs_t *ofs, char *buffer) {
     printer("+--------------+-------+\n");
 
     oncefs_status_t status;
-    int r = oncefs_get_status(ofs, &status);
+    int r = _oncefs_get_status(ofs, &status);
     if(r == 0) {
         printer("| free blocks  | %5lu |\n", status.free_blocks);
         printer("+--------------+-------+\n");
@@ -1661,4 +3957,6 @@ void oncefs_dumps(oncefs_t *ofs, char *buffer) {
     }
     table_dump_by_index(&ofs->blocks, index, printer2);
     printer("+-------+-----+------+------+------+--------+\n");
+
+    pthread_rwlock_unlock(&ofs->lock);
 }
@@ -1,13 +1,56 @@
 #ifndef _ONCEFS_H
 #define _ONCEFS_H
 
+#include <semaphore.h>
 #include <stdint.h>
 
 #include "lib/io.h"
+#include "lib/ring.h"
 #include "lib/table.h"
 
 #define ONCEFS_NAME_MAX_SIZE 256
 
+// Changes waiting for the writer thread, and the most it applies under one lock
+#define ONCEFS_WRITER_QUEUE 256
+
+// Bytes of extents an open file looks up ahead of a sequential read
+#define ONCEFS_HANDLE_WINDOW (4 << 20)
+
+// Freed blocks waiting to be discarded; beyond this the oldest are dropped
+#define ONCEFS_DISCARD_MAX (1 << 18)
+
+// Versions of the on-disk format
+#define ONCEFS_VERSION_LEGACY 0 // raw structs with compiler padding, no superblock
+#define ONCEFS_VERSION_PACKED 1 // packed little-endian records, superblock in block 0
+#define ONCEFS_VERSION 2 // tags carry the format epoch
+
+// Epochs keep their top bit set, above anything version 1 stores in the same place
+#define ONCEFS_EPOCH_MIN 0x80000000u
+
+// Sizes of packed on-disk records
+#define ONCEFS_TAG_SIZE 13 // seq (8), operation (1), epoch (4)
+#define ONCEFS_DATA_SIZE 14 // node (4), fill (2), offset (8)
+#define ONCEFS_NODE_SIZE (27 + ONCEFS_NAME_MAX_SIZE + 1) // node (4), parent (4), type (1),
+                                                       // access (8), modification (8),
+                                                       // mode (2), name
+#define ONCEFS_SUPER_SIZE 32 // magic (8), version (4), block size (4), header size (4),
+                             // blocks (8), epoch (4)
+
+// Types of node records
+#define NODE_TYPE_DIR 1
+#define NODE_TYPE_FILE 2
+#define NODE_TYPE_LINK 3
+#define NODE_TYPE_LINK_PAYLOAD 4 // the target of a link, under the link's identifier
+
+// Operations recorded in block tags
+#define BLOCK_OPERATION_FREE 0
+#define BLOCK_OPERATION_NODE 1
+#define BLOCK_OPERATION_DATA 2
+#define BLOCK_OPERATION_TRUNCATE 3
+#define BLOCK_OPERATION_DELETE 4
+#define BLOCK_OPERATION_MOVE 5
+#define BLOCK_OPERATION_LAST 8
+
 /**
  * Main filesystem data structures and API.
  */
@@ -15,6 +58,7 @@
 typedef struct oncefs_tag {
     uint64_t seq;
     char operation;
+    uint32_t epoch; // fits in padding, so legacy records keep their size
 } oncefs_tag_t;
 
 typedef struct oncefs_node {
@@ -39,6 +83,15 @@ typedef struct oncefs_block {
     oncefs_data_t data;
 } oncefs_block_t;
 
+// A run of bytes of a file, stored in one block or not at all
+typedef struct oncefs_extent {
+    uint64_t offset; // within the file
+    size_t size;
+    int hole; // nothing stored; reads as zeros
+    uint32_t block;
+    int skip; // bytes into the payload of the block
+} oncefs_extent_t;
+
 typedef struct oncefs_status_t {
     int block_size;
     size_t total_blocks;
@@ -58,6 +111,33 @@ typedef struct oncefs_stat_t {
     time_t last_modification;
 } oncefs_stat_t;
 
+typedef struct oncefs_super {
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t header_size; // bytes kept apart in the io header table, or 0
+    uint64_t num_blocks;
+    uint32_t epoch; // tags from any other epoch predate the last format
+} oncefs_super_t;
+
+// Blocks written for one operation since the instance was initialized
+typedef struct oncefs_amplification {
+    uint64_t blocks;
+    uint64_t logical;  // bytes of caller data carried
+    uint64_t physical; // bytes of storage taken, with headers and padding
+} oncefs_amplification_t;
+
+typedef struct oncefs_config {
+    const char *spill_path; // directory for index pages that exceed the budget
+    size_t memory_budget;   // bytes of index memory to allow; 0 for unlimited
+    size_t discard_rate;    // freed blocks to release to storage per sync; 0 to keep
+} oncefs_config_t;
+
+// A freed data block waiting to be discarded, kept in order of block
+typedef struct oncefs_discard {
+    uint32_t block;
+    uint64_t round; // of oncefs_sync when it was freed
+} oncefs_discard_t;
+
 typedef struct oncefs {
     unsigned long next_node_id;
     unsigned long first_block_id;
@@ -70,20 +150,62 @@ typedef struct oncefs {
     io_t *io;
     int payload_size;
     int block_size;
+    int version;
+    uint32_t epoch;
+    int overhead_size; // bytes before the payload of a data block
+    array_t discards; // of oncefs_discard_t, for freed blocks whose payload is stored
+    size_t discard_rate;
+    size_t discard_max;
+    uint64_t discard_round; // bumped by oncefs_sync before it flushes
+    pthread_mutex_t discard_lock; // for discards, which oncefs_sync may use concurrently
+    pthread_rwlock_t lock; // held for reading by lookups and reads, for writing by changes
+    ring_t requests; // changes queued for the writer thread
+    pthread_t writer;
+    int writer_running;
+    sem_t writer_wake;
+    uint64_t generation; // bumped by every change, so cached state can tell it is stale
+    oncefs_amplification_t amplification[BLOCK_OPERATION_LAST];
 } oncefs_t;
 
-#define ONCEFS_OVERHEAD_SIZE (sizeof(oncefs_tag_t) + sizeof(oncefs_data_t))
+// State of an open file, valid while nothing changed since it was cached
+typedef struct oncefs_handle {
+    oncefs_node_t node;
+    oncefs_stat_t stat;
+    uint64_t generation; // of the instance when cached
+    pthread_mutex_t lock; // for one access at a time; others bypass the cache
+    array_t extents; // of the window of the file last looked up
+    uint64_t window;
+    uint64_t window_end;
+    size_t cursor; // extent where the last read ended
+    uint64_t next; // byte where the last read ended
+} oncefs_handle_t;
+
+#define ONCEFS_OVERHEAD_SIZE (ONCEFS_TAG_SIZE + ONCEFS_DATA_SIZE)
+#define ONCEFS_LEGACY_OVERHEAD_SIZE (sizeof(oncefs_tag_t) + sizeof(oncefs_data_t))
 
-int oncefs_init(oncefs_t *ofs, io_t *io, int format);
+int oncefs_init2(oncefs_t *ofs, io_t *io, int format, oncefs_config_t *config);
+#define oncefs_init(ofs, io, format) oncefs_init2(ofs, io, format, NULL)
 #define oncefs_init_default(ofs) oncefs_init(ofs, NULL, 0)
 void oncefs_free(oncefs_t *ofs);
 
+int oncefs_probe(io_t *io, oncefs_super_t *result);
+int oncefs_migrate(oncefs_t *ofs, io_t *target);
+
+// Safe to call from many threads: lookups and reads run in parallel, changes one at a
+// time, or one batch at a time with the writer thread. Directory callbacks run with
+// the instance locked and must not change it.
 int oncefs_set_file(oncefs_t *ofs, const char *path);
 int oncefs_set_dir(oncefs_t *ofs, const char *path);
 int oncefs_set_link(oncefs_t *ofs, const char *from, const char *to);
 int oncefs_set_time(oncefs_t *ofs, const char *path, time_t last_access, time_t last_modification);
 size_t oncefs_set_data(oncefs_t *ofs, uint32_t node, const char *data, size_t size,
                     uint64_t offset);
+int oncefs_set_data_in_place(oncefs_t *ofs, uint32_t node, size_t size, uint64_t offset,
+                             int (*place)(uint32_t block, int offset, size_t amount));
+int oncefs_allocate(oncefs_t *ofs, uint32_t node, size_t size, uint64_t offset,
+                    int keep_size);
+int oncefs_copy_data(oncefs_t *ofs, uint32_t from, uint64_t from_offset, uint32_t to,
+                     uint64_t to_offset, size_t size, size_t *copied);
 
 int oncefs_get_status(oncefs_t *ofs, oncefs_status_t *result);
 int oncefs_get_node(oncefs_t *ofs, const char *path, oncefs_stat_t *result);
@@ -92,14 +214,62 @@ int oncefs_get_dir(oncefs_t *ofs, const char *path,
 int oncefs_get_link(oncefs_t *ofs, const char *path, oncefs_node_t *result);
 size_t oncefs_get_data(oncefs_t *ofs, uint32_t node, char *data, size_t size,
                     uint64_t offset);
+int oncefs_get_extents(oncefs_t *ofs, uint32_t node, size_t size, uint64_t offset,
+                       int (*callback)(oncefs_extent_t *extents, size_t count));
+int oncefs_seek(oncefs_t *ofs, uint32_t node, uint64_t offset, int hole,
+                uint64_t *result);
+
+// Open files, for repeated access without looking the file up each time
+int oncefs_open(oncefs_t *ofs, uint32_t node, oncefs_handle_t *handle);
+void oncefs_close(oncefs_handle_t *handle);
+int oncefs_handle_stat(oncefs_t *ofs, oncefs_handle_t *handle, oncefs_stat_t *result);
+size_t oncefs_handle_get_data(oncefs_t *ofs, oncefs_handle_t *handle, char *data,
+                              size_t size, uint64_t offset);
+int oncefs_handle_get_extents(oncefs_t *ofs, oncefs_handle_t *handle, size_t size,
+                              uint64_t offset,
+                              int (*callback)(oncefs_extent_t *extents, size_t count));
+size_t oncefs_handle_set_data(oncefs_t *ofs, oncefs_handle_t *handle, const char *data,
+                              size_t size, uint64_t offset);
 
 int oncefs_move_node(oncefs_t *ofs, const char *from, const char *to);
 
 int oncefs_del_node(oncefs_t *ofs, const char *path);
 int oncefs_del_data(oncefs_t *ofs, uint32_t node, uint64_t from);
 
+// The same operations addressing nodes by identifier (0 is the root), or by name
+// within a directory, for callers that keep track of node identifiers
+int oncefs_lookup(oncefs_t *ofs, uint32_t parent, const char *name,
+                  oncefs_stat_t *result);
+int oncefs_get_node_id(oncefs_t *ofs, uint32_t node, oncefs_stat_t *result);
+int oncefs_get_dir_id(oncefs_t *ofs, uint32_t node,
+                      int (*callback)(oncefs_node_t *entry));
+int oncefs_get_dir_after(oncefs_t *ofs, uint32_t node, const char *after, int with_stat,
+                         int (*callback)(oncefs_node_t *entry, oncefs_stat_t *stat));
+int oncefs_get_link_id(oncefs_t *ofs, uint32_t node, oncefs_node_t *result);
+int oncefs_set_file_at(oncefs_t *ofs, uint32_t parent, const char *name,
+                       uint32_t *node);
+int oncefs_set_dir_at(oncefs_t *ofs, uint32_t parent, const char *name,
+                      uint32_t *node);
+int oncefs_set_link_at(oncefs_t *ofs, uint32_t parent, const char *name,
+                       const char *to, uint32_t *node);
+int oncefs_set_time_id(oncefs_t *ofs, uint32_t node, time_t last_access,
+                       time_t last_modification);
+int oncefs_move_node_at(oncefs_t *ofs, uint32_t parent, const char *name,
+                        uint32_t new_parent, const char *new_name);
+int oncefs_del_node_at(oncefs_t *ofs, uint32_t parent, const char *name);
+
 int oncefs_sync(oncefs_t *ofs);
 
+// Hand every change to one thread that applies them in batches, in arrival order;
+// stop only once no operations are in flight
+int oncefs_start_writer(oncefs_t *ofs);
+void oncefs_stop_writer(oncefs_t *ofs);
+
+// Get the blocks written per operation, indexed by BLOCK_OPERATION_*
+void oncefs_get_amplification(oncefs_t *ofs, oncefs_amplification_t *result);
+void oncefs_dumps_amplification(oncefs_t *ofs, char *buffer);
+#define oncefs_dump_amplification(ofs) oncefs_dumps_amplification(ofs, NULL)
+
 void oncefs_dumps(oncefs_t *ofs, char *buffer);
 #define oncefs_dump(ofs) oncefs_dumps(ofs, NULL)
 
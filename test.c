@@ -5,8 +5,14 @@
 
 #include <errno.h>
 #include <fuse.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "lib/io.h"
+#include "lib/io_backend.h"
 #include "oncefs.h"
 
 /**
@@ -51,13 +57,31 @@ void xxd(uint8_t *buffer, size_t size) {
     }
 }
 
-int _do_test_io(char *path) {
+int _make_container(const char *path, size_t size) {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) { return -errno; }
+
+    char zero[1024] = {0};
+    for (size_t i = 0; i < size; i += sizeof(zero)) {
+        size_t amount = (size - i < sizeof(zero)) ? size - i : sizeof(zero);
+        if (fwrite(zero, 1, amount, fp) != amount) {
+            fclose(fp);
+            return -EIO;
+        }
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+int _do_test_io(char *path, int backend) {
     int r;
 
     io_config_t config = {
         .path = path,
         .block_size = 16,
-        .max_num_blocks = 10
+        .max_num_blocks = 10,
+        .backend = backend
     };
 
     io_t io;
@@ -99,377 +123,557 @@ int _do_test_io(char *path) {
     return 0;
 }
 
-int _test_io_file() {
-    return _do_test_io("test.mfs");
-}
+typedef struct {
+    ring_t *ring;
+    size_t producer;
+} _test_ring_t;
 
-int _test_io_memory() {
-    return _do_test_io(":memory:");
+void *_do_test_ring(void *raw) {
+    _test_ring_t *state = (_test_ring_t *) raw;
+
+    for (size_t i = 0; i < 1000; i++) {
+        size_t entry = state->producer * 1000 + i;
+        while (ring_push(state->ring, &entry) != 0) { sched_yield(); }
+    }
+
+    return NULL;
 }
 
-int _test_oncefs_init() {
+int _test_ring() {
     int r;
 
-    io_config_t config = {
-        .path = ":memory:",
-        .block_size = 512,
-        .max_num_blocks = 10
-    };
+    ring_t ring;
+    r = ring_init(&ring, 3, sizeof(size_t));
+    if (r != -EINVAL) { return -400; }
+    r = ring_init(&ring, 4, sizeof(size_t));
+    if (r != 0) { return r; }
 
-    io_t io;
-    io_init(&io, &config);
+    size_t entry = 0;
+    for (size_t i = 0; i < 4; i++) {
+        r = ring_push(&ring, &i);
+        if (r != 0) { return r; }
+    }
+    r = ring_push(&ring, &entry);
+    if (r != -EAGAIN) { return -400; }
 
-    oncefs_t ofs;
-    r = oncefs_init(&ofs, &io, 1);
+    for (size_t i = 0; i < 4; i++) {
+        r = ring_pop(&ring, &entry);
+        if (r != 0) { return r; }
+        if (entry != i) { return -400; }
+    }
+    r = ring_pop(&ring, &entry);
+    if (r != -EAGAIN) { return -400; }
+
+    ring_free(&ring);
+
+    // Many producers, each seen in its own order
+    r = ring_init(&ring, 64, sizeof(size_t));
     if (r != 0) { return r; }
 
+    _test_ring_t states[4];
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+        states[i] = (_test_ring_t) {.ring = &ring, .producer = i};
+        pthread_create(&threads[i], NULL, _do_test_ring, &states[i]);
+    }
+
+    size_t next[4] = {0};
+    for (size_t count = 0; count < 4000;) {
+        if (ring_pop(&ring, &entry) != 0) { continue; }
+
+        size_t producer = entry / 1000;
+        if (producer >= 4 || entry % 1000 != next[producer]) { return -400; }
+        next[producer]++;
+        count++;
+    }
+
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    ring_free(&ring);
+
     return 0;
 }
 
-int _test_oncefs_format() {
+int _test_io_file() {
+    return _do_test_io("test.mfs", IO_BACKEND_DEFAULT);
+}
+
+int _test_io_memory() {
+    return _do_test_io(":memory:", IO_BACKEND_DEFAULT);
+}
+
+int _test_io_mmap() {
     int r;
 
+    const char *path = "/tmp/oncefs-test-mmap.ofs";
+    r = _make_container(path, 16 * 10);
+    if (r != 0) { return r; }
+
+    r = _do_test_io((char *) path, IO_BACKEND_MMAP);
+    if (r != 0) { return r; }
+
+    // Data should be visible through the mapping and persist after closing
     io_config_t config = {
-        .path = ":memory:",
-        .block_size = 64,
-        .max_num_blocks = 10
+        .path = (char *) path,
+        .block_size = 16,
+        .backend = IO_BACKEND_MMAP
     };
 
     io_t io;
-    io_init(&io, &config);
-
-    if (((char *) io.buffer)[64] != 0) { return -400; }
-
-    oncefs_t ofs;
-    r = oncefs_init(&ofs, &io, 1);
+    r = io_init(&io, &config);
     if (r != 0) { return r; }
 
-    if (((char *) io.buffer)[64] == 0) { return -400; }
-
-    return 0;
-}
+    const void *data;
+    r = io_peek(&io, 1, 0, &data);
+    if (r != 0) { return r; }
+    if (memcmp(data, "Two", 3) != 0) { return -400; }
 
-int _test_oncefs_set_file() {
-    int r;
+    r = io_write(&io, 2, "Four", 4);
+    if (r != 0) { return r; }
 
-    oncefs_t ofs;
-    r = oncefs_init_default(&ofs);
+    r = io_sync(&io);
     if (r != 0) { return r; }
 
-    r = oncefs_set_file(&ofs, "/foo");
+    io_close(&io);
+
+    config.backend = IO_BACKEND_FILE;
+    r = io_init(&io, &config);
     if (r != 0) { return r; }
 
-    r = oncefs_set_file(&ofs, "/bar");
+    char buffer[5] = {0};
+    r = io_read(&io, 2, buffer, 4);
     if (r != 0) { return r; }
+    if (strcmp(buffer, "Four") != 0) { return -400; }
 
-    // Cannot set over existing
-    r = oncefs_set_file(&ofs, "/foo");
-    if (r == 0) { return r; }
+    // Only mapped backends support peeking
+    r = io_peek(&io, 1, 0, &data);
+    if (r != -ENOTSUP) { return -400; }
 
-    // oncefs_dump(&ofs);
+    // Descriptor based backends can be read around the block layer
+    int fh;
+    off_t position;
+    r = io_locate(&io, 2, 0, &fh, &position);
+    if (r != 0) { return r; }
+    memset(buffer, 0, sizeof(buffer));
+    if (pread(fh, buffer, 4, position) != 4) { return -400; }
+    if (strcmp(buffer, "Four") != 0) { return -400; }
 
-    oncefs_free(&ofs);
+    io_close(&io);
+    remove(path);
 
     return 0;
 }
 
-int _test_oncefs_set_dir() {
+int _do_test_io_queue(char *path, int backend) {
     int r;
 
-    oncefs_t ofs;
-    r = oncefs_init_default(&ofs);
-    if (r != 0) { return r; }
+    io_config_t config = {
+        .path = path,
+        .block_size = 16,
+        .max_num_blocks = 300,
+        .backend = backend
+    };
 
-    r = oncefs_set_dir(&ofs, "/foo");
+    io_t io;
+    r = io_init(&io, &config);
     if (r != 0) { return r; }
 
-    r = oncefs_set_dir(&ofs, "/bar");
-    if (r != 0) { return r; }
+    // More operations than fit in one submission
+    uint32_t values[300];
+    for (uint32_t i = 0; i < 300; i++) {
+        values[i] = i * 7;
+        r = io_queue_write2(&io, i, "tag", 3, &values[i], sizeof(values[i]));
+        if (r != 0) { return r; }
+    }
 
-    r = oncefs_set_file(&ofs, "/baz");
+    r = io_submit(&io);
     if (r != 0) { return r; }
 
-    r = oncefs_set_dir(&ofs, "/foo/bar");
-    if (r != 0) { return r; }
+    // Skip the tag when reading back
+    uint32_t actual[300];
+    for (uint32_t i = 0; i < 300; i++) {
+        r = io_queue_read2(&io, i, NULL, 3, &actual[i], sizeof(actual[i]));
+        if (r != 0) { return r; }
+    }
 
-    // Correctly select the right "bar"
-    r = oncefs_set_file(&ofs, "/foo/bar/baz");
+    r = io_submit(&io);
     if (r != 0) { return r; }
 
-    // Cannot set since parent is not a directory
-    r = oncefs_set_file(&ofs, "/baz/bar");
-    if (r == 0) { return r; }
-
-    // Cannot set since parent doesn't exist
-    r = oncefs_set_file(&ofs, "/foo/bork/baz");
-    if (r == 0) { return r; }
-
-    // Cannot set over existing
-    r = oncefs_set_dir(&ofs, "/foo");
-    if (r == 0) { return r; }
+    for (uint32_t i = 0; i < 300; i++) {
+        if (actual[i] != i * 7) { return -400; }
+    }
 
-    // oncefs_dump(&ofs);
+    // Synchronous calls still work
+    char buffer[4] = {0};
+    r = io_read(&io, 5, buffer, 3);
+    if (r != 0) { return r; }
+    if (strcmp(buffer, "tag") != 0) { return -400; }
 
-    oncefs_free(&ofs);
+    io_close(&io);
 
     return 0;
 }
 
-int _test_oncefs_set_link() {
+int _test_io_queue_memory() {
+    return _do_test_io_queue(":memory:", IO_BACKEND_DEFAULT);
+}
+
+int _test_io_queue_uring() {
     int r;
 
-    oncefs_t ofs;
-    r = oncefs_init_default(&ofs);
+    const char *path = "/tmp/oncefs-test-uring.ofs";
+    r = _make_container(path, 16 * 300);
     if (r != 0) { return r; }
 
-    r = oncefs_set_link(&ofs, "/foo", "../bar");
+    r = _do_test_io((char *) path, IO_BACKEND_URING);
     if (r != 0) { return r; }
 
-    // oncefs_dump(&ofs);
+    r = _do_test_io_queue((char *) path, IO_BACKEND_URING);
+    if (r != 0) { return r; }
 
-    oncefs_free(&ofs);
+    remove(path);
 
     return 0;
 }
 
-int _test_oncefs_set_data() {
+int _test_io_file_vectored() {
     int r;
 
-    oncefs_t ofs;
-    r = oncefs_init_default(&ofs);
+    const char *path = "/tmp/oncefs-test-file.ofs";
+    r = _make_container(path, 16 * 300);
     if (r != 0) { return r; }
 
-    r = oncefs_set_data(&ofs, 1, "Hello world!", 12, 0);
+    r = _do_test_io((char *) path, IO_BACKEND_FILE);
     if (r != 0) { return r; }
 
-    r = oncefs_set_data(&ofs, 1, "Testing", 7, 0);
+    r = _do_test_io_queue((char *) path, IO_BACKEND_FILE);
     if (r != 0) { return r; }
 
-    // oncefs_dump(&ofs);
+    io_config_t config = {
+        .path = (char *) path,
+        .block_size = 16,
+        .backend = IO_BACKEND_FILE
+    };
 
-    oncefs_free(&ofs);
+    io_t io;
+    r = io_init(&io, &config);
+    if (r != 0) { return r; }
+
+    // A short read must not be silently ignored
+    r = truncate(path, 16 * 10 + 4);
+    if (r != 0) { return -errno; }
+
+    char buffer[16];
+    r = io_read(&io, 10, buffer, 8);
+    if (r != -EIO) { return -400; }
+
+    // Reads within the file are unaffected
+    r = io_read(&io, 9, buffer, 16);
+    if (r != 0) { return r; }
+
+    io_close(&io);
+    remove(path);
 
     return 0;
 }
 
-int _test_oncefs_set_time() {
+int _do_test_io_blocks(char *path, int backend) {
     int r;
 
-    oncefs_t ofs;
-    r = oncefs_init_default(&ofs);
-    if (r != 0) { return r; }
+    io_config_t config = {
+        .path = path,
+        .block_size = 16,
+        .max_num_blocks = 300,
+        .backend = backend
+    };
 
-    r = oncefs_set_file(&ofs, "/foo");
+    io_t io;
+    r = io_init(&io, &config);
     if (r != 0) { return r; }
 
-    r = oncefs_set_file(&ofs, "/bar");
-    if (r != 0) { return r; }
+    // Full neighbouring blocks, with one out of order block in the middle
+    char payload[60][12];
+    io_blockv_t blocks[60];
+    for (int i = 0; i < 60; i++) {
+        memset(payload[i], 'a' + i % 26, sizeof(payload[i]));
+        size_t block = (i == 30) ? 200 : 10 + i;
+        blocks[i] = (io_blockv_t) {
+            .block = block, .data = {"head", payload[i]}, .size = {4, 12}};
+    }
 
-    r = oncefs_set_time(&ofs, "/foo", 100, 200);
+    r = io_writev_blocks(&io, blocks, 60);
     if (r != 0) { return r; }
 
-    // oncefs_dump(&ofs);
+    // Read back only the payloads; the headers in between are skipped
+    char actual[60][12];
+    for (int i = 0; i < 60; i++) {
+        blocks[i].data[0] = NULL;
+        blocks[i].data[1] = actual[i];
+    }
 
-    oncefs_stat_t stat;
-    r = oncefs_get_node(&ofs, "/foo", &stat);
+    r = io_readv_blocks(&io, blocks, 60);
     if (r != 0) { return r; }
-    if(stat.last_access != 100 || stat.last_modification != 200) { return -ECANCELED; }
 
-    r = oncefs_get_node(&ofs, "/bar", &stat);
+    if (memcmp(actual, payload, sizeof(payload)) != 0) { return -400; }
+
+    char header[5] = {0};
+    r = io_read(&io, 200, header, 4);
     if (r != 0) { return r; }
-    if(stat.last_access <= 0 || stat.last_modification <= 0) { return -ECANCELED; }
+    if (strcmp(header, "head") != 0) { return -400; }
 
-    oncefs_free(&ofs);
+    io_close(&io);
 
     return 0;
 }
 
-
-int _test_oncefs_get_status() {
+int _test_io_blocks() {
     int r;
 
-    oncefs_t ofs;
-    r = oncefs_init_default(&ofs);
+    const char *path = "/tmp/oncefs-test-blocks.ofs";
+    r = _make_container(path, 16 * 300);
     if (r != 0) { return r; }
 
-    r = oncefs_set_file(&ofs, "/foo");
+    r = _do_test_io_blocks((char *) path, IO_BACKEND_FILE);
     if (r != 0) { return r; }
 
-    r = oncefs_set_dir(&ofs, "/bar");
+    r = _do_test_io_blocks((char *) path, IO_BACKEND_URING);
     if (r != 0) { return r; }
 
-    r = oncefs_set_link(&ofs, "/baz", "foo");
+    r = _do_test_io_blocks(":memory:", IO_BACKEND_DEFAULT);
     if (r != 0) { return r; }
 
-    r = oncefs_del_node(&ofs, "/foo");
+    remove(path);
+
+    return 0;
+}
+
+int _test_io_split() {
+    int r;
+
+    const char *path = "/tmp/oncefs-test-split.ofs";
+    r = _make_container(path, 4096 + 16 * 100);
     if (r != 0) { return r; }
 
-    oncefs_status_t status;
-    r = oncefs_get_status(&ofs, &status);
+    io_config_t config = {
+        .path = (char *) path,
+        .block_size = 24,
+        .header_size = 8
+    };
+
+    io_t io;
+    r = io_init(&io, &config);
     if (r != 0) { return r; }
 
-    if (status.block_size != 64) { return -400; }
+    // The header table is padded to the alignment
+    if (io_block_last(&io) != 99) { return -400; }
 
-    if (status.total_blocks != -2) { // max value
-        return -400;
-    }
+    // A record crossing from the header into the payload
+    r = io_write2(&io, 5, "abcdef", 6, "ghijklmnop", 10);
+    if (r != 0) { return r; }
 
-    int expected_blocks_used = 5;
-    int expected_blocks_freed = 2;
+    char actual[17] = {0};
+    r = io_read(&io, 5, actual, 16);
+    if (r != 0) { return r; }
+    if (strcmp(actual, "abcdefghijklmnop") != 0) { return -400; }
 
-    if (status.free_blocks != -2 - expected_blocks_used + expected_blocks_freed) {
-        printf("%lu\n", status.free_blocks);
-        return -400;
-    }
+    io_close(&io);
 
-    if (status.name_max_size != ONCEFS_NAME_MAX_SIZE) { return -400; }
+    // Headers are stored together, payloads after the padded header table
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) { return -400; }
 
-    oncefs_free(&ofs);
+    char header[9] = {0};
+    fseek(fp, 5 * 8, SEEK_SET);
+    if (fread(header, 1, 8, fp) != 8) { return -400; }
+
+    char payload[9] = {0};
+    fseek(fp, 4096 + 5 * 16, SEEK_SET);
+    if (fread(payload, 1, 8, fp) != 8) { return -400; }
+    fclose(fp);
+
+    if (strcmp(header, "abcdefgh") != 0) { return -400; }
+    if (strcmp(payload, "ijklmnop") != 0) { return -400; }
+
+    remove(path);
 
     return 0;
 }
 
-int _test_oncefs_get_node() {
+int _test_io_sim() {
     int r;
 
-    oncefs_t ofs;
-    r = oncefs_init_default(&ofs);
-    if (r != 0) { return r; }
-
-    r = oncefs_set_file(&ofs, "/foo");
-    if (r != 0) { return r; }
+    io_config_t config = {
+        .path = ":memory:",
+        .block_size = 512,
+        .max_num_blocks = 10,
+        .backend = IO_BACKEND_SIM,
+        .sim = {.write_latency = 20000, .bandwidth = 512 * 100}
+    };
 
-    r = oncefs_set_dir(&ofs, "/bar");
+    io_t io;
+    r = io_init(&io, &config);
     if (r != 0) { return r; }
 
-    r = oncefs_set_link(&ofs, "/baz", "foo");
-    if (r != 0) { return r; }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    oncefs_stat_t stat;
-    r = oncefs_get_node(&ofs, "/foo", &stat);
+    // One operation's latency plus 10 ms of transfer
+    char data[512];
+    memset(data, 'a', sizeof(data));
+    r = io_write(&io, 1, data, sizeof(data));
     if (r != 0) { return r; }
 
-    if (!stat.is_file) { return -400; }
-    if (stat.node != 1) { return -400; }
-    if (stat.size != 0) { return -400; }
-
-    r = oncefs_get_node(&ofs, "/bar", &stat);
-    if (r != 0) { return r; }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long elapsed = (end.tv_sec - start.tv_sec) * 1000000 +
+        (end.tv_nsec - start.tv_nsec) / 1000;
+    if (elapsed < 30000) { return -400; }
 
-    r = oncefs_get_node(&ofs, "/baz", &stat);
+    char actual[512];
+    r = io_read(&io, 1, actual, sizeof(actual));
     if (r != 0) { return r; }
+    if (memcmp(actual, data, sizeof(data)) != 0) { return -400; }
 
-    oncefs_free(&ofs);
+    io_close(&io);
 
     return 0;
 }
 
-int _test_oncefs_get_node_size() {
+int _test_io_stats() {
     int r;
 
-    oncefs_t ofs;
-    r = oncefs_init_default(&ofs);
-    if (r != 0) { return r; }
+    io_config_t config = {
+        .path = ":memory:",
+        .block_size = 512,
+        .max_num_blocks = 10,
+        .backend = IO_BACKEND_SIM,
+        .sim = {.write_latency = 5000, .sync_latency = 20000}
+    };
 
-    r = oncefs_set_file(&ofs, "/foo");
+    io_t io;
+    r = io_init(&io, &config);
     if (r != 0) { return r; }
 
-    oncefs_stat_t stat;
-    r = oncefs_get_node(&ofs, "/foo", &stat);
+    char data[512] = {0};
+    r = io_write(&io, 1, data, sizeof(data));
     if (r != 0) { return r; }
-
-    r = oncefs_set_data(&ofs, 1, "Hello", 5, 0);
+    r = io_read(&io, 1, data, 100);
     if (r != 0) { return r; }
-
-    r = oncefs_set_data(&ofs, 1, " world", 6, 5);
+    r = io_sync(&io);
     if (r != 0) { return r; }
 
-    r = oncefs_set_data(&ofs, 1, "!", 1, 11);
-    if (r != 0) { return r; }
+    io_stats_t stats;
+    io_get_stats(&io, &stats);
+    if (stats.writes != 1 || stats.bytes_written != 512) { return -400; }
+    if (stats.reads != 1 || stats.bytes_read != 100) { return -400; }
+    if (stats.syncs != 1) { return -400; }
 
-    // oncefs_dump(&ofs);
+    // Simulated latencies land in their buckets
+    if (io_histogram_percentile(stats.write_latency, 1) < 5000) { return -400; }
+    if (io_histogram_percentile(stats.sync_latency, 0.5) < 20000) { return -400; }
+    if (io_histogram_percentile(stats.read_latency, 1) > 4096) { return -400; }
 
-    r = oncefs_get_node(&ofs, "/foo", &stat);
-    if (r != 0) { return r; }
-    if (stat.size != 12) { return -400; }
+    io_reset_stats(&io);
+    io_get_stats(&io, &stats);
+    if (stats.writes != 0 || stats.syncs != 0) { return -400; }
+    if (io_histogram_percentile(stats.write_latency, 1) != 0) { return -400; }
 
-    oncefs_free(&ofs);
+    io_close(&io);
 
     return 0;
 }
 
+void *_do_test_io_sync_group(void *raw) {
+    io_t *io = (io_t *) raw;
 
-int _test_oncefs_get_dir() {
+    char data[512] = {0};
+    io_write(io, 1, data, sizeof(data));
+    io_sync(io);
+
+    return NULL;
+}
+
+int _test_io_sync_group() {
     int r;
 
-    oncefs_t ofs;
-    r = oncefs_init_default(&ofs);
-    if (r != 0) { return r; }
-
-    r = oncefs_set_file(&ofs, "/foo");
-    if (r != 0) { return r; }
-
-    r = oncefs_set_dir(&ofs, "/bar");
-    if (r != 0) { return r; }
-
-    r = oncefs_set_file(&ofs, "/bar/bork");
-    if (r != 0) { return r; }
+    io_config_t config = {
+        .path = ":memory:",
+        .block_size = 512,
+        .max_num_blocks = 10,
+        .backend = IO_BACKEND_SIM,
+        .sim = {.sync_latency = 20000},
+        .sync_window = 1000
+    };
 
-    r = oncefs_set_link(&ofs, "/baz", "foo");
+    io_t io;
+    r = io_init(&io, &config);
     if (r != 0) { return r; }
 
-
-    char actual[2048];
-    int cursor = 0;
-    int _aggregator(oncefs_node_t * node) {
-        cursor += sprintf(&actual[cursor], "%s\n", node->name);
-        return 0;
+    pthread_t threads[8];
+    for (int i = 0; i < 8; i++) {
+        pthread_create(&threads[i], NULL, _do_test_io_sync_group, &io);
     }
-
-    r = oncefs_get_dir(&ofs, "/", _aggregator);
-    if (r != 0) { return r; }
-
-    char *expected = "bar\nbaz\nfoo\n";
-    if (strcmp(expected, actual) != 0) {
-        // printf(">%s<\n", actual);
-        return -400;
+    for (int i = 0; i < 8; i++) {
+        pthread_join(threads[i], NULL);
     }
 
-    oncefs_free(&ofs);
+    // Callers queued behind a flush share the next one
+    io_stats_t stats;
+    io_get_stats(&io, &stats);
+    if (stats.sync_requests != 8) { return -400; }
+    if (stats.syncs >= 8) { return -400; }
+
+    io_close(&io);
 
     return 0;
 }
 
-int _test_oncefs_get_link() {
+int _test_oncefs_init() {
     int r;
 
+    io_config_t config = {
+        .path = ":memory:",
+        .block_size = 512,
+        .max_num_blocks = 10
+    };
+
+    io_t io;
+    io_init(&io, &config);
+
     oncefs_t ofs;
-    r = oncefs_init_default(&ofs);
+    r = oncefs_init(&ofs, &io, 1);
     if (r != 0) { return r; }
 
-    r = oncefs_set_file(&ofs, "/foo");
-    if (r != 0) { return r; }
+    return 0;
+}
 
-    r = oncefs_set_dir(&ofs, "/bar");
-    if (r != 0) { return r; }
+int _test_oncefs_format() {
+    int r;
 
-    r = oncefs_set_link(&ofs, "/baz", "../foo");
-    if (r != 0) { return r; }
+    io_config_t config = {
+        .path = ":memory:",
+        .block_size = 64,
+        .max_num_blocks = 10
+    };
 
-    // oncefs_dump(&ofs);
+    io_t io;
+    io_init(&io, &config);
 
-    oncefs_node_t result;
-    r = oncefs_get_link(&ofs, "/baz", &result);
-    if (r != 0) { return r; }
+    if (((char *) io.buffer)[0] != 0) { return -400; }
 
-    if (strcmp(result.name, "../foo") != 0) { return -400; }
+    oncefs_t ofs;
+    r = oncefs_init(&ofs, &io, 1);
+    if (r != 0) { return r; }
 
-    oncefs_free(&ofs);
+    // Only the superblock is written
+    if (((char *) io.buffer)[0] == 0) { return -400; }
+    if (((char *) io.buffer)[64] != 0) { return -400; }
 
     return 0;
 }
 
-int _test_oncefs_del_file() {
+int _test_oncefs_set_file() {
     int r;
 
     oncefs_t ofs;
@@ -479,26 +683,21 @@ int _test_oncefs_del_file() {
     r = oncefs_set_file(&ofs, "/foo");
     if (r != 0) { return r; }
 
-    r = oncefs_set_data(&ofs, 1, "Hello world!", 12, 0);
+    r = oncefs_set_file(&ofs, "/bar");
     if (r != 0) { return r; }
 
+    // Cannot set over existing
     r = oncefs_set_file(&ofs, "/foo");
     if (r == 0) { return r; }
 
-    r = oncefs_del_node(&ofs, "/foo");
-    if (r != 0) { return r; }
-
     // oncefs_dump(&ofs);
 
-    r = oncefs_set_file(&ofs, "/foo");
-    if (r != 0) { return r; }
-
     oncefs_free(&ofs);
 
     return 0;
 }
 
-int _test_oncefs_del_dir() {
+int _test_oncefs_set_dir() {
     int r;
 
     oncefs_t ofs;
@@ -508,22 +707,46 @@ int _test_oncefs_del_dir() {
     r = oncefs_set_dir(&ofs, "/foo");
     if (r != 0) { return r; }
 
-    r = oncefs_set_file(&ofs, "/foo/bar");
+    r = oncefs_set_dir(&ofs, "/bar");
     if (r != 0) { return r; }
 
-    r = oncefs_set_dir(&ofs, "/baz");
+    r = oncefs_set_file(&ofs, "/baz");
     if (r != 0) { return r; }
 
-    r = oncefs_del_node(&ofs, "/foo");
-    if (r == 0) { return -400; }
+    r = oncefs_set_dir(&ofs, "/foo/bar");
+    if (r != 0) { return r; }
 
-    r = oncefs_del_node(&ofs, "/foo/bar");
+    // Correctly select the right "bar"
+    r = oncefs_set_file(&ofs, "/foo/bar/baz");
     if (r != 0) { return r; }
 
-    r = oncefs_del_node(&ofs, "/foo");
+    // Cannot set since parent is not a directory
+    r = oncefs_set_file(&ofs, "/baz/bar");
+    if (r == 0) { return r; }
+
+    // Cannot set since parent doesn't exist
+    r = oncefs_set_file(&ofs, "/foo/bork/baz");
+    if (r == 0) { return r; }
+
+    // Cannot set over existing
+    r = oncefs_set_dir(&ofs, "/foo");
+    if (r == 0) { return r; }
+
+    // oncefs_dump(&ofs);
+
+    oncefs_free(&ofs);
+
+    return 0;
+}
+
+int _test_oncefs_set_link() {
+    int r;
+
+    oncefs_t ofs;
+    r = oncefs_init_default(&ofs);
     if (r != 0) { return r; }
 
-    r = oncefs_set_file(&ofs, "/foo");
+    r = oncefs_set_link(&ofs, "/foo", "../bar");
     if (r != 0) { return r; }
 
     // oncefs_dump(&ofs);
@@ -533,30 +756,27 @@ int _test_oncefs_del_dir() {
     return 0;
 }
 
-int _test_oncefs_del_link() {
+int _test_oncefs_set_data() {
     int r;
 
     oncefs_t ofs;
     r = oncefs_init_default(&ofs);
     if (r != 0) { return r; }
 
-    r = oncefs_set_link(&ofs, "/foo", "link");
+    r = oncefs_set_data(&ofs, 1, "Hello world!", 12, 0);
     if (r != 0) { return r; }
 
-    r = oncefs_del_node(&ofs, "link"); // doesn't exist
-    if (r == 0) { return r; }
-
-    r = oncefs_del_node(&ofs, "/foo");
+    r = oncefs_set_data(&ofs, 1, "Testing", 7, 0);
     if (r != 0) { return r; }
 
-    // oncefs_dump(&ofs); // both link and payload should be freed
+    // oncefs_dump(&ofs);
 
     oncefs_free(&ofs);
 
     return 0;
 }
 
-int _test_oncefs_del_node_full() {
+int _test_oncefs_set_time() {
     int r;
 
     oncefs_t ofs;
@@ -569,22 +789,19 @@ int _test_oncefs_del_node_full() {
     r = oncefs_set_file(&ofs, "/bar");
     if (r != 0) { return r; }
 
-    // Artificially pretend all blocks are taken
-    ofs.next_block_id = ofs.last_block_id + 1;
+    r = oncefs_set_time(&ofs, "/foo", 100, 200);
+    if (r != 0) { return r; }
 
-    // Create should fail
-    r = oncefs_set_file(&ofs, "/baz");
-    if (r == 0) { return -ECANCELED; }
+    // oncefs_dump(&ofs);
 
-    // Delete existing should still go through
-    r = oncefs_del_node(&ofs, "/foo");
+    oncefs_stat_t stat;
+    r = oncefs_get_node(&ofs, "/foo", &stat);
     if (r != 0) { return r; }
+    if(stat.last_access != 100 || stat.last_modification != 200) { return -ECANCELED; }
 
-    // Create after delete should succeed
-    r = oncefs_set_file(&ofs, "/baz");
-    if (r == 0) { return -ECANCELED; }
-
-    // oncefs_dump(&ofs);
+    r = oncefs_get_node(&ofs, "/bar", &stat);
+    if (r != 0) { return r; }
+    if(stat.last_access <= 0 || stat.last_modification <= 0) { return -ECANCELED; }
 
     oncefs_free(&ofs);
 
@@ -592,134 +809,1412 @@ int _test_oncefs_del_node_full() {
 }
 
 
-int _test_oncefs_del_data() {
+int _test_oncefs_get_status() {
     int r;
 
     oncefs_t ofs;
     r = oncefs_init_default(&ofs);
     if (r != 0) { return r; }
 
-    // Setup
     r = oncefs_set_file(&ofs, "/foo");
     if (r != 0) { return r; }
 
-    r = oncefs_set_data(&ofs, 1, "abcdefgh", 8, 0);
+    r = oncefs_set_dir(&ofs, "/bar");
     if (r != 0) { return r; }
 
-    r = oncefs_set_data(&ofs, 1, "ijklmnop", 8, 8);
+    r = oncefs_set_link(&ofs, "/baz", "foo");
     if (r != 0) { return r; }
 
-    r = oncefs_set_data(&ofs, 1, "qrstuvwx", 8, 16);
+    r = oncefs_del_node(&ofs, "/foo");
     if (r != 0) { return r; }
 
-    r = oncefs_set_data(&ofs, 1, "yz", 2, 24);
+    oncefs_status_t status;
+    r = oncefs_get_status(&ofs, &status);
     if (r != 0) { return r; }
 
-    // Truncate
-    r = oncefs_del_data(&ofs, 1, 18);
-    if (r != 0) { return r; }
+    if (status.block_size != 64) { return -400; }
 
-    // oncefs_dump(&ofs);
+    if (status.total_blocks != -2) { // max value
+        return -400;
+    }
 
-    // Truncate again
-    r = oncefs_del_data(&ofs, 1, 15);
-    if (r != 0) { return r; }
+    int expected_blocks_used = 5;
+    int expected_blocks_freed = 2;
 
-    // oncefs_dump(&ofs);
+    if (status.free_blocks != -2 - expected_blocks_used + expected_blocks_freed) {
+        printf("%lu\n", status.free_blocks);
+        return -400;
+    }
+
+    if (status.name_max_size != ONCEFS_NAME_MAX_SIZE) { return -400; }
 
     oncefs_free(&ofs);
 
     return 0;
 }
 
-int _test_oncefs_del_data_rare() {
-    // Test with specially crafted payloads to cause bug when wrong index is used for
-    // lookup in table
+int _test_oncefs_get_node() {
     int r;
 
     oncefs_t ofs;
     r = oncefs_init_default(&ofs);
     if (r != 0) { return r; }
 
-    // Setup
     r = oncefs_set_file(&ofs, "/foo");
     if (r != 0) { return r; }
 
-    r = oncefs_set_data(&ofs, 1, "Hello world!", 12, 0);
+    r = oncefs_set_dir(&ofs, "/bar");
     if (r != 0) { return r; }
 
-    r = oncefs_set_file(&ofs, "/bar");
+    r = oncefs_set_link(&ofs, "/baz", "foo");
     if (r != 0) { return r; }
 
-    r = oncefs_set_data(&ofs, 2, "bork bork bork!", 16, 0);
+    oncefs_stat_t stat;
+    r = oncefs_get_node(&ofs, "/foo", &stat);
     if (r != 0) { return r; }
 
-    // Truncate
-    r = oncefs_del_data(&ofs, 1, 0);
+    if (!stat.is_file) { return -400; }
+    if (stat.node != 1) { return -400; }
+    if (stat.size != 0) { return -400; }
+
+    r = oncefs_get_node(&ofs, "/bar", &stat);
     if (r != 0) { return r; }
 
-    // oncefs_dump(&ofs);
+    r = oncefs_get_node(&ofs, "/baz", &stat);
+    if (r != 0) { return r; }
 
     oncefs_free(&ofs);
 
     return 0;
 }
 
-int _test_oncefs_move_file() {
+int _test_oncefs_get_node_size() {
     int r;
 
     oncefs_t ofs;
     r = oncefs_init_default(&ofs);
     if (r != 0) { return r; }
 
-    // Setup
     r = oncefs_set_file(&ofs, "/foo");
     if (r != 0) { return r; }
-    r = oncefs_set_file(&ofs, "/bar");
-    if (r != 0) { return r; }
-    r = oncefs_set_dir(&ofs, "/dir1");
+
+    oncefs_stat_t stat;
+    r = oncefs_get_node(&ofs, "/foo", &stat);
     if (r != 0) { return r; }
-    r = oncefs_set_dir(&ofs, "/dir2");
+
+    r = oncefs_set_data(&ofs, 1, "Hello", 5, 0);
     if (r != 0) { return r; }
 
-    // Move
-    r = oncefs_move_node(&ofs, "/foo", "/baz");
+    r = oncefs_set_data(&ofs, 1, " world", 6, 5);
     if (r != 0) { return r; }
 
-    // Move into directory
-    r = oncefs_move_node(&ofs, "/baz", "/dir1/foo");
+    r = oncefs_set_data(&ofs, 1, "!", 1, 11);
     if (r != 0) { return r; }
 
-    // Move into directory shortcut not supported
-    r = oncefs_move_node(&ofs, "/dir1/foo", "/dir2");
-    if (r == 0) { return r; }
+    // oncefs_dump(&ofs);
 
-    // Move overwriting existing
-    r = oncefs_move_node(&ofs, "/dir1/foo", "/bar");
+    r = oncefs_get_node(&ofs, "/foo", &stat);
     if (r != 0) { return r; }
-
-    // Can't move non-existing
-    r = oncefs_move_node(&ofs, "/foo", "/baz");
-    if (r == 0) { return r; }
+    if (stat.size != 12) { return -400; }
 
     oncefs_free(&ofs);
 
     return 0;
 }
 
-int _test_oncefs_load_state() {
-    int r;
 
-    // Initialize
-    io_t io;
-    r = io_init(&io, &io_config);
-    if (r != 0) { return r; }
+int _test_oncefs_get_dir() {
+    int r;
 
     oncefs_t ofs;
-    r = oncefs_init(&ofs, &io, 1); // format
+    r = oncefs_init_default(&ofs);
     if (r != 0) { return r; }
 
-    // Set up
+    r = oncefs_set_file(&ofs, "/foo");
+    if (r != 0) { return r; }
+
+    r = oncefs_set_dir(&ofs, "/bar");
+    if (r != 0) { return r; }
+
+    r = oncefs_set_file(&ofs, "/bar/bork");
+    if (r != 0) { return r; }
+
+    r = oncefs_set_link(&ofs, "/baz", "foo");
+    if (r != 0) { return r; }
+
+
+    char actual[2048];
+    int cursor = 0;
+    int _aggregator(oncefs_node_t * node) {
+        cursor += sprintf(&actual[cursor], "%s\n", node->name);
+        return 0;
+    }
+
+    r = oncefs_get_dir(&ofs, "/", _aggregator);
+    if (r != 0) { return r; }
+
+    char *expected = "bar\nbaz\nfoo\n";
+    if (strcmp(expected, actual) != 0) {
+        // printf(">%s<\n", actual);
+        return -400;
+    }
+
+    oncefs_free(&ofs);
+
+    return 0;
+}
+
+int _test_oncefs_get_dir_after() {
+    int r;
+
+    oncefs_t ofs;
+    r = oncefs_init_default(&ofs);
+    if (r != 0) { return r; }
+
+    r = oncefs_set_dir(&ofs, "/dir");
+    if (r != 0) { return r; }
+
+    oncefs_stat_t dir;
+    r = oncefs_get_node(&ofs, "/dir", &dir);
+    if (r != 0) { return r; }
+
+    char path[32];
+    for (int i = 0; i < 50; i++) {
+        sprintf(path, "/dir/file%02i", i);
+        r = oncefs_set_file(&ofs, path);
+        if (r != 0) { return r; }
+    }
+
+    oncefs_stat_t file;
+    r = oncefs_get_node(&ofs, "/dir/file07", &file);
+    if (r != 0) { return r; }
+    r = oncefs_set_data(&ofs, file.node, "Hello", 5, 0);
+    if (r != 0) { return r; }
+
+    // Read in batches, each continuing after the last name seen
+    char last[ONCEFS_NAME_MAX_SIZE + 1] = "";
+    int count = 0;
+    int batch;
+    int _callback(oncefs_node_t *entry, oncefs_stat_t *stat) {
+        if (batch == 7) { return 1; }
+
+        char expected[32];
+        sprintf(expected, "file%02i", count);
+        if (strcmp(entry->name, expected) != 0) { return 1; }
+        if (stat == NULL || stat->node != entry->node) { return 1; }
+        if (stat->size != ((count == 7) ? 5 : 0)) { return 1; }
+
+        strcpy(last, entry->name);
+        batch++;
+        count++;
+        return 0;
+    }
+
+    do {
+        batch = 0;
+        r = oncefs_get_dir_after(&ofs, dir.node, (count > 0) ? last : NULL, 1,
+                                 _callback);
+        if (r != 0) { return r; }
+
+        // Changes between batches do not lose the position
+        if (count == 14) {
+            r = oncefs_del_node(&ofs, "/dir/file13");
+            if (r != 0) { return r; }
+            r = oncefs_set_file(&ofs, "/dir/file00a"); // sorts before, so not listed
+            if (r != 0) { return r; }
+        }
+    } while (batch == 7);
+
+    if (count != 50) { return -400; }
+
+    // Without attributes, and past the end
+    int _nostat(oncefs_node_t *entry, oncefs_stat_t *stat) {
+        if (stat != NULL) { return 1; }
+        count++;
+        return 0;
+    }
+    count = 0;
+    r = oncefs_get_dir_after(&ofs, dir.node, "file47", 0, _nostat);
+    if (r != 0) { return r; }
+    if (count != 2) { return -400; }
+
+    r = oncefs_get_dir_after(&ofs, dir.node, "file49", 0, _nostat);
+    if (r != 0) { return r; }
+    if (count != 2) { return -400; }
+
+    // Not a directory
+    r = oncefs_get_dir_after(&ofs, file.node, NULL, 0, _nostat);
+    if (r != -EINVAL) { return -400; }
+
+    oncefs_free(&ofs);
+
+    return 0;
+}
+
+int _test_oncefs_get_link() {
+    int r;
+
+    oncefs_t ofs;
+    r = oncefs_init_default(&ofs);
+    if (r != 0) { return r; }
+
+    r = oncefs_set_file(&ofs, "/foo");
+    if (r != 0) { return r; }
+
+    r = oncefs_set_dir(&ofs, "/bar");
+    if (r != 0) { return r; }
+
+    r = oncefs_set_link(&ofs, "/baz", "../foo");
+    if (r != 0) { return r; }
+
+    // oncefs_dump(&ofs);
+
+    oncefs_node_t result;
+    r = oncefs_get_link(&ofs, "/baz", &result);
+    if (r != 0) { return r; }
+
+    if (strcmp(result.name, "../foo") != 0) { return -400; }
+
+    oncefs_free(&ofs);
+
+    return 0;
+}
+
+int _test_oncefs_del_file() {
+    int r;
+
+    oncefs_t ofs;
+    r = oncefs_init_default(&ofs);
+    if (r != 0) { return r; }
+
+    r = oncefs_set_file(&ofs, "/foo");
+    if (r != 0) { return r; }
+
+    r = oncefs_set_data(&ofs, 1, "Hello world!", 12, 0);
+    if (r != 0) { return r; }
+
+    r = oncefs_set_file(&ofs, "/foo");
+    if (r == 0) { return r; }
+
+    r = oncefs_del_node(&ofs, "/foo");
+    if (r != 0) { return r; }
+
+    // oncefs_dump(&ofs);
+
+    r = oncefs_set_file(&ofs, "/foo");
+    if (r != 0) { return r; }
+
+    oncefs_free(&ofs);
+
+    return 0;
+}
+
+int _test_oncefs_del_dir() {
+    int r;
+
+    oncefs_t ofs;
+    r = oncefs_init_default(&ofs);
+    if (r != 0) { return r; }
+
+    r = oncefs_set_dir(&ofs, "/foo");
+    if (r != 0) { return r; }
+
+    r = oncefs_set_file(&ofs, "/foo/bar");
+    if (r != 0) { return r; }
+
+    r = oncefs_set_dir(&ofs, "/baz");
+    if (r != 0) { return r; }
+
+    r = oncefs_del_node(&ofs, "/foo");
+    if (r == 0) { return -400; }
+
+    r = oncefs_del_node(&ofs, "/foo/bar");
+    if (r != 0) { return r; }
+
+    r = oncefs_del_node(&ofs, "/foo");
+    if (r != 0) { return r; }
+
+    r = oncefs_set_file(&ofs, "/foo");
+    if (r != 0) { return r; }
+
+    // oncefs_dump(&ofs);
+
+    oncefs_free(&ofs);
+
+    return 0;
+}
+
+int _test_oncefs_del_link() {
+    int r;
+
+    oncefs_t ofs;
+    r = oncefs_init_default(&ofs);
+    if (r != 0) { return r; }
+
+    r = oncefs_set_link(&ofs, "/foo", "link");
+    if (r != 0) { return r; }
+
+    r = oncefs_del_node(&ofs, "link"); // doesn't exist
+    if (r == 0) { return r; }
+
+    r = oncefs_del_node(&ofs, "/foo");
+    if (r != 0) { return r; }
+
+    // oncefs_dump(&ofs); // both link and payload should be freed
+
+    oncefs_free(&ofs);
+
+    return 0;
+}
+
+int _test_oncefs_del_node_full() {
+    int r;
+
+    oncefs_t ofs;
+    r = oncefs_init_default(&ofs);
+    if (r != 0) { return r; }
+
+    r = oncefs_set_file(&ofs, "/foo");
+    if (r != 0) { return r; }
+
+    r = oncefs_set_file(&ofs, "/bar");
+    if (r != 0) { return r; }
+
+    // Artificially pretend all blocks are taken
+    ofs.next_block_id = ofs.last_block_id + 1;
+
+    // Create should fail
+    r = oncefs_set_file(&ofs, "/baz");
+    if (r == 0) { return -ECANCELED; }
+
+    // Delete existing should still go through
+    r = oncefs_del_node(&ofs, "/foo");
+    if (r != 0) { return r; }
+
+    // Create after delete should succeed
+    r = oncefs_set_file(&ofs, "/baz");
+    if (r == 0) { return -ECANCELED; }
+
+    // oncefs_dump(&ofs);
+
+    oncefs_free(&ofs);
+
+    return 0;
+}
+
+
+int _test_oncefs_del_data() {
+    int r;
+
+    oncefs_t ofs;
+    r = oncefs_init_default(&ofs);
+    if (r != 0) { return r; }
+
+    // Setup
+    r = oncefs_set_file(&ofs, "/foo");
+    if (r != 0) { return r; }
+
+    r = oncefs_set_data(&ofs, 1, "abcdefgh", 8, 0);
+    if (r != 0) { return r; }
+
+    r = oncefs_set_data(&ofs, 1, "ijklmnop", 8, 8);
+    if (r != 0) { return r; }
+
+    r = oncefs_set_data(&ofs, 1, "qrstuvwx", 8, 16);
+    if (r != 0) { return r; }
+
+    r = oncefs_set_data(&ofs, 1, "yz", 2, 24);
+    if (r != 0) { return r; }
+
+    // Truncate
+    r = oncefs_del_data(&ofs, 1, 18);
+    if (r != 0) { return r; }
+
+    // oncefs_dump(&ofs);
+
+    // Truncate again
+    r = oncefs_del_data(&ofs, 1, 15);
+    if (r != 0) { return r; }
+
+    // oncefs_dump(&ofs);
+
+    oncefs_free(&ofs);
+
+    return 0;
+}
+
+int _test_oncefs_del_data_rare() {
+    // Test with specially crafted payloads to cause bug when wrong index is used for
+    // lookup in table
+    int r;
+
+    oncefs_t ofs;
+    r = oncefs_init_default(&ofs);
+    if (r != 0) { return r; }
+
+    // Setup
+    r = oncefs_set_file(&ofs, "/foo");
+    if (r != 0) { return r; }
+
+    r = oncefs_set_data(&ofs, 1, "Hello world!", 12, 0);
+    if (r != 0) { return r; }
+
+    r = oncefs_set_file(&ofs, "/bar");
+    if (r != 0) { return r; }
+
+    r = oncefs_set_data(&ofs, 2, "bork bork bork!", 16, 0);
+    if (r != 0) { return r; }
+
+    // Truncate
+    r = oncefs_del_data(&ofs, 1, 0);
+    if (r != 0) { return r; }
+
+    // oncefs_dump(&ofs);
+
+    oncefs_free(&ofs);
+
+    return 0;
+}
+
+int _test_oncefs_move_file() {
+    int r;
+
+    oncefs_t ofs;
+    r = oncefs_init_default(&ofs);
+    if (r != 0) { return r; }
+
+    // Setup
+    r = oncefs_set_file(&ofs, "/foo");
+    if (r != 0) { return r; }
+    r = oncefs_set_file(&ofs, "/bar");
+    if (r != 0) { return r; }
+    r = oncefs_set_dir(&ofs, "/dir1");
+    if (r != 0) { return r; }
+    r = oncefs_set_dir(&ofs, "/dir2");
+    if (r != 0) { return r; }
+
+    // Move
+    r = oncefs_move_node(&ofs, "/foo", "/baz");
+    if (r != 0) { return r; }
+
+    // Move into directory
+    r = oncefs_move_node(&ofs, "/baz", "/dir1/foo");
+    if (r != 0) { return r; }
+
+    // Move into directory shortcut not supported
+    r = oncefs_move_node(&ofs, "/dir1/foo", "/dir2");
+    if (r == 0) { return r; }
+
+    // Move overwriting existing
+    r = oncefs_move_node(&ofs, "/dir1/foo", "/bar");
+    if (r != 0) { return r; }
+
+    // Can't move non-existing
+    r = oncefs_move_node(&ofs, "/foo", "/baz");
+    if (r == 0) { return r; }
+
+    oncefs_free(&ofs);
+
+    return 0;
+}
+
+int _test_oncefs_extents() {
+    int r;
+
+    io_config_t config = {
+        .path = ":memory:",
+        .block_size = 512,
+        .max_num_blocks = 64
+    };
+
+    io_t io;
+    r = io_init(&io, &config);
+    if (r != 0) { return r; }
+
+    oncefs_t ofs;
+    r = oncefs_init(&ofs, &io, 1); // format
+    if (r != 0) { return r; }
+
+    uint32_t file;
+    r = oncefs_set_file_at(&ofs, 0, "foo", &file);
+    if (r != 0) { return r; }
+
+    // Two blocks, a hole, then a newer write over the middle of the first block
+    size_t payload = ofs.payload_size;
+    char data[payload * 2];
+    memset(data, 'a', sizeof(data));
+    r = oncefs_set_data(&ofs, file, data, payload * 2, 0);
+    if (r != 0) { return r; }
+    r = oncefs_set_data(&ofs, file, "bb", 2, payload * 3);
+    if (r != 0) { return r; }
+    r = oncefs_set_data(&ofs, file, "cc", 2, 10);
+    if (r != 0) { return r; }
+
+    oncefs_extent_t expected[] = {
+        {.offset = 0, .size = 10, .skip = 0},
+        {.offset = 10, .size = 2, .skip = 0},
+        {.offset = 12, .size = payload - 12, .skip = 12},
+        {.offset = payload, .size = payload, .skip = 0},
+        {.offset = payload * 2, .size = payload, .hole = 1},
+        {.offset = payload * 3, .size = 2, .skip = 0}};
+
+    int _callback(oncefs_extent_t *extents, size_t count) {
+        if (count != 6) { return -400; }
+
+        for (size_t i = 0; i < count; i++) {
+            if (extents[i].offset != expected[i].offset) { return -400; }
+            if (extents[i].size != expected[i].size) { return -400; }
+            if (extents[i].hole != expected[i].hole) { return -400; }
+            if (!extents[i].hole && extents[i].skip != expected[i].skip) { return -400; }
+        }
+
+        // The newer write has a block of its own
+        if (extents[1].block == extents[0].block) { return -400; }
+        if (extents[2].block != extents[0].block) { return -400; }
+
+        return 0;
+    }
+
+    r = oncefs_get_extents(&ofs, file, payload * 5, 0, _callback);
+    if (r != 0) { return r; }
+
+    // Nothing past the end of the data
+    int _empty(oncefs_extent_t *extents, size_t count) {
+        return (count == 0) ? 0 : -400;
+    }
+
+    r = oncefs_get_extents(&ofs, file, 100, payload * 4, _empty);
+    if (r != 0) { return r; }
+
+    oncefs_free(&ofs);
+    io_close(&io);
+
+    return 0;
+}
+
+int _test_oncefs_seek() {
+    int r;
+
+    io_config_t config = {
+        .path = ":memory:",
+        .block_size = 512,
+        .max_num_blocks = 64
+    };
+
+    io_t io;
+    r = io_init(&io, &config);
+    if (r != 0) { return r; }
+
+    oncefs_t ofs;
+    r = oncefs_init(&ofs, &io, 1); // format
+    if (r != 0) { return r; }
+
+    uint32_t file;
+    r = oncefs_set_file_at(&ofs, 0, "foo", &file);
+    if (r != 0) { return r; }
+
+    // Data, a hole of two blocks, then data again
+    size_t payload = ofs.payload_size;
+    r = oncefs_set_data(&ofs, file, "aa", 2, 0);
+    if (r != 0) { return r; }
+    r = oncefs_set_data(&ofs, file, "bb", 2, payload * 2);
+    if (r != 0) { return r; }
+
+    uint64_t result;
+    r = oncefs_seek(&ofs, file, 0, 0, &result);
+    if (r != 0 || result != 0) { return -400; }
+    r = oncefs_seek(&ofs, file, 0, 1, &result);
+    if (r != 0 || result != 2) { return -400; }
+    r = oncefs_seek(&ofs, file, 5, 0, &result);
+    if (r != 0 || result != payload * 2) { return -400; }
+    r = oncefs_seek(&ofs, file, payload * 2 + 1, 1, &result);
+    if (r != 0 || result != payload * 2 + 2) { return -400; } // the end of the file
+
+    r = oncefs_seek(&ofs, file, payload * 2 + 2, 0, &result);
+    if (r != -ENXIO) { return -400; }
+
+    // Inside a block, and across overlapping ones
+    r = oncefs_seek(&ofs, file, 1, 0, &result);
+    if (r != 0 || result != 1) { return -400; }
+    r = oncefs_set_data(&ofs, file, "ccc", 3, payload * 2 + 1);
+    if (r != 0) { return r; }
+    r = oncefs_seek(&ofs, file, payload * 2, 1, &result);
+    if (r != 0 || result != payload * 2 + 4) { return -400; }
+
+    oncefs_free(&ofs);
+    io_close(&io);
+
+    return 0;
+}
+
+int _test_oncefs_allocate() {
+    int r;
+
+    io_config_t config = {
+        .path = ":memory:",
+        .block_size = 512,
+        .max_num_blocks = 64
+    };
+
+    io_t io;
+    r = io_init(&io, &config);
+    if (r != 0) { return r; }
+
+    oncefs_t ofs;
+    r = oncefs_init(&ofs, &io, 1); // format
+    if (r != 0) { return r; }
+
+    uint32_t file;
+    r = oncefs_set_file_at(&ofs, 0, "foo", &file);
+    if (r != 0) { return r; }
+
+    size_t payload = ofs.payload_size;
+    r = oncefs_set_data(&ofs, file, "bb", 2, payload * 2);
+    if (r != 0) { return r; }
+
+    oncefs_status_t before;
+    r = oncefs_get_status(&ofs, &before);
+    if (r != 0) { return r; }
+
+    // Only checked, so the hole stays a hole
+    r = oncefs_allocate(&ofs, file, payload * 2, 0, 1);
+    if (r != 0) { return r; }
+
+    oncefs_stat_t stat;
+    r = oncefs_get_node_id(&ofs, file, &stat);
+    if (r != 0) { return r; }
+    if (stat.size != payload * 2 + 2) { return -400; }
+
+    uint64_t result;
+    r = oncefs_seek(&ofs, file, 0, 1, &result);
+    if (r != 0 || result != 0) { return -400; }
+
+    oncefs_status_t after;
+    r = oncefs_get_status(&ofs, &after);
+    if (r != 0) { return r; }
+    if (after.free_blocks != before.free_blocks) { return -400; }
+
+    // Past the end only if the size stays
+    r = oncefs_allocate(&ofs, file, payload * 4, 0, 1);
+    if (r != 0) { return r; }
+    r = oncefs_allocate(&ofs, file, payload, payload * 2, 0);
+    if (r != -EOPNOTSUPP) { return -400; }
+    r = oncefs_get_node_id(&ofs, file, &stat);
+    if (r != 0) { return r; }
+    if (stat.size != payload * 2 + 2) { return -400; }
+
+    // More than is free
+    r = oncefs_allocate(&ofs, file, payload * 64, 0, 1);
+    if (r != -ENOSPC) { return -400; }
+
+    oncefs_free(&ofs);
+    io_close(&io);
+
+    return 0;
+}
+
+int _test_oncefs_copy_data() {
+    int r;
+
+    io_config_t config = {
+        .path = ":memory:",
+        .block_size = 512,
+        .max_num_blocks = 64
+    };
+
+    io_t io;
+    r = io_init(&io, &config);
+    if (r != 0) { return r; }
+
+    oncefs_t ofs;
+    r = oncefs_init(&ofs, &io, 1); // format
+    if (r != 0) { return r; }
+
+    uint32_t from;
+    r = oncefs_set_file_at(&ofs, 0, "foo", &from);
+    if (r != 0) { return r; }
+    uint32_t to;
+    r = oncefs_set_file_at(&ofs, 0, "bar", &to);
+    if (r != 0) { return r; }
+
+    // A sparse source
+    size_t payload = ofs.payload_size;
+    r = oncefs_set_data(&ofs, from, "Hello", 5, 0);
+    if (r != 0) { return r; }
+    r = oncefs_set_data(&ofs, from, "world", 5, payload * 3);
+    if (r != 0) { return r; }
+
+    size_t copied;
+    r = oncefs_copy_data(&ofs, from, 0, to, 1, payload * 8, &copied);
+    if (r != 0) { return r; }
+    if (copied != payload * 3 + 5) { return -400; }
+
+    size_t size = payload * 3 + 6;
+    char expected[size];
+    memset(expected, 0, size);
+    memcpy(expected + 1, "Hello", 5);
+    memcpy(expected + 1 + payload * 3, "world", 5);
+
+    char actual[size];
+    r = oncefs_get_data(&ofs, to, actual, size, 0);
+    if (r != size || memcmp(actual, expected, size) != 0) { return -400; }
+
+    // The hole is not copied as zeros
+    uint64_t result;
+    r = oncefs_seek(&ofs, to, 1, 1, &result);
+    if (r != 0 || result != 6) { return -400; }
+
+    // Past the end, and overlapping
+    r = oncefs_copy_data(&ofs, from, payload * 4, to, 0, 10, &copied);
+    if (r != 0 || copied != 0) { return -400; }
+    r = oncefs_copy_data(&ofs, from, 0, from, 2, 10, &copied);
+    if (r != -EINVAL) { return -400; }
+
+    // Running out of space part way gives a short copy, like a short write
+    uint32_t big;
+    r = oncefs_set_file_at(&ofs, 0, "big", &big);
+    if (r != 0) { return r; }
+    uint32_t short_copy;
+    r = oncefs_set_file_at(&ofs, 0, "short", &short_copy);
+    if (r != 0) { return r; }
+
+    char data[payload * 4];
+    for (size_t i = 0; i < sizeof(data); i++) { data[i] = 'a' + i % 26; }
+    r = oncefs_set_data(&ofs, big, data, sizeof(data), 0);
+    if (r != 0) { return r; }
+
+    oncefs_status_t status;
+    r = oncefs_get_status(&ofs, &status);
+    if (r != 0) { return r; }
+
+    uint32_t filler;
+    r = oncefs_set_file_at(&ofs, 0, "filler", &filler);
+    if (r != 0) { return r; }
+    size_t fill = payload * (status.free_blocks - 3);
+    char *zeros = calloc(1, fill);
+    r = oncefs_set_data(&ofs, filler, zeros, fill, 0);
+    free(zeros);
+    if (r != 0) { return r; }
+
+    r = oncefs_copy_data(&ofs, big, 0, short_copy, 0, sizeof(data), &copied);
+    if (r != 0) { return r; }
+    if (copied == 0 || copied >= sizeof(data) || copied % payload != 0) { return -400; }
+
+    char copy[sizeof(data)];
+    r = oncefs_get_data(&ofs, short_copy, copy, sizeof(data), 0);
+    if (r != copied || memcmp(copy, data, copied) != 0) { return -400; }
+
+    // Nothing copied at all is an error
+    r = oncefs_copy_data(&ofs, big, 0, short_copy, copied, sizeof(data), &copied);
+    if (r != -ENOSPC || copied != 0) { return -400; }
+
+    oncefs_free(&ofs);
+    io_close(&io);
+
+    return 0;
+}
+
+int _test_oncefs_handle() {
+    int r;
+
+    io_config_t config = {
+        .path = ":memory:",
+        .block_size = 512,
+        .max_num_blocks = 64
+    };
+
+    io_t io;
+    r = io_init(&io, &config);
+    if (r != 0) { return r; }
+
+    oncefs_t ofs;
+    r = oncefs_init(&ofs, &io, 1); // format
+    if (r != 0) { return r; }
+
+    uint32_t file;
+    r = oncefs_set_file_at(&ofs, 0, "foo", &file);
+    if (r != 0) { return r; }
+
+    // Not a file
+    oncefs_handle_t handle;
+    r = oncefs_open(&ofs, 0, &handle);
+    if (r != -EINVAL) { return -400; }
+
+    r = oncefs_open(&ofs, file, &handle);
+    if (r != 0) { return r; }
+
+    // Appends through the handle keep it valid
+    size_t size = ofs.payload_size * 6;
+    char expected[size];
+    for (size_t i = 0; i < size; i++) { expected[i] = 'a' + i % 26; }
+    for (size_t i = 0; i < size; i += 100) {
+        size_t amount = (size - i < 100) ? size - i : 100;
+        r = oncefs_handle_set_data(&ofs, &handle, expected + i, amount, i);
+        if (r != 0) { return r; }
+    }
+    if (handle.generation != ofs.generation) { return -400; }
+
+    oncefs_stat_t stat;
+    r = oncefs_handle_stat(&ofs, &handle, &stat);
+    if (r != 0) { return r; }
+    if (stat.size != size) { return -400; }
+
+    // Sequential reads, crossing blocks, then one further back
+    char actual[size];
+    for (size_t i = 0; i < size; i += 77) {
+        size_t amount = (size - i < 77) ? size - i : 77;
+        r = oncefs_handle_get_data(&ofs, &handle, actual + i, amount, i);
+        if (r != amount) { return -400; }
+    }
+    if (memcmp(actual, expected, size) != 0) { return -400; }
+
+    r = oncefs_handle_get_data(&ofs, &handle, actual, 50, 1000);
+    if (r != 50 || memcmp(actual, expected + 1000, 50) != 0) { return -400; }
+
+    // Other changes make it stale
+    r = oncefs_set_data(&ofs, file, "XY", 2, 1001);
+    if (r != 0) { return r; }
+    memcpy(expected + 1001, "XY", 2);
+
+    r = oncefs_handle_get_data(&ofs, &handle, actual, 50, 1000);
+    if (r != 50 || memcmp(actual, expected + 1000, 50) != 0) { return -400; }
+
+    r = oncefs_del_data(&ofs, file, 10);
+    if (r != 0) { return r; }
+    r = oncefs_handle_stat(&ofs, &handle, &stat);
+    if (r != 0) { return r; }
+    if (stat.size != 10) { return -400; }
+    r = oncefs_handle_get_data(&ofs, &handle, actual, 50, 1000);
+    if (r != 0) { return -400; }
+
+    oncefs_close(&handle);
+    oncefs_free(&ofs);
+    io_close(&io);
+
+    return 0;
+}
+
+int _test_oncefs_set_data_in_place() {
+    int r;
+
+    const char *path = "/tmp/oncefs-test-in-place.ofs";
+    r = _make_container(path, 512 * 64);
+    if (r != 0) { return r; }
+
+    io_config_t config = {
+        .path = (char *) path,
+        .block_size = 512,
+        .backend = IO_BACKEND_FILE
+    };
+
+    io_t io;
+    r = io_init(&io, &config);
+    if (r != 0) { return r; }
+
+    oncefs_t ofs;
+    r = oncefs_init(&ofs, &io, 1); // format
+    if (r != 0) { return r; }
+
+    uint32_t file;
+    r = oncefs_set_file_at(&ofs, 0, "foo", &file);
+    if (r != 0) { return r; }
+
+    size_t size = ofs.payload_size * 2 + 10;
+    char expected[size];
+    for (size_t i = 0; i < size; i++) { expected[i] = 'a' + i % 26; }
+
+    // Parts arrive in order and go straight to the file
+    size_t done = 0;
+    int _place(uint32_t block, int offset, size_t amount) {
+        int fh;
+        off_t position;
+        int r = io_locate(&io, block, offset, &fh, &position);
+        if (r != 0) { return r; }
+        if (pwrite(fh, expected + done, amount, position) != amount) { return -EIO; }
+        done += amount;
+        return 0;
+    }
+
+    r = oncefs_set_data_in_place(&ofs, file, size, 0, _place);
+    if (r != 0) { return r; }
+    if (done != size) { return -400; }
+
+    char actual[size];
+    r = oncefs_get_data(&ofs, file, actual, size, 0);
+    if (r != size) { return -400; }
+    if (memcmp(actual, expected, size) != 0) { return -400; }
+
+    // Headers made it to storage, so the data survives a reload
+    oncefs_free(&ofs);
+    r = oncefs_init(&ofs, &io, 0);
+    if (r != 0) { return r; }
+
+    memset(actual, 0, size);
+    r = oncefs_get_data(&ofs, file, actual, size, 0);
+    if (r != size) { return -400; }
+    if (memcmp(actual, expected, size) != 0) { return -400; }
+
+    oncefs_free(&ofs);
+    io_close(&io);
+    remove(path);
+
+    return 0;
+}
+
+int _test_oncefs_set_data_in_place_fail() {
+    int r;
+
+    const char *path = "/tmp/oncefs-test-in-place-fail.ofs";
+    r = _make_container(path, 512 * 64);
+    if (r != 0) { return r; }
+
+    io_config_t config = {
+        .path = (char *) path,
+        .block_size = 512,
+        .backend = IO_BACKEND_FILE
+    };
+
+    io_t io;
+    r = io_init(&io, &config);
+    if (r != 0) { return r; }
+
+    oncefs_t ofs;
+    r = oncefs_init(&ofs, &io, 1); // format
+    if (r != 0) { return r; }
+
+    uint32_t file;
+    r = oncefs_set_file_at(&ofs, 0, "foo", &file);
+    if (r != 0) { return r; }
+
+    size_t size = ofs.payload_size * 3;
+    char expected[size];
+    memset(expected, 'a', size);
+    r = oncefs_set_data(&ofs, file, expected, size, 0);
+    if (r != 0) { return r; }
+
+    oncefs_status_t before;
+    r = oncefs_get_status(&ofs, &before);
+    if (r != 0) { return r; }
+
+    // The second part never arrives
+    int calls = 0;
+    int _place(uint32_t block, int offset, size_t amount) {
+        if (++calls == 2) { return -EIO; }
+
+        int fh;
+        off_t position;
+        int r = io_locate(&io, block, offset, &fh, &position);
+        if (r != 0) { return r; }
+        if (pwrite(fh, expected, amount, position) != amount) { return -EIO; }
+        return 0;
+    }
+
+    memset(expected, 'b', ofs.payload_size);
+    r = oncefs_set_data_in_place(&ofs, file, size, 0, _place);
+    if (r != -EIO) { return -400; }
+    if (calls != 2) { return -400; }
+
+    // Only the first part was written; the failed block is free again
+    oncefs_status_t after;
+    r = oncefs_get_status(&ofs, &after);
+    if (r != 0) { return r; }
+    if (after.free_blocks != before.free_blocks - 1) { return -400; }
+
+    char actual[size];
+    r = oncefs_get_data(&ofs, file, actual, size, 0);
+    if (r != size) { return -400; }
+    if (memcmp(actual, expected, size) != 0) { return -400; }
+
+    // Blocks written after the failed one are not lost on a reload
+    uint32_t other;
+    r = oncefs_set_file_at(&ofs, 0, "bar", &other);
+    if (r != 0) { return r; }
+    r = oncefs_set_data(&ofs, other, "Hello", 5, 0);
+    if (r != 0) { return r; }
+
+    r = oncefs_sync(&ofs);
+    if (r != 0) { return r; }
+    oncefs_free(&ofs);
+    r = oncefs_init(&ofs, &io, 0);
+    if (r != 0) { return r; }
+
+    memset(actual, 0, size);
+    r = oncefs_get_data(&ofs, file, actual, size, 0);
+    if (r != size) { return -400; }
+    if (memcmp(actual, expected, size) != 0) { return -400; }
+
+    r = oncefs_get_data(&ofs, other, actual, 5, 0);
+    if (r != 5 || memcmp(actual, "Hello", 5) != 0) { return -400; }
+
+    oncefs_free(&ofs);
+    io_close(&io);
+    remove(path);
+
+    return 0;
+}
+
+// Writes to fail before storage works again, for the faulty backend below
+static int faulty_writes = 0;
+
+int _faulty_execute(io_t *io, int fh, io_request_t *requests, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (requests[i].op == IO_OP_WRITE && faulty_writes > 0) {
+            faulty_writes--;
+            return -EIO;
+        }
+    }
+
+    return io_backend_file.execute(io, fh, requests, count);
+}
+
+int _test_oncefs_set_data_fail() {
+    int r;
+
+    const char *path = "/tmp/oncefs-test-set-data-fail.ofs";
+    r = _make_container(path, 512 * 64);
+    if (r != 0) { return r; }
+
+    io_backend_t faulty = io_backend_file;
+    faulty.execute = _faulty_execute;
+
+    io_config_t config = {
+        .path = (char *) path,
+        .block_size = 512,
+        .backend = IO_BACKEND_CUSTOM,
+        .ops = &faulty
+    };
+
+    io_t io;
+    r = io_init(&io, &config);
+    if (r != 0) { return r; }
+
+    oncefs_t ofs;
+    r = oncefs_init(&ofs, &io, 1); // format
+    if (r != 0) { return r; }
+
+    uint32_t file;
+    r = oncefs_set_file_at(&ofs, 0, "foo", &file);
+    if (r != 0) { return r; }
+
+    size_t size = ofs.payload_size * 3;
+    char expected[size];
+    memset(expected, 'a', size);
+    r = oncefs_set_data(&ofs, file, expected, size, 0);
+    if (r != 0) { return r; }
+
+    oncefs_amplification_t before[BLOCK_OPERATION_LAST];
+    oncefs_get_amplification(&ofs, before);
+
+    // The batch never reaches storage, so the older data stays
+    char changed[size];
+    memset(changed, 'b', size);
+    faulty_writes = 1;
+    r = oncefs_set_data(&ofs, file, changed, size, 0);
+    if (r != -EIO) { return -400; }
+
+    oncefs_amplification_t after[BLOCK_OPERATION_LAST];
+    oncefs_get_amplification(&ofs, after);
+    if (after[BLOCK_OPERATION_DATA].blocks != before[BLOCK_OPERATION_DATA].blocks) {
+        return -400;
+    }
+
+    char actual[size];
+    r = oncefs_get_data(&ofs, file, actual, size, 0);
+    if (r != size || memcmp(actual, expected, size) != 0) { return -400; }
+
+    // Blocks written after the failed ones are not lost on a reload
+    uint32_t other;
+    r = oncefs_set_file_at(&ofs, 0, "bar", &other);
+    if (r != 0) { return r; }
+    r = oncefs_set_data(&ofs, other, "Hello", 5, 0);
+    if (r != 0) { return r; }
+
+    r = oncefs_sync(&ofs);
+    if (r != 0) { return r; }
+    oncefs_free(&ofs);
+    r = oncefs_init(&ofs, &io, 0);
+    if (r != 0) { return r; }
+
+    memset(actual, 0, size);
+    r = oncefs_get_data(&ofs, file, actual, size, 0);
+    if (r != size || memcmp(actual, expected, size) != 0) { return -400; }
+
+    r = oncefs_get_data(&ofs, other, actual, 5, 0);
+    if (r != 5 || memcmp(actual, "Hello", 5) != 0) { return -400; }
+
+    oncefs_free(&ofs);
+    io_close(&io);
+    remove(path);
+
+    return 0;
+}
+
+int _test_oncefs_lookup() {
+    int r;
+
+    oncefs_t ofs;
+    r = oncefs_init_default(&ofs);
+    if (r != 0) { return r; }
+
+    uint32_t dir, file, link;
+    r = oncefs_set_dir_at(&ofs, 0, "foo", &dir);
+    if (r != 0) { return r; }
+    r = oncefs_set_file_at(&ofs, dir, "bar", &file);
+    if (r != 0) { return r; }
+    r = oncefs_set_link_at(&ofs, 0, "baz", "foo/bar", &link);
+    if (r != 0) { return r; }
+
+    r = oncefs_set_file_at(&ofs, dir, "bar", NULL);
+    if (r != -EEXIST) { return -400; }
+
+    oncefs_stat_t stat;
+    r = oncefs_lookup(&ofs, dir, "bar", &stat);
+    if (r != 0) { return r; }
+    if (stat.node != file || !stat.is_file) { return -400; }
+
+    // Same node as by path
+    r = oncefs_get_node_id(&ofs, dir, &stat);
+    if (r != 0) { return r; }
+    if (!stat.is_dir) { return -400; }
+
+    oncefs_node_t target;
+    r = oncefs_get_link_id(&ofs, link, &target);
+    if (r != 0) { return r; }
+    if (strcmp(target.name, "foo/bar") != 0) { return -400; }
+
+    // Not a directory
+    r = oncefs_lookup(&ofs, file, "bar", &stat);
+    if (r != -EINVAL) { return -400; }
+    r = oncefs_lookup(&ofs, link, "foo/bar", &stat);
+    if (r != -EINVAL) { return -400; }
+
+    int count = 0;
+    int _callback(oncefs_node_t *entry) {
+        count++;
+        return 0;
+    }
+    r = oncefs_get_dir_id(&ofs, 0, _callback);
+    if (r != 0) { return r; }
+    if (count != 2) { return -400; }
+
+    r = oncefs_move_node_at(&ofs, dir, "bar", 0, "qux");
+    if (r != 0) { return r; }
+    r = oncefs_get_node(&ofs, "/qux", &stat);
+    if (r != 0) { return r; }
+    if (stat.node != file) { return -400; }
+
+    r = oncefs_del_node_at(&ofs, 0, "qux");
+    if (r != 0) { return r; }
+    r = oncefs_lookup(&ofs, 0, "qux", &stat);
+    if (r != -ENOENT) { return -400; }
+    r = oncefs_get_node_id(&ofs, file, &stat);
+    if (r != -ENOENT) { return -400; }
+
+    oncefs_free(&ofs);
+
+    return 0;
+}
+
+typedef struct {
+    oncefs_t *ofs;
+    uint32_t file;
+    size_t size;
+    int result;
+} _test_oncefs_threads_t;
+
+void *_do_test_oncefs_threads_read(void *raw) {
+    _test_oncefs_threads_t *state = (_test_oncefs_threads_t *) raw;
+
+    char data[state->size];
+    for (int i = 0; i < 200 && state->result == 0; i++) {
+        oncefs_stat_t stat;
+        int r = oncefs_lookup(state->ofs, 0, "foo", &stat);
+        if (r != 0 || stat.size != state->size) {
+            state->result = -400;
+            break;
+        }
+
+        // Whole writes are never seen in part
+        r = oncefs_get_data(state->ofs, state->file, data, state->size, 0);
+        if (r != state->size) {
+            state->result = -400;
+            break;
+        }
+        for (size_t j = 1; j < state->size; j++) {
+            if (data[j] != data[0]) { state->result = -400; }
+        }
+    }
+
+    return NULL;
+}
+
+void *_do_test_oncefs_threads_write(void *raw) {
+    _test_oncefs_threads_t *state = (_test_oncefs_threads_t *) raw;
+
+    char data[state->size];
+    for (int i = 0; i < 100 && state->result == 0; i++) {
+        memset(data, 'a' + i % 26, state->size);
+        int r = oncefs_set_data(state->ofs, state->file, data, state->size, 0);
+        if (r == 0) { r = oncefs_set_dir(state->ofs, "/bar"); }
+        if (r == 0) { r = oncefs_del_node(state->ofs, "/bar"); }
+        if (r == 0 && i % 10 == 0) { r = oncefs_sync(state->ofs); }
+        if (r != 0) { state->result = r; }
+    }
+
+    return NULL;
+}
+
+int _do_test_oncefs_threads(int writer) {
+    int r;
+
+    io_config_t config = {
+        .path = ":memory:",
+        .block_size = 512,
+        .max_num_blocks = 4096
+    };
+
+    io_t io;
+    r = io_init(&io, &config);
+    if (r != 0) { return r; }
+
+    oncefs_t ofs;
+    r = oncefs_init(&ofs, &io, 1); // format
+    if (r != 0) { return r; }
+
+    uint32_t file;
+    r = oncefs_set_file_at(&ofs, 0, "foo", &file);
+    if (r != 0) { return r; }
+
+    size_t size = ofs.payload_size * 3;
+    char data[size];
+    memset(data, 'z', size);
+    r = oncefs_set_data(&ofs, file, data, size, 0);
+    if (r != 0) { return r; }
+
+    if (writer) {
+        r = oncefs_start_writer(&ofs);
+        if (r != 0) { return r; }
+    }
+
+    // One writer alongside several readers
+    _test_oncefs_threads_t states[5];
+    pthread_t threads[5];
+    for (int i = 0; i < 5; i++) {
+        states[i] = (_test_oncefs_threads_t) {
+            .ofs = &ofs, .file = file, .size = size, .result = 0};
+        pthread_create(&threads[i], NULL, (i == 0) ? _do_test_oncefs_threads_write
+                                                   : _do_test_oncefs_threads_read,
+                       &states[i]);
+    }
+    for (int i = 0; i < 5; i++) {
+        pthread_join(threads[i], NULL);
+        if (states[i].result != 0) { return states[i].result; }
+    }
+
+    oncefs_free(&ofs);
+    io_close(&io);
+
+    return 0;
+}
+
+int _test_oncefs_threads() {
+    return _do_test_oncefs_threads(0);
+}
+
+int _test_oncefs_writer() {
+    return _do_test_oncefs_threads(1);
+}
+
+int _test_oncefs_load_state() {
+    int r;
+
+    // Initialize
+    io_t io;
+    r = io_init(&io, &io_config);
+    if (r != 0) { return r; }
+
+    oncefs_t ofs;
+    r = oncefs_init(&ofs, &io, 1); // format
+    if (r != 0) { return r; }
+
+    // Set up
+    r = oncefs_set_file(&ofs, "/foo");
+    if (r != 0) { return r; }
+    r = oncefs_set_dir(&ofs, "/bar");
+    if (r != 0) { return r; }
+    r = oncefs_set_link(&ofs, "/baz", "../link");
+    if (r != 0) { return r; }
+
+    char expected[2048];
+    oncefs_dumps(&ofs, expected);
+
+    oncefs_free(&ofs);
+
+    // Load
+    r = oncefs_init(&ofs, &io, 0); // don't format
+    if (r != 0) { return r; }
+
+    if(ofs.next_node_id != 4) { return -ECANCELED; }
+    if(ofs.next_block_id != 5) { return -ECANCELED; }
+    if(ofs.next_seq_id != 5) { return -ECANCELED; }
+
+    oncefs_free(&ofs);
+
+    return 0;
+}
+
+int _test_oncefs_load_get_node() {
+    int r;
+
+    // Initialize
+    io_t io;
+    r = io_init(&io, &io_config);
+    if (r != 0) { return r; }
+
+    oncefs_t ofs;
+    r = oncefs_init(&ofs, &io, 1); // format
+    if (r != 0) { return r; }
+
+    // Set up
+    r = oncefs_set_file(&ofs, "/foo");
+    if (r != 0) { return r; }
+    r = oncefs_set_dir(&ofs, "/bar");
+    if (r != 0) { return r; }
+    r = oncefs_set_link(&ofs, "/baz", "../link");
+    if (r != 0) { return r; }
+
+    char expected[2048];
+    oncefs_dumps(&ofs, expected);
+
+    oncefs_free(&ofs);
+
+    // Load
+    r = oncefs_init(&ofs, &io, 0); // don't format
+    if (r != 0) { return r; }
+
+    char actual[2048];
+    oncefs_dumps(&ofs, actual);
+
+    if (strcmp(actual, expected) != 0) { return -400; }
+
+    oncefs_free(&ofs);
+
+    return 0;
+}
+
+int _test_oncefs_load_del_node() {
+    int r;
+
+    // Initialize
+    io_t io;
+    r = io_init(&io, &io_config);
+    if (r != 0) { return r; }
+
+    oncefs_t ofs;
+    r = oncefs_init(&ofs, &io, 1); // format
+    if (r != 0) { return r; }
+
+    // Set up
     r = oncefs_set_file(&ofs, "/foo");
     if (r != 0) { return r; }
     r = oncefs_set_dir(&ofs, "/bar");
@@ -727,7 +2222,335 @@ int _test_oncefs_load_state() {
     r = oncefs_set_link(&ofs, "/baz", "../link");
     if (r != 0) { return r; }
 
-    char expected[2048];
+    r = oncefs_del_node(&ofs, "/foo");
+    if (r != 0) { return r; }
+
+    char expected[2048];
+    oncefs_dumps(&ofs, expected);
+
+    oncefs_free(&ofs);
+
+    // Load
+    r = oncefs_init(&ofs, &io, 0); // don't format
+    if (r != 0) { return r; }
+
+    char actual[2048];
+    oncefs_dumps(&ofs, actual);
+
+    if (strcmp(actual, expected) != 0) { return -400; }
+
+    oncefs_free(&ofs);
+
+    return 0;
+}
+
+int _test_oncefs_load_del_node_partial() {
+    // Special test to ensure that a delete is processed even when
+    // the relevant node no longer exists
+    int r;
+
+    // Initialize
+    io_t io;
+    r = io_init(&io, &io_config);
+    if (r != 0) { return r; }
+
+    oncefs_t ofs;
+    r = oncefs_init(&ofs, &io, 1); // format
+    if (r != 0) { return r; }
+
+    // Set up
+    r = oncefs_set_file(&ofs, "/foo");
+    if (r != 0) { return r; }
+
+    r = oncefs_set_file(&ofs, "/bar");
+    if (r != 0) { return r; }
+
+    // Force overwrite block
+    ofs.next_block_id = 1;
+    r = oncefs_set_file(&ofs, "/baz");
+    if (r != 0) { return r; }
+
+    // Re-establish
+    ofs.next_block_id = 3;
+    r = oncefs_del_node(&ofs, "/foo");
+    if (r != 0) { return r; }
+
+    char expected[2048];
+    oncefs_dumps(&ofs, expected);
+
+    oncefs_free(&ofs);
+
+    // Load
+    r = oncefs_init(&ofs, &io, 0); // don't format
+    if (r != 0) { return r; }
+
+    char actual[2048];
+    oncefs_dumps(&ofs, actual);
+
+    if (strcmp(actual, expected) != 0) {
+        printf("actual %s\n", actual);
+        printf("expected %s\n", expected);
+        return -ECANCELED;
+    }
+
+    oncefs_free(&ofs);
+
+    return 0;
+}
+
+int _test_oncefs_load_move_node() {
+    int r;
+
+    // Initialize
+    io_t io;
+    r = io_init(&io, &io_config);
+    if (r != 0) { return r; }
+
+    oncefs_t ofs;
+    r = oncefs_init(&ofs, &io, 1); // format
+    if (r != 0) { return r; }
+
+    // Setup
+    r = oncefs_set_file(&ofs, "/foo");
+    if (r != 0) { return r; }
+    r = oncefs_set_file(&ofs, "/bar");
+    if (r != 0) { return r; }
+    r = oncefs_set_dir(&ofs, "/dir1");
+    if (r != 0) { return r; }
+
+    // Move
+    r = oncefs_move_node(&ofs, "/foo", "/bar");
+    if (r != 0) { return r; }
+    r = oncefs_move_node(&ofs, "/bar", "/dir1/foo");
+    if (r != 0) { return r; }
+    r = oncefs_move_node(&ofs, "/dir1", "/dir2");
+    if (r != 0) { return r; }
+
+    // Save state
+    char expected[2048];
+    oncefs_dumps(&ofs, expected);
+
+    oncefs_free(&ofs);
+
+    // Load
+    r = oncefs_init(&ofs, &io, 0); // don't format
+    if (r != 0) { return r; }
+
+    char actual[2048];
+    oncefs_dumps(&ofs, actual);
+
+    if (strcmp(actual, expected) != 0) {
+        printf("actual %s\n", actual);
+        printf("expected %s\n", expected);
+        return -400;
+    }
+
+    oncefs_free(&ofs);
+
+    return 0;
+}
+
+
+int _test_oncefs_load_get_data() {
+    int r;
+
+    // Initialize
+    io_t io;
+    r = io_init(&io, &io_config);
+    if (r != 0) { return r; }
+
+    oncefs_t ofs;
+    r = oncefs_init(&ofs, &io, 1); // format
+    if (r != 0) { return r; }
+
+    // Setup
+
+    size_t amount = oncefs_set_data(&ofs, 1, "Hello world!", 12, 0);
+    if (amount != 12) { return amount; }
+
+    char expected[2048];
+    oncefs_dumps(&ofs, expected);
+
+    oncefs_free(&ofs);
+
+    // Load
+    r = oncefs_init(&ofs, &io, 0); // don't format
+    if (r != 0) { return r; }
+
+    char actual[2048];
+    oncefs_dumps(&ofs, actual);
+
+    if (strcmp(actual, expected) != 0) {
+        printf("actual %s\n", actual);
+        printf("expected %s\n", expected);
+        return -400;
+    }
+
+    // Check contents
+
+    strcpy(expected, "Hello world!");
+    int size = strlen(expected);
+
+    r = oncefs_get_data(&ofs, 1, actual, size, 0);
+    if (r != 0) { return r; }
+
+    // Inject 0
+    actual[size] = '\0';
+
+    if (strncmp(actual, expected, size) != 0) {
+        printf("actual %s\n", actual);
+        printf("expected %s\n", expected);
+        return -400;
+    }
+
+    return 0;
+}
+
+int _test_oncefs_load_get_data_overlay() {
+    int r;
+
+    // Initialize
+    io_t io;
+    r = io_init(&io, &io_config);
+    if (r != 0) { return r; }
+
+    oncefs_t ofs;
+    r = oncefs_init(&ofs, &io, 1); // format
+    if (r != 0) { return r; }
+
+    // Setup
+    r = oncefs_set_data(&ofs, 1, "xxxxxxxxxxxxxxxx", 16, 0);
+    if (r != 0) { return r; }
+    r = oncefs_set_data(&ofs, 1, "aaaaaaaaaaaaa", 12, 2);
+    if (r != 0) { return r; }
+    r = oncefs_set_data(&ofs, 1, "ddd", 3, 9 + 2);
+    if (r != 0) { return r; }
+    r = oncefs_set_data(&ofs, 1, "cccccc", 6, 3 + 2);
+    if (r != 0) { return r; }
+    r = oncefs_set_data(&ofs, 1, "bbb", 3, 3 + 2);
+    if (r != 0) { return r; }
+
+    char expected[2048];
+    oncefs_dumps(&ofs, expected);
+
+    oncefs_free(&ofs);
+
+    // Load
+    r = oncefs_init(&ofs, &io, 0); // don't format
+    if (r != 0) { return r; }
+
+    char actual[2048];
+    oncefs_dumps(&ofs, actual);
+
+    if (strcmp(actual, expected) != 0) { return -400; }
+
+    // Check contents
+    strcpy(expected, "xaaabbbcccdddx");
+    int size = strlen(expected);
+
+    size_t amount = oncefs_get_data(&ofs, 1, actual, size, 1);
+    if (amount != size) { return r; }
+
+    // Inject 0
+    actual[size] = '\0';
+
+    if (strncmp(actual, expected, size) != 0) {
+        printf("actual %s\n", actual);
+        printf("expected %s\n", expected);
+        return -400;
+    }
+
+    return 0;
+}
+
+int _test_oncefs_load_get_data_large() {
+    int r;
+
+    // Initialize
+    io_t io;
+    r = io_init(&io, &io_config);
+    if (r != 0) { return r; }
+
+    oncefs_t ofs;
+    r = oncefs_init(&ofs, &io, 1); // format
+    if (r != 0) { return r; }
+
+    // Setup
+    size_t count = 1024 * 20; // must be greater than 16k
+    char data[count];
+    for (int i = 0; i < count; i++) {
+        data[i] = (char) i;
+    }
+
+    r = oncefs_set_data(&ofs, 1, data, count, 0);
+    if (r != 0) { return r; }
+
+    char expected[5120];
+    oncefs_dumps(&ofs, expected);
+
+    oncefs_free(&ofs);
+
+    // Load
+    r = oncefs_init(&ofs, &io, 0); // don't format
+    if (r != 0) { return r; }
+
+    char actual[5120];
+    oncefs_dumps(&ofs, actual);
+
+    if (strcmp(actual, expected) != 0) { return -400; }
+
+    // Read
+    memset(data, 0, count);
+    size_t amount = oncefs_get_data(&ofs, 1, data, count, 0);
+    if (amount != count) { return r; }
+
+    // Verify
+    for (int i = 0; i < count; i++) {
+        if (data[i] != (char) i) { return -400; }
+    }
+
+    return 0;
+}
+
+
+int _test_oncefs_load_del_data() {
+    int r;
+
+    // Initialize
+    io_t io;
+    r = io_init(&io, &io_config);
+    if (r != 0) { return r; }
+
+    oncefs_t ofs;
+    r = oncefs_init(&ofs, &io, 1); // format
+    if (r != 0) { return r; }
+
+    // Setup
+    int count = 1024 * 10;
+    char data[count];
+    for (int i = 0; i < count; i++) {
+        data[i] = (char) i;
+    }
+
+    r = oncefs_set_file(&ofs, "/foo");
+    if (r != 0) { return r; }
+
+    r = oncefs_set_data(&ofs, 1, data, count, 0);
+    if (r != 0) { return r; }
+
+    // Unrelated
+    r = oncefs_set_file(&ofs, "/bar");
+    if (r != 0) { return r; }
+    r = oncefs_set_data(&ofs, 2, "bork bork bork", 14, 0);
+    if (r != 0) { return r; }
+
+    // Truncate
+    int cutoff = 5000;
+
+    r = oncefs_del_data(&ofs, 1, cutoff);
+    if (r != 0) { return r; }
+
+    char expected[4096];
     oncefs_dumps(&ofs, expected);
 
     oncefs_free(&ofs);
@@ -736,16 +2559,41 @@ int _test_oncefs_load_state() {
     r = oncefs_init(&ofs, &io, 0); // don't format
     if (r != 0) { return r; }
 
-    if(ofs.next_node_id != 4) { return -ECANCELED; }
-    if(ofs.next_block_id != 5) { return -ECANCELED; }
-    if(ofs.next_seq_id != 5) { return -ECANCELED; }
+    char actual[4096];
+    oncefs_dumps(&ofs, actual);
 
-    oncefs_free(&ofs);
+    // oncefs_dump(&ofs);
+
+    if (strcmp(actual, expected) != 0) {
+        printf("expected %s\n", expected);
+        printf("actual %s\n", actual);
+        return -400;
+    }
+
+    // Read
+    memset(data, 0, count);
+    int size = oncefs_get_data(&ofs, 1, data, count, 0);
+    if (size < 0) { return size; }
+
+    // oncefs_dump(&ofs);
+
+    if(size != cutoff) { return -ECANCELED; }
+
+    // Verify
+    for (int i = 0; i < count; i++) {
+        if (i >= cutoff) {
+            // This data should have been truncated
+            if (data[i] != 0) { return -400; }
+        } else {
+            // This data should exist
+            if (data[i] != (char) i) { return -400; }
+        }
+    }
 
     return 0;
 }
 
-int _test_oncefs_load_get_node() {
+int _test_oncefs_load_del_data_missing() {
     int r;
 
     // Initialize
@@ -757,81 +2605,151 @@ int _test_oncefs_load_get_node() {
     r = oncefs_init(&ofs, &io, 1); // format
     if (r != 0) { return r; }
 
-    // Set up
+    // Setup
     r = oncefs_set_file(&ofs, "/foo");
     if (r != 0) { return r; }
-    r = oncefs_set_dir(&ofs, "/bar");
+
+    r = oncefs_set_data(&ofs, 1, "Hello world!", 12, 0);
     if (r != 0) { return r; }
-    r = oncefs_set_link(&ofs, "/baz", "../link");
+
+    // Truncating a non-existing node should error
+    r = oncefs_del_data(&ofs, 2, 5);
+    if (r == 0) { return r; }
+
+    // Force overwriting node declaration
+    ofs.next_block_id = 1;
+    r = oncefs_del_data(&ofs, 1, 5);
     if (r != 0) { return r; }
 
-    char expected[2048];
-    oncefs_dumps(&ofs, expected);
+    // oncefs_dump(&ofs);
 
     oncefs_free(&ofs);
 
-    // Load
+    // When loading, truncating a non-existing node should not error
     r = oncefs_init(&ofs, &io, 0); // don't format
     if (r != 0) { return r; }
 
-    char actual[2048];
-    oncefs_dumps(&ofs, actual);
-
-    if (strcmp(actual, expected) != 0) { return -400; }
-
     oncefs_free(&ofs);
 
     return 0;
 }
-
-int _test_oncefs_load_del_node() {
+int _do_test_oncefs_load_backend(int backend, int direct, int header_size) {
     int r;
 
+    int block_size = header_size + (direct ? IO_DIRECT_ALIGNMENT : 512);
+
+    const char *path = "/tmp/oncefs-test-backend.ofs";
+    r = _make_container(path, block_size * 100);
+    if (r != 0) { return r; }
+
+    io_config_t config = {
+        .path = (char *) path,
+        .block_size = block_size,
+        .backend = backend,
+        .direct = direct,
+        .header_size = header_size
+    };
+
     // Initialize
     io_t io;
-    r = io_init(&io, &io_config);
+    r = io_init(&io, &config);
     if (r != 0) { return r; }
 
     oncefs_t ofs;
     r = oncefs_init(&ofs, &io, 1); // format
     if (r != 0) { return r; }
 
-    // Set up
+    // Setup
     r = oncefs_set_file(&ofs, "/foo");
     if (r != 0) { return r; }
-    r = oncefs_set_dir(&ofs, "/bar");
-    if (r != 0) { return r; }
-    r = oncefs_set_link(&ofs, "/baz", "../link");
-    if (r != 0) { return r; }
 
-    r = oncefs_del_node(&ofs, "/foo");
+    size_t count = 1024 * 20;
+    char data[count];
+    for (int i = 0; i < count; i++) {
+        data[i] = (char) i;
+    }
+
+    r = oncefs_set_data(&ofs, 1, data, count, 0);
     if (r != 0) { return r; }
 
-    char expected[2048];
-    oncefs_dumps(&ofs, expected);
+    // Overwrite part of the data
+    r = oncefs_set_data(&ofs, 1, "Hello world!", 12, 1000);
+    if (r != 0) { return r; }
+    memcpy(data + 1000, "Hello world!", 12);
 
     oncefs_free(&ofs);
+    io_close(&io);
 
     // Load
+    r = io_init(&io, &config);
+    if (r != 0) { return r; }
+
     r = oncefs_init(&ofs, &io, 0); // don't format
     if (r != 0) { return r; }
 
-    char actual[2048];
-    oncefs_dumps(&ofs, actual);
+    // Read
+    char actual[count];
+    size_t amount = oncefs_get_data(&ofs, 1, actual, count, 0);
+    if (amount != count) { return -400; }
 
-    if (strcmp(actual, expected) != 0) { return -400; }
+    if (memcmp(actual, data, count) != 0) { return -400; }
+
+    // Direct handles cannot be read around the block layer
+    int fh;
+    off_t position;
+    r = io_locate(&io, 0, 0, &fh, &position);
+    if ((r == -ENOTSUP) != direct) { return -400; }
 
     oncefs_free(&ofs);
+    io_close(&io);
+    remove(path);
 
     return 0;
 }
 
-int _test_oncefs_load_del_node_partial() {
-    // Special test to ensure that a delete is processed even when
-    // the relevant node no longer exists
+int _test_oncefs_load_mmap() {
+    return _do_test_oncefs_load_backend(IO_BACKEND_MMAP, 0, 0);
+}
+
+int _test_oncefs_load_uring() {
+    return _do_test_oncefs_load_backend(IO_BACKEND_URING, 0, 0);
+}
+
+int _test_oncefs_load_direct() {
+    int r;
+
+    // Blocks must be aligned
+    io_config_t config = {
+        .path = "/tmp/oncefs-test-backend.ofs",
+        .block_size = 1024,
+        .direct = 1
+    };
+
+    io_t io;
+    r = io_init(&io, &config);
+    if (r != -EINVAL) { return -400; }
+
+    r = _do_test_oncefs_load_backend(IO_BACKEND_FILE, 1, 0);
+    if (r != 0) { return r; }
+
+    return _do_test_oncefs_load_backend(IO_BACKEND_URING, 1, 0);
+}
+
+int _test_oncefs_load_split() {
+    int r;
+
+    r = _do_test_oncefs_load_backend(IO_BACKEND_FILE, 0, ONCEFS_OVERHEAD_SIZE);
+    if (r != 0) { return r; }
+
+    r = _do_test_oncefs_load_backend(IO_BACKEND_MMAP, 0, ONCEFS_OVERHEAD_SIZE);
+    if (r != 0) { return r; }
+
+    return _do_test_oncefs_load_backend(IO_BACKEND_URING, 1, ONCEFS_OVERHEAD_SIZE);
+}
+
+int _test_oncefs_packed() {
     int r;
 
-    // Initialize
     io_t io;
     r = io_init(&io, &io_config);
     if (r != 0) { return r; }
@@ -840,381 +2758,496 @@ int _test_oncefs_load_del_node_partial() {
     r = oncefs_init(&ofs, &io, 1); // format
     if (r != 0) { return r; }
 
-    // Set up
+    if (ofs.payload_size != io_config.block_size - 27) { return -400; }
+
+    oncefs_super_t super;
+    r = oncefs_probe(&io, &super);
+    if (r != 0) { return r; }
+    if (super.version != ONCEFS_VERSION) { return -400; }
+    if (super.block_size != io_config.block_size) { return -400; }
+    if (super.num_blocks != io_config.max_num_blocks) { return -400; }
+
     r = oncefs_set_file(&ofs, "/foo");
     if (r != 0) { return r; }
 
-    r = oncefs_set_file(&ofs, "/bar");
+    r = oncefs_set_data(&ofs, 1, "Hello", 5, 0x0102);
     if (r != 0) { return r; }
 
-    // Force overwrite block
-    ofs.next_block_id = 1;
-    r = oncefs_set_file(&ofs, "/baz");
+    // Little endian seq, operation, epoch, node, fill and offset, then the payload
+    uint32_t e = ofs.epoch;
+    uint8_t expected[] = {2, 0, 0, 0, 0, 0, 0, 0, 2, e, e >> 8, e >> 16, e >> 24,
+                          1, 0, 0, 0, 5, 0, 2, 1, 0, 0, 0, 0, 0, 0,
+                          'H', 'e', 'l', 'l', 'o'};
+    uint8_t actual[sizeof(expected)];
+    r = io_read(&io, 2, actual, sizeof(actual));
     if (r != 0) { return r; }
 
-    // Re-establish
-    ofs.next_block_id = 3;
-    r = oncefs_del_node(&ofs, "/foo");
+    if (memcmp(actual, expected, sizeof(expected)) != 0) { return -400; }
+
+    oncefs_free(&ofs);
+    io_close(&io);
+
+    return 0;
+}
+
+int _test_oncefs_format_epoch() {
+    int r;
+
+    io_t io;
+    r = io_init(&io, &io_config);
     if (r != 0) { return r; }
 
-    char expected[2048];
-    oncefs_dumps(&ofs, expected);
+    oncefs_t ofs;
+    r = oncefs_init(&ofs, &io, 1); // format
+    if (r != 0) { return r; }
+
+    uint32_t epoch = ofs.epoch;
+
+    r = oncefs_set_file(&ofs, "/foo");
+    if (r != 0) { return r; }
 
     oncefs_free(&ofs);
 
-    // Load
+    // Format again; only the superblock changes
+    r = oncefs_init(&ofs, &io, 1); // format
+    if (r != 0) { return r; }
+
+    if (ofs.epoch != epoch + 1) { return -400; }
+
+    oncefs_free(&ofs);
+
+    // Load; the file belongs to the previous epoch
     r = oncefs_init(&ofs, &io, 0); // don't format
     if (r != 0) { return r; }
 
-    char actual[2048];
-    oncefs_dumps(&ofs, actual);
+    oncefs_stat_t stat;
+    r = oncefs_get_node(&ofs, "/foo", &stat);
+    if (r != -ENOENT) { return -400; }
 
-    if (strcmp(actual, expected) != 0) {
-        printf("actual %s\n", actual);
-        printf("expected %s\n", expected);
-        return -ECANCELED;
-    }
+    if (ofs.next_block_id != io_block_first(&io)) { return -400; }
 
     oncefs_free(&ofs);
+    io_close(&io);
 
     return 0;
 }
 
-int _test_oncefs_load_move_node() {
+int _test_oncefs_format_over_v1() {
     int r;
 
-    // Initialize
     io_t io;
     r = io_init(&io, &io_config);
     if (r != 0) { return r; }
 
+    // A version 1 container: superblock, then packed seq, operation, node, fill,
+    // offset and payload; the node identifier sits where the epoch is now
+    uint8_t super[] = {'o', 'n', 'c', 'e', 'f', 's', 0, 0, 1, 0, 0, 0,
+                       0, 2, 0, 0, 0, 0, 0, 0, 100, 0, 0, 0, 0, 0, 0, 0};
+    r = io_write(&io, 0, super, sizeof(super));
+    if (r != 0) { return r; }
+
+    for (uint8_t i = 1; i < 10; i++) {
+        uint8_t record[] = {100 + i, 0, 0, 0, 0, 0, 0, 0, BLOCK_OPERATION_DATA,
+                            1, 0, 0, 0, 5, 0, i * 5, 0, 0, 0, 0, 0, 0, 0,
+                            's', 't', 'a', 'l', 'e'};
+        r = io_write(&io, i, record, sizeof(record));
+        if (r != 0) { return r; }
+    }
+
     oncefs_t ofs;
     r = oncefs_init(&ofs, &io, 1); // format
     if (r != 0) { return r; }
+    if (ofs.epoch < ONCEFS_EPOCH_MIN) { return -400; }
 
-    // Setup
-    r = oncefs_set_file(&ofs, "/foo");
-    if (r != 0) { return r; }
-    r = oncefs_set_file(&ofs, "/bar");
+    r = oncefs_set_file(&ofs, "/foo"); // node 1 again, in block 1
     if (r != 0) { return r; }
-    r = oncefs_set_dir(&ofs, "/dir1");
+
+    oncefs_free(&ofs);
+
+    // Load; nothing of the old container comes back
+    r = oncefs_init(&ofs, &io, 0); // don't format
     if (r != 0) { return r; }
 
-    // Move
-    r = oncefs_move_node(&ofs, "/foo", "/bar");
+    oncefs_stat_t stat;
+    r = oncefs_get_node(&ofs, "/foo", &stat);
     if (r != 0) { return r; }
-    r = oncefs_move_node(&ofs, "/bar", "/dir1/foo");
+    if (stat.size != 0) { return -400; }
+
+    if (ofs.next_block_id != io_block_first(&io) + 1) { return -400; }
+
+    oncefs_free(&ofs);
+    io_close(&io);
+
+    return 0;
+}
+
+int _test_oncefs_amplification() {
+    int r;
+
+    io_t io;
+    r = io_init(&io, &io_config);
     if (r != 0) { return r; }
-    r = oncefs_move_node(&ofs, "/dir1", "/dir2");
+
+    oncefs_t ofs;
+    r = oncefs_init(&ofs, &io, 1); // format
     if (r != 0) { return r; }
 
-    // Save state
-    char expected[2048];
-    oncefs_dumps(&ofs, expected);
+    r = oncefs_set_file(&ofs, "/foo");
+    if (r != 0) { return r; }
 
-    oncefs_free(&ofs);
+    // Two full blocks and one mostly padding
+    size_t count = ofs.payload_size * 2 + 30;
+    char data[count];
+    memset(data, 'x', count);
+    r = oncefs_set_data(&ofs, 1, data, count, 0);
+    if (r != 0) { return r; }
 
-    // Load
-    r = oncefs_init(&ofs, &io, 0); // don't format
+    r = oncefs_del_data(&ofs, 1, 0);
+    if (r != 0) { return r; }
+    r = oncefs_move_node(&ofs, "/foo", "/bar");
     if (r != 0) { return r; }
 
-    char actual[2048];
-    oncefs_dumps(&ofs, actual);
+    oncefs_amplification_t counters[BLOCK_OPERATION_LAST];
+    oncefs_get_amplification(&ofs, counters);
 
-    if (strcmp(actual, expected) != 0) {
-        printf("actual %s\n", actual);
-        printf("expected %s\n", expected);
-        return -400;
-    }
+    oncefs_amplification_t *data_counter = &counters[BLOCK_OPERATION_DATA];
+    if (data_counter->blocks != 3) { return -400; }
+    if (data_counter->logical != count) { return -400; }
+    if (data_counter->physical != 3 * 512) { return -400; }
+
+    if (counters[BLOCK_OPERATION_NODE].blocks != 1) { return -400; }
+    if (counters[BLOCK_OPERATION_NODE].logical != 0) { return -400; }
+    if (counters[BLOCK_OPERATION_TRUNCATE].physical != 512) { return -400; }
+    if (counters[BLOCK_OPERATION_MOVE].blocks != 1) { return -400; }
+
+    char actual[2048];
+    oncefs_dumps_amplification(&ofs, actual);
+    if (strstr(actual, "| data     |          3 |") == NULL) { return -400; }
+    if (strstr(actual, "| ratio    |") == NULL) { return -400; }
 
     oncefs_free(&ofs);
+    io_close(&io);
 
     return 0;
 }
 
-
-int _test_oncefs_load_get_data() {
+int _test_oncefs_discard() {
     int r;
 
-    // Initialize
+    int block_size = ONCEFS_OVERHEAD_SIZE + 4096;
+
+    const char *path = "/tmp/oncefs-test-discard.ofs";
+    r = _make_container(path, 4096 + block_size * 100);
+    if (r != 0) { return r; }
+
+    io_config_t config = {
+        .path = (char *) path,
+        .block_size = block_size,
+        .header_size = ONCEFS_OVERHEAD_SIZE
+    };
+
     io_t io;
-    r = io_init(&io, &io_config);
+    r = io_init(&io, &config);
     if (r != 0) { return r; }
 
+    oncefs_config_t ofs_config = {.discard_rate = 1000};
+
     oncefs_t ofs;
-    r = oncefs_init(&ofs, &io, 1); // format
+    r = oncefs_init2(&ofs, &io, 1, &ofs_config); // format
     if (r != 0) { return r; }
 
-    // Setup
+    r = oncefs_set_file(&ofs, "/foo");
+    if (r != 0) { return r; }
+    r = oncefs_set_file(&ofs, "/bar");
+    if (r != 0) { return r; }
 
-    size_t amount = oncefs_set_data(&ofs, 1, "Hello world!", 12, 0);
-    if (amount != 12) { return amount; }
+    size_t count = 4096 * 20;
+    char data[count];
+    memset(data, 'x', count);
 
-    char expected[2048];
-    oncefs_dumps(&ofs, expected);
+    r = oncefs_set_data(&ofs, 1, data, count, 0);
+    if (r != 0) { return r; }
+    r = oncefs_set_data(&ofs, 2, data, 4096, 0);
+    if (r != 0) { return r; }
 
-    oncefs_free(&ofs);
+    r = oncefs_sync(&ofs);
+    if (r != 0) { return r; }
 
-    // Load
-    r = oncefs_init(&ofs, &io, 0); // don't format
+    struct stat before;
+    stat(path, &before);
+
+    // Free the blocks of one file
+    r = oncefs_del_node(&ofs, "/foo");
     if (r != 0) { return r; }
 
-    char actual[2048];
-    oncefs_dumps(&ofs, actual);
+    if (array_len(&ofs.discards) != 20) { return -400; }
 
-    if (strcmp(actual, expected) != 0) {
-        printf("actual %s\n", actual);
-        printf("expected %s\n", expected);
+    r = oncefs_sync(&ofs);
+    if (r != 0) { return r; }
+
+    if (array_len(&ofs.discards) != 0) { return -400; }
+
+    struct stat after;
+    stat(path, &after);
+
+    // Unsupported on some filesystems, in which case discard turns itself off
+    if (ofs.discard_rate != 0 && after.st_blocks > before.st_blocks - 20 * 4096 / 512) {
         return -400;
     }
 
-    // Check contents
-
-    strcpy(expected, "Hello world!");
-    int size = strlen(expected);
+    oncefs_free(&ofs);
 
-    r = oncefs_get_data(&ofs, 1, actual, size, 0);
+    // Load
+    r = oncefs_init2(&ofs, &io, 0, &ofs_config); // don't format
     if (r != 0) { return r; }
 
-    // Inject 0
-    actual[size] = '\0';
+    char actual[4096];
+    size_t amount = oncefs_get_data(&ofs, 2, actual, 4096, 0);
+    if (amount != 4096) { return -400; }
+    if (memcmp(actual, data, 4096) != 0) { return -400; }
 
-    if (strncmp(actual, expected, size) != 0) {
-        printf("actual %s\n", actual);
-        printf("expected %s\n", expected);
-        return -400;
-    }
+    oncefs_stat_t stat;
+    r = oncefs_get_node(&ofs, "/foo", &stat);
+    if (r != -ENOENT) { return -400; }
+
+    oncefs_free(&ofs);
+    io_close(&io);
+    remove(path);
 
     return 0;
 }
 
-int _test_oncefs_load_get_data_overlay() {
+int _test_oncefs_discard_max() {
     int r;
 
-    // Initialize
+    io_config_t config = {
+        .path = ":memory:",
+        .block_size = 512,
+        .max_num_blocks = 64
+    };
+
     io_t io;
-    r = io_init(&io, &io_config);
+    r = io_init(&io, &config);
     if (r != 0) { return r; }
 
+    oncefs_config_t ofs_config = {.discard_rate = 1000};
+
     oncefs_t ofs;
-    r = oncefs_init(&ofs, &io, 1); // format
+    r = oncefs_init2(&ofs, &io, 1, &ofs_config); // format
     if (r != 0) { return r; }
+    ofs.discard_max = 8;
 
-    // Setup
-    r = oncefs_set_data(&ofs, 1, "xxxxxxxxxxxxxxxx", 16, 0);
-    if (r != 0) { return r; }
-    r = oncefs_set_data(&ofs, 1, "aaaaaaaaaaaaa", 12, 2);
+    r = oncefs_set_file(&ofs, "/foo");
     if (r != 0) { return r; }
-    r = oncefs_set_data(&ofs, 1, "ddd", 3, 9 + 2);
+    r = oncefs_set_file(&ofs, "/bar");
     if (r != 0) { return r; }
-    r = oncefs_set_data(&ofs, 1, "cccccc", 6, 3 + 2);
+
+    size_t count = ofs.payload_size * 10;
+    char data[count];
+    memset(data, 'x', count);
+    r = oncefs_set_data(&ofs, 1, data, ofs.payload_size * 4, 0);
     if (r != 0) { return r; }
-    r = oncefs_set_data(&ofs, 1, "bbb", 3, 3 + 2);
+    r = oncefs_set_data(&ofs, 2, data, count, 0);
     if (r != 0) { return r; }
 
-    char expected[2048];
-    oncefs_dumps(&ofs, expected);
-
-    oncefs_free(&ofs);
-
-    // Load
-    r = oncefs_init(&ofs, &io, 0); // don't format
+    // Freed in an earlier round than the blocks of the second file
+    r = oncefs_del_node(&ofs, "/foo");
+    if (r != 0) { return r; }
+    ofs.discard_round++;
+    r = oncefs_del_node(&ofs, "/bar");
     if (r != 0) { return r; }
 
-    char actual[2048];
-    oncefs_dumps(&ofs, actual);
-
-    if (strcmp(actual, expected) != 0) { return -400; }
-
-    // Check contents
-    strcpy(expected, "xaaabbbcccdddx");
-    int size = strlen(expected);
-
-    size_t amount = oncefs_get_data(&ofs, 1, actual, size, 1);
-    if (amount != size) { return r; }
+    // The queue stays bounded, and the oldest went first
+    if (array_len(&ofs.discards) > 8) { return -400; }
+    oncefs_discard_t *entries = (oncefs_discard_t *) ofs.discards.entries;
+    for (size_t i = 0; i < array_len(&ofs.discards); i++) {
+        if (entries[i].round != 1) { return -400; }
+        if (i > 0 && entries[i].block <= entries[i - 1].block) { return -400; }
+    }
 
-    // Inject 0
-    actual[size] = '\0';
+    r = oncefs_sync(&ofs);
+    if (r != 0) { return r; }
+    if (array_len(&ofs.discards) != 0) { return -400; }
 
-    if (strncmp(actual, expected, size) != 0) {
-        printf("actual %s\n", actual);
-        printf("expected %s\n", expected);
-        return -400;
-    }
+    oncefs_free(&ofs);
+    io_close(&io);
 
     return 0;
 }
 
-int _test_oncefs_load_get_data_large() {
+int _test_oncefs_discard_reuse() {
     int r;
 
-    // Initialize
+    // Small enough that freed blocks are reused
+    io_config_t config = {
+        .path = ":memory:",
+        .block_size = 512,
+        .max_num_blocks = 8
+    };
+
     io_t io;
-    r = io_init(&io, &io_config);
+    r = io_init(&io, &config);
     if (r != 0) { return r; }
 
+    oncefs_config_t ofs_config = {.discard_rate = 1000};
+
     oncefs_t ofs;
-    r = oncefs_init(&ofs, &io, 1); // format
+    r = oncefs_init2(&ofs, &io, 1, &ofs_config); // format
     if (r != 0) { return r; }
 
-    // Setup
-    size_t count = 1024 * 20; // must be greater than 16k
-    char data[count];
-    for (int i = 0; i < count; i++) {
-        data[i] = (char) i;
-    }
+    r = oncefs_set_file(&ofs, "/foo");
+    if (r != 0) { return r; }
 
+    size_t count = ofs.payload_size * 3;
+    char data[count];
+    memset(data, 'x', count);
     r = oncefs_set_data(&ofs, 1, data, count, 0);
     if (r != 0) { return r; }
 
-    char expected[5120];
-    oncefs_dumps(&ofs, expected);
-
-    oncefs_free(&ofs);
+    r = oncefs_del_node(&ofs, "/foo");
+    if (r != 0) { return r; }
 
-    // Load
-    r = oncefs_init(&ofs, &io, 0); // don't format
+    // Rewriting freed blocks before the sync cancels their discards
+    r = oncefs_set_file(&ofs, "/bar");
+    if (r != 0) { return r; }
+    memset(data, 'y', count);
+    r = oncefs_set_data(&ofs, 2, data, count, 0);
     if (r != 0) { return r; }
 
-    char actual[5120];
-    oncefs_dumps(&ofs, actual);
+    r = oncefs_sync(&ofs);
+    if (r != 0) { return r; }
 
-    if (strcmp(actual, expected) != 0) { return -400; }
+    if (array_len(&ofs.discards) != 0) { return -400; }
 
-    // Read
-    memset(data, 0, count);
-    size_t amount = oncefs_get_data(&ofs, 1, data, count, 0);
-    if (amount != count) { return r; }
+    char actual[count];
+    size_t amount = oncefs_get_data(&ofs, 2, actual, count, 0);
+    if (amount != count) { return -400; }
+    if (memcmp(actual, data, count) != 0) { return -400; }
 
-    // Verify
-    for (int i = 0; i < count; i++) {
-        if (data[i] != (char) i) { return -400; }
-    }
+    oncefs_free(&ofs);
+    io_close(&io);
 
     return 0;
 }
 
-
-int _test_oncefs_load_del_data() {
+int _test_oncefs_migrate() {
     int r;
 
-    // Initialize
     io_t io;
     r = io_init(&io, &io_config);
     if (r != 0) { return r; }
 
-    oncefs_t ofs;
-    r = oncefs_init(&ofs, &io, 1); // format
+    // A container written by an earlier version, with padded records
+    oncefs_tag_t tag = {.seq = 1, .operation = 1}; // node
+    oncefs_node_t node = {.node = 1, .parent = 0, .type = 2, .name = "foo"}; // file
+    r = io_write2(&io, 1, &tag, sizeof(tag), &node, sizeof(node));
     if (r != 0) { return r; }
 
-    // Setup
-    int count = 1024 * 10;
-    char data[count];
-    for (int i = 0; i < count; i++) {
-        data[i] = (char) i;
-    }
-
-    r = oncefs_set_file(&ofs, "/foo");
+    tag = (oncefs_tag_t) {.seq = 2, .operation = 2}; // data
+    oncefs_data_t data = {.node = 1, .fill = 5, .offset = 0};
+    r = io_write3(&io, 2, &tag, sizeof(tag), &data, sizeof(data), "Hello", 5);
     if (r != 0) { return r; }
 
-    r = oncefs_set_data(&ofs, 1, data, count, 0);
+    tag = (oncefs_tag_t) {.seq = 3, .operation = 100}; // never written
+    r = io_write(&io, 3, &tag, sizeof(tag));
     if (r != 0) { return r; }
 
-    // Unrelated
-    r = oncefs_set_file(&ofs, "/bar");
-    if (r != 0) { return r; }
-    r = oncefs_set_data(&ofs, 2, "bork bork bork", 14, 0);
+    oncefs_t ofs;
+    r = oncefs_init(&ofs, &io, 0); // don't format
     if (r != 0) { return r; }
 
-    // Truncate
-    int cutoff = 5000;
+    if (ofs.version != ONCEFS_VERSION_LEGACY) { return -400; }
 
-    r = oncefs_del_data(&ofs, 1, cutoff);
+    // Migrate
+    io_t target;
+    r = io_init(&target, &io_config);
     if (r != 0) { return r; }
 
-    char expected[4096];
-    oncefs_dumps(&ofs, expected);
+    r = oncefs_migrate(&ofs, &target);
+    if (r != 0) { return r; }
 
     oncefs_free(&ofs);
+    io_close(&io);
 
     // Load
-    r = oncefs_init(&ofs, &io, 0); // don't format
+    r = oncefs_init(&ofs, &target, 0); // don't format
     if (r != 0) { return r; }
 
-    char actual[4096];
-    oncefs_dumps(&ofs, actual);
-
-    // oncefs_dump(&ofs);
-
-    if (strcmp(actual, expected) != 0) {
-        printf("expected %s\n", expected);
-        printf("actual %s\n", actual);
-        return -400;
-    }
-
-    // Read
-    memset(data, 0, count);
-    int size = oncefs_get_data(&ofs, 1, data, count, 0);
-    if (size < 0) { return size; }
+    if (ofs.version != ONCEFS_VERSION) { return -400; }
 
-    // oncefs_dump(&ofs);
+    oncefs_stat_t stat;
+    r = oncefs_get_node(&ofs, "/foo", &stat);
+    if (r != 0) { return r; }
 
-    if(size != cutoff) { return -ECANCELED; }
+    char actual[6] = {0};
+    size_t amount = oncefs_get_data(&ofs, stat.node, actual, 5, 0);
+    if (amount != 5) { return -400; }
+    if (strcmp(actual, "Hello") != 0) { return -400; }
 
-    // Verify
-    for (int i = 0; i < count; i++) {
-        if (i >= cutoff) {
-            // This data should have been truncated
-            if (data[i] != 0) { return -400; }
-        } else {
-            // This data should exist
-            if (data[i] != (char) i) { return -400; }
-        }
-    }
+    oncefs_free(&ofs);
+    io_close(&target);
 
     return 0;
 }
 
-int _test_oncefs_load_del_data_missing() {
+int _test_oncefs_load_spill() {
     int r;
 
-    // Initialize
+    // Initialize with a budget small enough that every table spills
+    oncefs_config_t config = {.spill_path = "/tmp", .memory_budget = 1};
+
     io_t io;
     r = io_init(&io, &io_config);
     if (r != 0) { return r; }
 
     oncefs_t ofs;
-    r = oncefs_init(&ofs, &io, 1); // format
+    r = oncefs_init2(&ofs, &io, 1, &config); // format
     if (r != 0) { return r; }
 
     // Setup
     r = oncefs_set_file(&ofs, "/foo");
     if (r != 0) { return r; }
 
-    r = oncefs_set_data(&ofs, 1, "Hello world!", 12, 0);
-    if (r != 0) { return r; }
-
-    // Truncating a non-existing node should error
-    r = oncefs_del_data(&ofs, 2, 5);
-    if (r == 0) { return r; }
+    size_t count = 1024 * 20;
+    char data[count];
+    for (int i = 0; i < count; i++) {
+        data[i] = (char) i;
+    }
 
-    // Force overwriting node declaration
-    ofs.next_block_id = 1;
-    r = oncefs_del_data(&ofs, 1, 5);
+    r = oncefs_set_data(&ofs, 1, data, count, 0);
     if (r != 0) { return r; }
 
-    // oncefs_dump(&ofs);
+    if (ofs.blocks.rows.spill_fd == -1) { return -400; }
+
+    char expected[5120];
+    oncefs_dumps(&ofs, expected);
 
     oncefs_free(&ofs);
 
-    // When loading, truncating a non-existing node should not error
-    r = oncefs_init(&ofs, &io, 0); // don't format
+    // Load
+    r = oncefs_init2(&ofs, &io, 0, &config); // don't format
     if (r != 0) { return r; }
 
+    char actual[5120];
+    oncefs_dumps(&ofs, actual);
+
+    if (strcmp(actual, expected) != 0) { return -400; }
+
+    // Read
+    memset(data, 0, count);
+    size_t amount = oncefs_get_data(&ofs, 1, data, count, 0);
+    if (amount != count) { return -400; }
+
+    // Verify
+    for (int i = 0; i < count; i++) {
+        if (data[i] != (char) i) { return -400; }
+    }
+
     oncefs_free(&ofs);
 
     return 0;
 }
+
 // Framework code
 
 void _runner(const char *name, const int (*func)()) {
@@ -1234,7 +3267,17 @@ void _runner(const char *name, const int (*func)()) {
 
 void test_unit() {
     //_runner("_test_io_file", &_test_io_file); // !! requires manual setup
+    _runner("_test_ring", &_test_ring);
     _runner("_test_io_memory", &_test_io_memory);
+    _runner("_test_io_mmap", &_test_io_mmap);
+    _runner("_test_io_queue_memory", &_test_io_queue_memory);
+    _runner("_test_io_queue_uring", &_test_io_queue_uring);
+    _runner("_test_io_file_vectored", &_test_io_file_vectored);
+    _runner("_test_io_blocks", &_test_io_blocks);
+    _runner("_test_io_split", &_test_io_split);
+    _runner("_test_io_sim", &_test_io_sim);
+    _runner("_test_io_stats", &_test_io_stats);
+    _runner("_test_io_sync_group", &_test_io_sync_group);
     _runner("_test_oncefs_init", &_test_oncefs_init);
     _runner("_test_oncefs_format", &_test_oncefs_format);
     _runner("_test_oncefs_set_file", &_test_oncefs_set_file);
@@ -1246,6 +3289,7 @@ void test_unit() {
     _runner("_test_oncefs_get_node", &_test_oncefs_get_node);
     _runner("_test_oncefs_get_node_size", &_test_oncefs_get_node);
     _runner("_test_oncefs_get_dir", &_test_oncefs_get_dir);
+    _runner("_test_oncefs_get_dir_after", &_test_oncefs_get_dir_after);
     _runner("_test_oncefs_get_link", &_test_oncefs_get_link);
     _runner("_test_oncefs_del_file", &_test_oncefs_del_file);
     _runner("_test_oncefs_del_dir", &_test_oncefs_del_dir);
@@ -1254,6 +3298,17 @@ void test_unit() {
     _runner("_test_oncefs_del_data", &_test_oncefs_del_data);
     _runner("_test_oncefs_del_data_rare", &_test_oncefs_del_data_rare);
     _runner("_test_oncefs_move_file", &_test_oncefs_move_file);
+    _runner("_test_oncefs_extents", &_test_oncefs_extents);
+    _runner("_test_oncefs_seek", &_test_oncefs_seek);
+    _runner("_test_oncefs_allocate", &_test_oncefs_allocate);
+    _runner("_test_oncefs_copy_data", &_test_oncefs_copy_data);
+    _runner("_test_oncefs_handle", &_test_oncefs_handle);
+    _runner("_test_oncefs_set_data_in_place", &_test_oncefs_set_data_in_place);
+    _runner("_test_oncefs_set_data_in_place_fail", &_test_oncefs_set_data_in_place_fail);
+    _runner("_test_oncefs_set_data_fail", &_test_oncefs_set_data_fail);
+    _runner("_test_oncefs_lookup", &_test_oncefs_lookup);
+    _runner("_test_oncefs_threads", &_test_oncefs_threads);
+    _runner("_test_oncefs_writer", &_test_oncefs_writer);
     _runner("_test_oncefs_load_state", &_test_oncefs_load_state);
     _runner("_test_oncefs_load_get_node", &_test_oncefs_load_get_node);
     _runner("_test_oncefs_load_del_node", &_test_oncefs_load_del_node);
@@ -1264,6 +3319,19 @@ void test_unit() {
     _runner("_test_oncefs_load_get_data", &_test_oncefs_load_get_data);
     _runner("_test_oncefs_load_get_data_overlay", &_test_oncefs_load_get_data_overlay);
     _runner("_test_oncefs_load_get_data_large", &_test_oncefs_load_get_data_large);
+    _runner("_test_oncefs_load_mmap", &_test_oncefs_load_mmap);
+    _runner("_test_oncefs_load_uring", &_test_oncefs_load_uring);
+    _runner("_test_oncefs_load_direct", &_test_oncefs_load_direct);
+    _runner("_test_oncefs_load_split", &_test_oncefs_load_split);
+    _runner("_test_oncefs_packed", &_test_oncefs_packed);
+    _runner("_test_oncefs_format_epoch", &_test_oncefs_format_epoch);
+    _runner("_test_oncefs_format_over_v1", &_test_oncefs_format_over_v1);
+    _runner("_test_oncefs_amplification", &_test_oncefs_amplification);
+    _runner("_test_oncefs_discard", &_test_oncefs_discard);
+    _runner("_test_oncefs_discard_max", &_test_oncefs_discard_max);
+    _runner("_test_oncefs_discard_reuse", &_test_oncefs_discard_reuse);
+    _runner("_test_oncefs_migrate", &_test_oncefs_migrate);
+    _runner("_test_oncefs_load_spill", &_test_oncefs_load_spill);
 }
 
 int main(int argc, char **argv) {
@@ -620,6 +620,159 @@ class TestFuse(TestBase):
         self.assertEqual(os.path.getmtime(path), expected)
         self.assertEqual(os.path.getctime(path), expected)
 
+    def test_durability(self):
+        """
+        Test choosing a durability mode and reading it back.
+        """
+        self.assertEqual(
+            os.getxattr("mountpoint", "user.oncefs.durability"), b"strict"
+        )
+
+        subprocess.check_call(["fusermount", "-u", "mountpoint"])
+        subprocess.check_call(
+            [
+                "./fuse",
+                "--durability=periodic,100",
+                TEST_CONTAINER_PATH,
+                "mountpoint",
+            ]
+        )
+
+        self.assertEqual(
+            os.getxattr("mountpoint", "user.oncefs.durability"),
+            b"periodic,100ms,64MiB",
+        )
+
+        expected = "Hello world!"
+        with open("mountpoint/foo", "w") as output_stream:
+            output_stream.write(expected)
+
+        # Flushed in the background, and again on unmount
+        time.sleep(0.2)
+        self._remount()
+
+        with open("mountpoint/foo") as input_stream:
+            actual = input_stream.read()
+
+        self.assertEqual(actual, expected)
+
+    def test_write_read_tuned(self):
+        """
+        Test large writes through the writeback cache and splicing, then reading.
+        """
+        subprocess.check_call(["fusermount", "-u", "mountpoint"])
+        subprocess.check_call(
+            [
+                "./fuse",
+                "--writeback",
+                "--splice",
+                "--max-io=1024",
+                "--max-background=32",
+                TEST_CONTAINER_PATH,
+                "mountpoint",
+            ]
+        )
+
+        expected = os.urandom(int(TEST_CONTAINER_SIZE_BYTES * 0.3))
+        with open("mountpoint/foo", "wb") as output_stream:
+            output_stream.write(expected)
+
+        with open("mountpoint/foo", "rb") as input_stream:
+            actual = input_stream.read()
+
+        self.assertEqual(actual, expected)
+
+        self._remount()
+
+        with open("mountpoint/foo", "rb") as input_stream:
+            actual = input_stream.read()
+
+        self.assertEqual(actual, expected)
+
+    def test_list_large(self):
+        """
+        Test listing a directory over many batches, with attributes.
+        """
+        os.mkdir("mountpoint/dir")
+
+        expected = []
+        for i in range(2000):
+            name = f"file-with-a-longer-name-{i:05}"
+            with open(f"mountpoint/dir/{name}", "wb") as output_stream:
+                output_stream.write(b"x" * (i % 7))
+            expected.append((name, i % 7))
+
+        actual = [
+            (entry.name, entry.stat().st_size)
+            for entry in os.scandir("mountpoint/dir")
+        ]
+
+        self.assertEqual(sorted(actual), expected)
+
+    def test_long_timeouts(self):
+        """
+        Test changes stay visible while the kernel caches names and attributes.
+        """
+        subprocess.check_call(["fusermount", "-u", "mountpoint"])
+        subprocess.check_call(
+            [
+                "./fuse",
+                "--entry-timeout=60",
+                "--attr-timeout=60",
+                "--negative-timeout=60",
+                TEST_CONTAINER_PATH,
+                "mountpoint",
+            ]
+        )
+
+        self.assertFalse(os.path.exists("mountpoint/foo"))
+
+        with open("mountpoint/foo", "wb") as output_stream:
+            output_stream.write(b"Hello")
+        self.assertEqual(os.stat("mountpoint/foo").st_size, 5)
+
+        # Opening for writing truncates without the kernel asking for it
+        with open("mountpoint/foo", "r+b"):
+            pass
+        time.sleep(0.1)
+        self.assertEqual(os.stat("mountpoint/foo").st_size, 0)
+
+        os.mkdir("mountpoint/dir")
+        os.rename("mountpoint/foo", "mountpoint/dir/bar")
+        self.assertFalse(os.path.exists("mountpoint/foo"))
+        self.assertTrue(os.path.exists("mountpoint/dir/bar"))
+
+        os.unlink("mountpoint/dir/bar")
+        self.assertFalse(os.path.exists("mountpoint/dir/bar"))
+        self.assertEqual(os.listdir("mountpoint/dir"), [])
+
+    def test_allocate_copy_seek(self):
+        """
+        Test preallocating, copying within the mount, and seeking over holes.
+        """
+        with open("mountpoint/foo", "wb") as output_stream:
+            output_stream.write(b"Hello")
+            output_stream.seek(100000)
+            output_stream.write(b"world")
+
+        with open("mountpoint/foo", "rb") as input_stream:
+            fd = input_stream.fileno()
+            self.assertEqual(os.lseek(fd, 0, os.SEEK_HOLE), 5)
+            self.assertEqual(os.lseek(fd, 5, os.SEEK_DATA), 100000)
+
+            with open("mountpoint/bar", "wb") as output_stream:
+                copied = os.copy_file_range(fd, output_stream.fileno(), 200000)
+                self.assertEqual(copied, 100005)
+
+        with open("mountpoint/bar", "rb") as input_stream:
+            actual = input_stream.read()
+        self.assertEqual(actual, b"Hello" + bytes(99995) + b"world")
+
+        # Growing a file isn't supported, so the C library writes zeros instead
+        with open("mountpoint/baz", "wb") as output_stream:
+            os.posix_fallocate(output_stream.fileno(), 0, 50000)
+        self.assertEqual(os.stat("mountpoint/baz").st_size, 50000)
+
 
 if __name__ == "__main__":
     unittest.main()